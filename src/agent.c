@@ -0,0 +1,421 @@
+/*
+ * Copyright (C) 2010 Xavier Claessens <xclaesse@gmail.com>
+ * Copyright (C) 2010 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+#include <gio/gunixconnection.h>
+#include <telepathy-glib/telepathy-glib.h>
+
+#include "agent.h"
+#include "client-helpers.h"
+
+/* The agent is a resident process keeping the account manager, connections,
+ * contact lists and capabilities prepared, so ssh-contact runs don't have to
+ * download them each time. telepathy-glib keeps those proxies up to date from
+ * D-Bus signals as accounts connect and contacts come and go.
+ *
+ * A client connects to its socket and sends "CONTACT\tACCOUNT\n", ACCOUNT
+ * being empty to use any account having that contact. The agent answers with
+ * the tube's socket as SCM_RIGHTS, or "error: MESSAGE\n", and keeps the tube's
+ * channel until the client hangs up. */
+
+typedef struct
+{
+  GMainLoop *loop;
+  gchar *socket_path;
+  GSocketListener *listener;
+  TpAccountManager *manager;
+  gboolean manager_ready;
+
+  /* Requests that came before the account manager was prepared */
+  GList *pending;
+
+  GError *error;
+} AgentContext;
+
+typedef struct
+{
+  AgentContext *context;
+  GSocketConnection *connection;
+  GDataInputStream *input;
+
+  gchar *contact_id;
+  gchar *account_path;
+  TpChannel *channel;
+} AgentRequest;
+
+static void
+agent_quit (AgentContext *context,
+    const GError *error)
+{
+  if (error != NULL && context->error == NULL)
+    context->error = g_error_copy (error);
+
+  g_main_loop_quit (context->loop);
+}
+
+static void
+agent_request_free (AgentRequest *request)
+{
+  if (request->channel != NULL &&
+      tp_proxy_get_invalidated (request->channel) == NULL)
+    tp_channel_close_async (request->channel, NULL, NULL);
+
+  tp_clear_object (&request->connection);
+  tp_clear_object (&request->input);
+  tp_clear_object (&request->channel);
+  g_free (request->contact_id);
+  g_free (request->account_path);
+
+  g_slice_free (AgentRequest, request);
+}
+
+static void
+agent_request_fail (AgentRequest *request,
+    const gchar *message)
+{
+  GOutputStream *output;
+  gchar *line;
+
+  g_debug ("Request for %s failed: %s", request->contact_id != NULL ?
+      request->contact_id : "nobody", message);
+
+  output = g_io_stream_get_output_stream (G_IO_STREAM (request->connection));
+  line = g_strdup_printf ("error: %s\n", message);
+  g_output_stream_write_all (output, line, strlen (line), NULL, NULL, NULL);
+  g_free (line);
+
+  agent_request_free (request);
+}
+
+static void
+request_hangup_cb (GObject *source_object,
+    GAsyncResult *res,
+    gpointer user_data)
+{
+  AgentRequest *request = user_data;
+  gchar *line;
+
+  /* The client doesn't say anything after its request, this is its end */
+  line = g_data_input_stream_read_line_finish (request->input, res, NULL,
+      NULL);
+  g_free (line);
+
+  g_debug ("Session to %s is over", request->contact_id);
+  agent_request_free (request);
+}
+
+static void
+request_tube_cb (GObject *source_object,
+    GAsyncResult *res,
+    gpointer user_data)
+{
+  AgentRequest *request = user_data;
+  GSocketConnection *tube_connection;
+  GSocket *socket;
+  GError *error = NULL;
+
+  tube_connection = _client_create_tube_finish (res, &request->channel,
+      &error);
+  if (tube_connection == NULL)
+    {
+      agent_request_fail (request, error->message);
+      g_clear_error (&error);
+      return;
+    }
+
+  socket = g_socket_connection_get_socket (tube_connection);
+  if (!g_unix_connection_send_fd (G_UNIX_CONNECTION (request->connection),
+      g_socket_get_fd (socket), NULL, &error))
+    {
+      g_debug ("Can't give the tube to %s: %s", request->contact_id,
+          error->message);
+      g_clear_error (&error);
+      agent_request_free (request);
+      goto OUT;
+    }
+
+  /* Telepathy keeps a ref on the tube's connection. Close our copy of the
+   * socket so the client's is the only one, the tube ends with its session. */
+  g_io_stream_close (G_IO_STREAM (tube_connection), NULL, NULL);
+
+  g_data_input_stream_read_line_async (request->input, G_PRIORITY_DEFAULT,
+      NULL, request_hangup_cb, request);
+
+OUT:
+  g_object_unref (tube_connection);
+}
+
+static gboolean
+account_has_contact (TpAccount *account,
+    const gchar *contact_id)
+{
+  TpConnection *connection;
+  GPtrArray *contacts;
+  gboolean found = FALSE;
+  guint i;
+
+  connection = tp_account_get_connection (account);
+  if (connection == NULL ||
+      !_capabilities_has_stream_tube (
+          tp_connection_get_capabilities (connection)))
+    return FALSE;
+
+  contacts = tp_connection_dup_contact_list (connection);
+  for (i = 0; i < contacts->len && !found; i++)
+    {
+      TpContact *contact = g_ptr_array_index (contacts, i);
+
+      found = !tp_strdiff (tp_contact_get_identifier (contact), contact_id) &&
+          _capabilities_has_stream_tube (tp_contact_get_capabilities (contact));
+    }
+  g_ptr_array_unref (contacts);
+
+  return found;
+}
+
+/* The account of the request, or the first one where its contact can handle
+ * our tube */
+static TpAccount *
+agent_find_account (AgentContext *context,
+    AgentRequest *request)
+{
+  TpAccount *found = NULL;
+  GList *accounts;
+  GList *l;
+
+  accounts = tp_account_manager_get_valid_accounts (context->manager);
+  for (l = accounts; l != NULL && found == NULL; l = l->next)
+    {
+      TpAccount *account = l->data;
+
+      if (request->account_path != NULL)
+        {
+          if (!tp_strdiff (tp_proxy_get_object_path (account),
+              request->account_path))
+            found = account;
+        }
+      else if (account_has_contact (account, request->contact_id))
+        {
+          found = account;
+        }
+    }
+  g_list_free (accounts);
+
+  return found;
+}
+
+static void
+agent_request_start (AgentRequest *request)
+{
+  TpAccount *account;
+
+  account = agent_find_account (request->context, request);
+  if (account == NULL)
+    {
+      agent_request_fail (request, request->account_path != NULL ?
+          "Unknown account" : "No suitable contact");
+      return;
+    }
+
+  g_debug ("Creating a tube to %s on %s", request->contact_id,
+      tp_proxy_get_object_path (account));
+  _client_create_tube_async (account, request->contact_id, TUBE_SERVICE,
+      request_tube_cb, request);
+}
+
+static void
+request_line_cb (GObject *source_object,
+    GAsyncResult *res,
+    gpointer user_data)
+{
+  AgentRequest *request = user_data;
+  AgentContext *context = request->context;
+  gchar *line;
+  gchar **parts = NULL;
+
+  line = g_data_input_stream_read_line_finish (request->input, res, NULL,
+      NULL);
+  if (line == NULL)
+    {
+      agent_request_free (request);
+      return;
+    }
+
+  parts = g_strsplit (line, "\t", 2);
+  if (parts[0] == NULL || parts[0][0] == '\0')
+    {
+      agent_request_fail (request, "Malformed request");
+      goto OUT;
+    }
+
+  request->contact_id = g_strdup (parts[0]);
+  if (parts[1] != NULL && parts[1][0] != '\0')
+    request->account_path = g_strdup (parts[1]);
+
+  if (context->manager_ready)
+    agent_request_start (request);
+  else
+    context->pending = g_list_append (context->pending, request);
+
+OUT:
+  g_strfreev (parts);
+  g_free (line);
+}
+
+static void
+agent_accepted_cb (GObject *source_object,
+    GAsyncResult *res,
+    gpointer user_data)
+{
+  AgentContext *context = user_data;
+  GSocketConnection *connection;
+  AgentRequest *request;
+  GError *error = NULL;
+
+  connection = g_socket_listener_accept_finish (
+      G_SOCKET_LISTENER (source_object), res, NULL, &error);
+  if (connection == NULL)
+    {
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        agent_quit (context, error);
+      g_clear_error (&error);
+      return;
+    }
+
+  request = g_slice_new0 (AgentRequest);
+  request->context = context;
+  request->connection = connection;
+  request->input = g_data_input_stream_new (
+      g_io_stream_get_input_stream (G_IO_STREAM (connection)));
+  g_data_input_stream_read_line_async (request->input, G_PRIORITY_DEFAULT,
+      NULL, request_line_cb, request);
+
+  g_socket_listener_accept_async (context->listener, NULL,
+      agent_accepted_cb, context);
+}
+
+static void
+manager_prepared_cb (GObject *object,
+    GAsyncResult *res,
+    gpointer user_data)
+{
+  AgentContext *context = user_data;
+  GList *pending;
+  GList *l;
+  GError *error = NULL;
+
+  if (!tp_proxy_prepare_finish (TP_PROXY (object), res, &error))
+    {
+      agent_quit (context, error);
+      g_clear_error (&error);
+      return;
+    }
+
+  g_debug ("Accounts are prepared, serving requests");
+  context->manager_ready = TRUE;
+
+  pending = context->pending;
+  context->pending = NULL;
+  for (l = pending; l != NULL; l = l->next)
+    agent_request_start (l->data);
+  g_list_free (pending);
+}
+
+gchar *
+_agent_socket_path (void)
+{
+  return g_build_filename (g_get_user_runtime_dir (), "ssh-contact", "agent",
+      NULL);
+}
+
+gboolean
+_agent_run (GError **error)
+{
+  AgentContext context = { 0, };
+  TpDBusDaemon *dbus = NULL;
+  TpSimpleClientFactory *factory = NULL;
+
+  context.loop = g_main_loop_new (NULL, FALSE);
+  context.socket_path = _agent_socket_path ();
+
+  context.listener = _client_listen_unix (context.socket_path,
+      &context.error);
+  if (context.listener == NULL)
+    {
+      /* Don't remove the socket of the agent already running */
+      tp_clear_pointer (&context.socket_path, g_free);
+      goto OUT;
+    }
+
+  dbus = tp_dbus_daemon_dup (&context.error);
+  if (dbus == NULL)
+    goto OUT;
+
+  /* Unlike the client, which prepares accounts one at a time to use the first
+   * one that's ready, we can wait for all of them once */
+  factory = (TpSimpleClientFactory *) tp_automatic_client_factory_new (dbus);
+  tp_simple_client_factory_add_account_features_varargs (factory,
+      TP_ACCOUNT_FEATURE_CONNECTION,
+      0);
+  tp_simple_client_factory_add_connection_features_varargs (factory,
+      TP_CONNECTION_FEATURE_CONTACT_LIST,
+      TP_CONNECTION_FEATURE_CAPABILITIES,
+      0);
+  tp_simple_client_factory_add_contact_features_varargs (factory,
+      TP_CONTACT_FEATURE_ALIAS,
+      TP_CONTACT_FEATURE_CAPABILITIES,
+      TP_CONTACT_FEATURE_INVALID);
+
+  context.manager = tp_account_manager_new_with_factory (factory);
+  tp_proxy_prepare_async (context.manager, NULL, manager_prepared_cb,
+      &context);
+
+  /* Requests are read meanwhile, and wait for the accounts */
+  g_socket_listener_accept_async (context.listener, NULL,
+      agent_accepted_cb, &context);
+
+  g_main_loop_run (context.loop);
+
+OUT:
+  if (context.socket_path != NULL)
+    g_unlink (context.socket_path);
+
+  g_list_free_full (context.pending, (GDestroyNotify) agent_request_free);
+
+  tp_clear_pointer (&context.loop, g_main_loop_unref);
+  tp_clear_object (&context.listener);
+  tp_clear_object (&context.manager);
+  tp_clear_object (&factory);
+  tp_clear_object (&dbus);
+  g_free (context.socket_path);
+
+  if (context.error != NULL)
+    {
+      g_propagate_error (error, context.error);
+      return FALSE;
+    }
+
+  return TRUE;
+}
@@ -0,0 +1,684 @@
+/*
+ * Copyright (C) 2010 Xavier Claessens <xclaesse@gmail.com>
+ * Copyright (C) 2010 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include <gio/gunixsocketaddress.h>
+
+#include "backend.h"
+#include "relay.h"
+
+/* Seconds during which a backend that failed is considered down */
+#define BACKEND_RETRY_INTERVAL 5
+
+/* Default port when the address does not specify one */
+#define BACKEND_DEFAULT_PORT 22
+
+struct _Backend
+{
+  gchar *address;
+  GSocketConnectable *connectable;
+  GSocketClient *client;
+  guint timeout;
+
+  /* Monotonic time until which the backend is considered down, 0 when up */
+  gint64 down_until;
+  /* TRUE while a connection attempt checks if a down backend is back */
+  gboolean probing;
+
+  /* Share of the connections it gets in its group, relative to others */
+  guint weight;
+  /* Smooth weighted round-robin state, see backend_group_pick_weighted() */
+  gint64 current_weight;
+
+  /* Connecting and connected, updated atomically since connections may be
+   * released from relay threads */
+  gint n_active;
+  guint64 n_connected;
+  guint64 n_failed;
+};
+
+struct _BackendGroup
+{
+  GPtrArray *backends;
+  BackendBalance balance;
+};
+
+static const gchar *balance_names[] = {
+  "least-connections",
+  "weighted",
+};
+
+typedef struct
+{
+  BackendGroup *group;
+  /* Backends of the group already tried, by index */
+  gboolean *tried;
+  Backend *current;
+  GError *error;
+  GSocketConnection *connection;
+} GroupConnectData;
+
+typedef struct
+{
+  Backend *backend;
+  GCancellable *cancellable;
+  guint timeout_id;
+  gboolean timed_out;
+  GSocketConnection *connection;
+} ConnectData;
+
+static void
+connect_data_free (ConnectData *data)
+{
+  if (data->timeout_id != 0)
+    g_source_remove (data->timeout_id);
+
+  g_clear_object (&data->cancellable);
+  g_clear_object (&data->connection);
+
+  g_slice_free (ConnectData, data);
+}
+
+Backend *
+_backend_new (const gchar *address,
+    guint timeout,
+    GError **error)
+{
+  Backend *backend;
+  GSocketConnectable *connectable;
+
+  /* Either "unix:/path/to/socket" or "host[:port]" */
+  if (g_str_has_prefix (address, "unix:"))
+    {
+      connectable = G_SOCKET_CONNECTABLE (g_unix_socket_address_new (
+          address + strlen ("unix:")));
+    }
+  else
+    {
+      connectable = g_network_address_parse (address, BACKEND_DEFAULT_PORT,
+          error);
+      if (connectable == NULL)
+        return NULL;
+    }
+
+  backend = g_slice_new0 (Backend);
+  backend->address = g_strdup (address);
+  backend->connectable = connectable;
+  backend->timeout = timeout;
+  backend->weight = 1;
+
+  /* The timeout is handled by ourself because GSocketClient would also apply
+   * it to I/O on the resulting connection, idle sessions would get killed. */
+  backend->client = g_socket_client_new ();
+  g_socket_client_set_enable_proxy (backend->client, FALSE);
+
+  return backend;
+}
+
+void
+_backend_free (Backend *backend)
+{
+  if (backend == NULL)
+    return;
+
+  g_free (backend->address);
+  g_object_unref (backend->connectable);
+  g_object_unref (backend->client);
+
+  g_slice_free (Backend, backend);
+}
+
+const gchar *
+_backend_get_address (Backend *backend)
+{
+  return backend->address;
+}
+
+gboolean
+_backend_is_available (Backend *backend)
+{
+  if (backend->down_until == 0)
+    return TRUE;
+
+  /* Only one connection at a time may check if the backend is back */
+  if (backend->probing)
+    return FALSE;
+
+  return g_get_monotonic_time () >= backend->down_until;
+}
+
+static void
+backend_set_up (Backend *backend)
+{
+  if (backend->down_until != 0)
+    g_debug ("Backend %s is back up", backend->address);
+
+  backend->down_until = 0;
+  backend->probing = FALSE;
+}
+
+static void
+backend_set_down (Backend *backend)
+{
+  if (backend->down_until == 0)
+    g_debug ("Backend %s is down", backend->address);
+
+  backend->down_until = g_get_monotonic_time () +
+      BACKEND_RETRY_INTERVAL * G_USEC_PER_SEC;
+  backend->probing = FALSE;
+}
+
+static GQuark
+backend_connection_quark (void)
+{
+  static GQuark quark = 0;
+
+  if (G_UNLIKELY (quark == 0))
+    quark = g_quark_from_static_string ("ssh-contact-backend");
+
+  return quark;
+}
+
+static void
+backend_connection_released (Backend *backend)
+{
+  g_atomic_int_add (&backend->n_active, -1);
+}
+
+static gboolean
+connect_timeout_cb (gpointer user_data)
+{
+  ConnectData *data = user_data;
+
+  data->timeout_id = 0;
+  data->timed_out = TRUE;
+  g_cancellable_cancel (data->cancellable);
+
+  return FALSE;
+}
+
+static void
+connect_cb (GObject *source_object,
+    GAsyncResult *res,
+    gpointer user_data)
+{
+  GSimpleAsyncResult *simple = user_data;
+  ConnectData *data;
+  GError *error = NULL;
+
+  data = g_simple_async_result_get_op_res_gpointer (simple);
+
+  data->connection = g_socket_client_connect_finish (
+      G_SOCKET_CLIENT (source_object), res, &error);
+
+  if (data->timeout_id != 0)
+    {
+      g_source_remove (data->timeout_id);
+      data->timeout_id = 0;
+    }
+
+  if (data->connection == NULL)
+    {
+      if (data->timed_out)
+        {
+          g_clear_error (&error);
+          error = g_error_new (G_IO_ERROR, G_IO_ERROR_TIMED_OUT,
+              "Connection to %s timed out", data->backend->address);
+        }
+
+      /* Running out of file descriptors is our problem, not the backend's */
+      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_TOO_MANY_OPEN_FILES))
+        {
+          data->backend->probing = FALSE;
+        }
+      else
+        {
+          backend_set_down (data->backend);
+          data->backend->n_failed++;
+        }
+      g_simple_async_result_take_error (simple, error);
+
+      g_atomic_int_add (&data->backend->n_active, -1);
+    }
+  else
+    {
+      _relay_set_nodelay (g_socket_connection_get_socket (data->connection));
+      backend_set_up (data->backend);
+
+      /* It stays active until the connection is finalized, whoever drops
+       * the last ref */
+      data->backend->n_connected++;
+      g_object_set_qdata_full (G_OBJECT (data->connection),
+          backend_connection_quark (), data->backend,
+          (GDestroyNotify) backend_connection_released);
+    }
+
+  g_simple_async_result_complete (simple);
+  g_object_unref (simple);
+}
+
+void
+_backend_connect_async (Backend *backend,
+    GAsyncReadyCallback callback,
+    gpointer user_data)
+{
+  GSimpleAsyncResult *simple;
+  ConnectData *data;
+
+  simple = g_simple_async_result_new (NULL, callback, user_data,
+      _backend_connect_async);
+
+  /* Fail fast instead of making each tube wait for the timeout */
+  if (!_backend_is_available (backend))
+    {
+      g_simple_async_result_set_error (simple, G_IO_ERROR,
+          G_IO_ERROR_HOST_UNREACHABLE, "Backend %s is down",
+          backend->address);
+      g_simple_async_result_complete_in_idle (simple);
+      g_object_unref (simple);
+      return;
+    }
+
+  if (backend->down_until != 0)
+    backend->probing = TRUE;
+
+  /* Counted from now on, so a burst of tubes doesn't all go to the backend
+   * that had the fewest connections before it */
+  g_atomic_int_inc (&backend->n_active);
+
+  data = g_slice_new0 (ConnectData);
+  data->backend = backend;
+  data->cancellable = g_cancellable_new ();
+  if (backend->timeout > 0)
+    data->timeout_id = g_timeout_add_seconds (backend->timeout,
+        connect_timeout_cb, data);
+  g_simple_async_result_set_op_res_gpointer (simple, data,
+      (GDestroyNotify) connect_data_free);
+
+  g_socket_client_connect_async (backend->client, backend->connectable,
+      data->cancellable, connect_cb, simple);
+}
+
+GSocketConnection *
+_backend_connect_finish (Backend *backend,
+    GAsyncResult *res,
+    GError **error)
+{
+  GSimpleAsyncResult *simple;
+  ConnectData *data;
+
+  g_return_val_if_fail (g_simple_async_result_is_valid (res, NULL,
+      _backend_connect_async), NULL);
+
+  simple = G_SIMPLE_ASYNC_RESULT (res);
+
+  if (g_simple_async_result_propagate_error (simple, error))
+    return NULL;
+
+  data = g_simple_async_result_get_op_res_gpointer (simple);
+
+  return g_object_ref (data->connection);
+}
+
+void
+_backend_get_counts (Backend *backend,
+    guint *n_active,
+    guint64 *n_connected,
+    guint64 *n_failed)
+{
+  *n_active = g_atomic_int_get (&backend->n_active);
+  *n_connected = backend->n_connected;
+  *n_failed = backend->n_failed;
+}
+
+gboolean
+_backend_balance_from_string (const gchar *str,
+    BackendBalance *balance)
+{
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (balance_names); i++)
+    {
+      if (g_ascii_strcasecmp (str, balance_names[i]) == 0)
+        {
+          *balance = i;
+          return TRUE;
+        }
+    }
+
+  return FALSE;
+}
+
+/* Parse ADDRESS[=WEIGHT] specs, the weight is after the last '=' */
+BackendGroup *
+_backend_group_new (gchar **specs,
+    BackendBalance balance,
+    guint timeout,
+    GError **error)
+{
+  BackendGroup *group;
+  guint i;
+
+  g_return_val_if_fail (specs != NULL && specs[0] != NULL, NULL);
+
+  group = g_slice_new0 (BackendGroup);
+  group->backends = g_ptr_array_new_with_free_func (
+      (GDestroyNotify) _backend_free);
+  group->balance = balance;
+
+  for (i = 0; specs[i] != NULL; i++)
+    {
+      const gchar *sep = strrchr (specs[i], '=');
+      Backend *backend;
+      gchar *address;
+      guint64 weight = 1;
+
+      if (sep != NULL)
+        {
+          gchar *end = NULL;
+
+          weight = g_ascii_strtoull (sep + 1, &end, 10);
+          if (sep == specs[i] || sep[1] == '\0' || *end != '\0' ||
+              weight == 0 || weight > G_MAXUINT16)
+            {
+              g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                  "Invalid backend '%s', expected ADDRESS[=WEIGHT]",
+                  specs[i]);
+              _backend_group_free (group);
+              return NULL;
+            }
+          address = g_strndup (specs[i], sep - specs[i]);
+        }
+      else
+        {
+          address = g_strdup (specs[i]);
+        }
+
+      backend = _backend_new (address, timeout, error);
+      g_free (address);
+      if (backend == NULL)
+        {
+          _backend_group_free (group);
+          return NULL;
+        }
+
+      backend->weight = weight;
+      g_ptr_array_add (group->backends, backend);
+    }
+
+  return group;
+}
+
+void
+_backend_group_free (BackendGroup *group)
+{
+  if (group == NULL)
+    return;
+
+  g_ptr_array_unref (group->backends);
+
+  g_slice_free (BackendGroup, group);
+}
+
+guint
+_backend_group_get_size (BackendGroup *group)
+{
+  return group->backends->len;
+}
+
+Backend *
+_backend_group_get (BackendGroup *group,
+    guint i)
+{
+  g_return_val_if_fail (i < group->backends->len, NULL);
+
+  return g_ptr_array_index (group->backends, i);
+}
+
+/* TRUE if at least one backend may take a connection */
+gboolean
+_backend_group_is_available (BackendGroup *group)
+{
+  guint i;
+
+  for (i = 0; i < group->backends->len; i++)
+    {
+      if (_backend_is_available (g_ptr_array_index (group->backends, i)))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+void
+_backend_group_log (BackendGroup *group)
+{
+  guint i;
+
+  for (i = 0; i < group->backends->len; i++)
+    {
+      Backend *backend = g_ptr_array_index (group->backends, i);
+
+      g_debug ("Backend %s: %s, weight %u, %d active, %" G_GUINT64_FORMAT
+          " connected, %" G_GUINT64_FORMAT " failed", backend->address,
+          backend->down_until == 0 ? "up" : "down", backend->weight,
+          g_atomic_int_get (&backend->n_active), backend->n_connected,
+          backend->n_failed);
+    }
+}
+
+/* Fewest active connections per unit of weight, the first one wins ties.
+ * Returns the index of the backend, -1 if none is available. */
+static gint
+backend_group_pick_least_connections (BackendGroup *group,
+    const gboolean *tried)
+{
+  Backend *best = NULL;
+  gint best_index = -1;
+  gint64 best_active = 0;
+  guint i;
+
+  for (i = 0; i < group->backends->len; i++)
+    {
+      Backend *backend = g_ptr_array_index (group->backends, i);
+      gint64 active;
+
+      if (tried[i] || !_backend_is_available (backend))
+        continue;
+
+      /* Compare active/weight without dividing */
+      active = g_atomic_int_get (&backend->n_active);
+      if (best == NULL ||
+          active * best->weight < best_active * backend->weight)
+        {
+          best = backend;
+          best_index = i;
+          best_active = active;
+        }
+    }
+
+  return best_index;
+}
+
+/* Smooth weighted round-robin: each candidate gains its weight, the richest
+ * is picked and pays the total. Backends get connections in proportion to
+ * their weights, interleaved rather than in bursts. */
+static gint
+backend_group_pick_weighted (BackendGroup *group,
+    const gboolean *tried)
+{
+  Backend *best = NULL;
+  gint best_index = -1;
+  gint64 total = 0;
+  guint i;
+
+  for (i = 0; i < group->backends->len; i++)
+    {
+      Backend *backend = g_ptr_array_index (group->backends, i);
+
+      if (tried[i] || !_backend_is_available (backend))
+        continue;
+
+      backend->current_weight += backend->weight;
+      total += backend->weight;
+
+      if (best == NULL || backend->current_weight > best->current_weight)
+        {
+          best = backend;
+          best_index = i;
+        }
+    }
+
+  if (best != NULL)
+    best->current_weight -= total;
+
+  return best_index;
+}
+
+static void
+group_connect_data_free (GroupConnectData *data)
+{
+  g_free (data->tried);
+  g_clear_error (&data->error);
+  g_clear_object (&data->connection);
+
+  g_slice_free (GroupConnectData, data);
+}
+
+static void backend_group_connect_next (GSimpleAsyncResult *simple);
+
+static void
+group_connect_cb (GObject *source_object,
+    GAsyncResult *res,
+    gpointer user_data)
+{
+  GSimpleAsyncResult *simple = user_data;
+  GroupConnectData *data;
+  GError *error = NULL;
+
+  data = g_simple_async_result_get_op_res_gpointer (simple);
+
+  data->connection = _backend_connect_finish (data->current, res, &error);
+  if (data->connection != NULL)
+    {
+      g_simple_async_result_complete (simple);
+      g_object_unref (simple);
+      return;
+    }
+
+  /* Another backend won't have more file descriptors for us */
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_TOO_MANY_OPEN_FILES))
+    {
+      g_simple_async_result_take_error (simple, error);
+      g_simple_async_result_complete (simple);
+      g_object_unref (simple);
+      return;
+    }
+
+  g_debug ("%s, trying the next backend", error->message);
+  g_clear_error (&data->error);
+  data->error = error;
+
+  backend_group_connect_next (simple);
+}
+
+/* Connect to the best backend not tried yet, or fail with the last error */
+static void
+backend_group_connect_next (GSimpleAsyncResult *simple)
+{
+  GroupConnectData *data;
+  gint i;
+
+  data = g_simple_async_result_get_op_res_gpointer (simple);
+
+  if (data->group->balance == BACKEND_BALANCE_WEIGHTED)
+    i = backend_group_pick_weighted (data->group, data->tried);
+  else
+    i = backend_group_pick_least_connections (data->group, data->tried);
+
+  if (i < 0)
+    {
+      if (data->error != NULL)
+        {
+          g_simple_async_result_take_error (simple, data->error);
+          data->error = NULL;
+        }
+      else
+        {
+          g_simple_async_result_set_error (simple, G_IO_ERROR,
+              G_IO_ERROR_HOST_UNREACHABLE, "All backends are down");
+        }
+
+      g_simple_async_result_complete_in_idle (simple);
+      g_object_unref (simple);
+      return;
+    }
+
+  data->tried[i] = TRUE;
+  data->current = g_ptr_array_index (data->group->backends, i);
+  _backend_connect_async (data->current, group_connect_cb, simple);
+}
+
+/* Connect to a backend of @group chosen by its balance policy. A backend
+ * that fails is marked down and the next one is tried, until one accepts or
+ * all of them failed. */
+void
+_backend_group_connect_async (BackendGroup *group,
+    GAsyncReadyCallback callback,
+    gpointer user_data)
+{
+  GSimpleAsyncResult *simple;
+  GroupConnectData *data;
+
+  simple = g_simple_async_result_new (NULL, callback, user_data,
+      _backend_group_connect_async);
+
+  data = g_slice_new0 (GroupConnectData);
+  data->group = group;
+  data->tried = g_new0 (gboolean, group->backends->len);
+  g_simple_async_result_set_op_res_gpointer (simple, data,
+      (GDestroyNotify) group_connect_data_free);
+
+  backend_group_connect_next (simple);
+}
+
+GSocketConnection *
+_backend_group_connect_finish (BackendGroup *group,
+    GAsyncResult *res,
+    GError **error)
+{
+  GSimpleAsyncResult *simple;
+  GroupConnectData *data;
+
+  g_return_val_if_fail (g_simple_async_result_is_valid (res, NULL,
+      _backend_group_connect_async), NULL);
+
+  simple = G_SIMPLE_ASYNC_RESULT (res);
+
+  if (g_simple_async_result_propagate_error (simple, error))
+    return NULL;
+
+  data = g_simple_async_result_get_op_res_gpointer (simple);
+
+  return g_object_ref (data->connection);
+}
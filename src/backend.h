@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2010 Xavier Claessens <xclaesse@gmail.com>
+ * Copyright (C) 2010 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA  02110-1301  USA
+ */
+
+#ifndef __BACKEND_H__
+#define __BACKEND_H__
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+typedef struct _Backend Backend;
+typedef struct _BackendGroup BackendGroup;
+
+/* How a BackendGroup chooses the backend of a new connection */
+typedef enum
+{
+  /* Fewest connections relative to its weight */
+  BACKEND_BALANCE_LEAST_CONNECTIONS,
+  /* Connections in proportion to weights, however long they last */
+  BACKEND_BALANCE_WEIGHTED,
+} BackendBalance;
+
+Backend *_backend_new (const gchar *address, guint timeout, GError **error);
+
+void _backend_free (Backend *backend);
+
+const gchar *_backend_get_address (Backend *backend);
+
+gboolean _backend_is_available (Backend *backend);
+
+void _backend_connect_async (Backend *backend, GAsyncReadyCallback callback,
+    gpointer user_data);
+
+GSocketConnection *_backend_connect_finish (Backend *backend,
+    GAsyncResult *res, GError **error);
+
+void _backend_get_counts (Backend *backend, guint *n_active,
+    guint64 *n_connected, guint64 *n_failed);
+
+gboolean _backend_balance_from_string (const gchar *str,
+    BackendBalance *balance);
+
+BackendGroup *_backend_group_new (gchar **specs, BackendBalance balance,
+    guint timeout, GError **error);
+
+void _backend_group_free (BackendGroup *group);
+
+guint _backend_group_get_size (BackendGroup *group);
+
+Backend *_backend_group_get (BackendGroup *group, guint i);
+
+gboolean _backend_group_is_available (BackendGroup *group);
+
+void _backend_group_log (BackendGroup *group);
+
+void _backend_group_connect_async (BackendGroup *group,
+    GAsyncReadyCallback callback, gpointer user_data);
+
+GSocketConnection *_backend_group_connect_finish (BackendGroup *group,
+    GAsyncResult *res, GError **error);
+
+G_END_DECLS
+
+#endif /* #ifndef __BACKEND_H__*/
@@ -0,0 +1,362 @@
+/*
+ * Copyright (C) 2010 Xavier Claessens <xclaesse@gmail.com>
+ * Copyright (C) 2010 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include "buffer-pool.h"
+
+/* Relay buffers of all sessions come from here. Sizes are rounded up to a
+ * power of two, and released buffers are kept on a free list per size so
+ * sessions reuse each other's memory instead of fragmenting the heap. The
+ * pool never hands out more than its cap, callers have to wait for other
+ * sessions to release memory. */
+
+/* Free buffers kept around for reuse, beyond that they are freed */
+#define BUFFER_POOL_CACHE_SIZE (8 * 1024 * 1024)
+
+#define BUFFER_POOL_N_CLASSES (sizeof (gsize) * 8)
+
+/* Free buffers are linked through their first bytes */
+#define BUFFER_POOL_MIN_CLASS 4
+
+typedef struct _FreeBuffer FreeBuffer;
+struct _FreeBuffer
+{
+  FreeBuffer *next;
+};
+
+typedef struct
+{
+  BufferPool *pool;
+  GMainContext *context;
+  BufferPoolReadyFunc func;
+  gpointer user_data;
+  /* Bytes it failed to get */
+  gsize size;
+  /* Idle source calling @func once memory got released */
+  GSource *source;
+} Waiter;
+
+struct _BufferPool
+{
+  GMutex mutex;
+
+  /* 0 means no limit */
+  gsize cap;
+  /* Bytes handed out, and kept in free lists */
+  gsize used;
+  gsize cached;
+  FreeBuffer *free_lists[BUFFER_POOL_N_CLASSES];
+
+  GList *waiters;
+  gboolean exhausted;
+};
+
+static guint
+size_class (gsize size)
+{
+  /* Smallest n such that size <= 2^n */
+  if (size <= (1 << BUFFER_POOL_MIN_CLASS))
+    return BUFFER_POOL_MIN_CLASS;
+
+  return g_bit_storage (size - 1);
+}
+
+static gpointer
+free_list_pop (FreeBuffer **list)
+{
+  FreeBuffer *buffer = *list;
+
+  *list = buffer->next;
+
+  return buffer;
+}
+
+static void
+free_list_push (FreeBuffer **list,
+    gpointer buffer)
+{
+  FreeBuffer *head = buffer;
+
+  head->next = *list;
+  *list = head;
+}
+
+static void
+waiter_free (Waiter *waiter)
+{
+  if (waiter->source != NULL)
+    {
+      g_source_destroy (waiter->source);
+      g_source_unref (waiter->source);
+    }
+  g_main_context_unref (waiter->context);
+
+  g_slice_free (Waiter, waiter);
+}
+
+BufferPool *
+_buffer_pool_new (gsize cap)
+{
+  BufferPool *pool;
+
+  pool = g_slice_new0 (BufferPool);
+  g_mutex_init (&pool->mutex);
+  pool->cap = cap;
+
+  return pool;
+}
+
+void
+_buffer_pool_free (BufferPool *pool)
+{
+  guint i;
+
+  for (i = 0; i < BUFFER_POOL_N_CLASSES; i++)
+    {
+      while (pool->free_lists[i] != NULL)
+        g_free (free_list_pop (&pool->free_lists[i]));
+    }
+
+  g_list_free_full (pool->waiters, (GDestroyNotify) waiter_free);
+  g_mutex_clear (&pool->mutex);
+
+  g_slice_free (BufferPool, pool);
+}
+
+/* Free cached buffers, biggest first, until @needed more bytes fit under the
+ * cap. Must be called with the mutex held. */
+static void
+buffer_pool_trim (BufferPool *pool,
+    gsize needed)
+{
+  guint i;
+
+  for (i = BUFFER_POOL_N_CLASSES; i > 0; i--)
+    {
+      FreeBuffer **list = &pool->free_lists[i - 1];
+
+      while (*list != NULL && pool->used + pool->cached + needed > pool->cap)
+        {
+          g_free (free_list_pop (list));
+          pool->cached -= (gsize) 1 << (i - 1);
+        }
+    }
+}
+
+/* Must be called with the mutex held */
+static gpointer
+buffer_pool_alloc_locked (BufferPool *pool,
+    gsize size)
+{
+  guint class = size_class (size);
+  gsize class_size = (gsize) 1 << class;
+  gpointer buffer;
+
+  if (pool->free_lists[class] != NULL)
+    {
+      buffer = free_list_pop (&pool->free_lists[class]);
+      pool->cached -= class_size;
+      pool->used += class_size;
+      return buffer;
+    }
+
+  if (pool->cap != 0)
+    {
+      if (pool->used + class_size > pool->cap)
+        {
+          if (!pool->exhausted)
+            g_debug ("Buffer pool exhausted: %" G_GSIZE_FORMAT " bytes used, "
+                "cap is %" G_GSIZE_FORMAT, pool->used, pool->cap);
+          pool->exhausted = TRUE;
+          return NULL;
+        }
+
+      buffer_pool_trim (pool, class_size);
+    }
+
+  buffer = g_malloc (class_size);
+  pool->used += class_size;
+
+  return buffer;
+}
+
+/* Returns NULL if that would go over the cap */
+gpointer
+_buffer_pool_alloc (BufferPool *pool,
+    gsize size)
+{
+  gpointer buffer;
+
+  g_mutex_lock (&pool->mutex);
+  buffer = buffer_pool_alloc_locked (pool, size);
+  g_mutex_unlock (&pool->mutex);
+
+  return buffer;
+}
+
+static gboolean
+waiter_ready_cb (gpointer user_data)
+{
+  Waiter *waiter = user_data;
+  BufferPool *pool = waiter->pool;
+  BufferPoolReadyFunc func = waiter->func;
+  gpointer func_data = waiter->user_data;
+
+  g_mutex_lock (&pool->mutex);
+  pool->waiters = g_list_remove (pool->waiters, waiter);
+  waiter_free (waiter);
+  g_mutex_unlock (&pool->mutex);
+
+  func (func_data);
+
+  return FALSE;
+}
+
+void
+_buffer_pool_release (BufferPool *pool,
+    gpointer buffer,
+    gsize size)
+{
+  guint class = size_class (size);
+  gsize class_size = (gsize) 1 << class;
+  gsize available;
+  GList *l;
+
+  if (buffer == NULL)
+    return;
+
+  g_mutex_lock (&pool->mutex);
+
+  pool->used -= class_size;
+  if (pool->cached + class_size <= BUFFER_POOL_CACHE_SIZE)
+    {
+      free_list_push (&pool->free_lists[class], buffer);
+      pool->cached += class_size;
+    }
+  else
+    {
+      g_free (buffer);
+    }
+
+  if (pool->exhausted)
+    {
+      g_debug ("Buffer pool available again, %u sessions waiting",
+          g_list_length (pool->waiters));
+      pool->exhausted = FALSE;
+    }
+
+  /* Waiters try again from their own thread, never from within this call.
+   * They are woken in the order they came, as long as what they asked for
+   * fits in what is left, counting the ones woken already. */
+  available = pool->used < pool->cap ? pool->cap - pool->used : 0;
+  for (l = pool->waiters; l != NULL; l = l->next)
+    {
+      Waiter *waiter = l->data;
+
+      if (waiter->source == NULL)
+        continue;
+
+      available -= MIN (available, waiter->size);
+    }
+
+  for (l = pool->waiters; l != NULL; l = l->next)
+    {
+      Waiter *waiter = l->data;
+
+      if (waiter->source != NULL)
+        continue;
+
+      if (waiter->size > available)
+        break;
+      available -= waiter->size;
+
+      waiter->source = g_idle_source_new ();
+      g_source_set_callback (waiter->source, waiter_ready_cb, waiter, NULL);
+      g_source_attach (waiter->source, waiter->context);
+    }
+
+  g_mutex_unlock (&pool->mutex);
+}
+
+/* Like _buffer_pool_alloc(), but if that would go over the cap, @func is
+ * called in the thread-default main context once @size bytes have been
+ * released, and the caller then tries again. Checking the cap and queueing
+ * happen under the same lock, so a release in between can't be missed. */
+gpointer
+_buffer_pool_alloc_or_wait (BufferPool *pool,
+    gsize size,
+    BufferPoolReadyFunc func,
+    gpointer user_data)
+{
+  Waiter *waiter;
+  gpointer buffer;
+
+  g_mutex_lock (&pool->mutex);
+
+  buffer = buffer_pool_alloc_locked (pool, size);
+  if (buffer == NULL)
+    {
+      waiter = g_slice_new0 (Waiter);
+      waiter->pool = pool;
+      waiter->context = g_main_context_ref_thread_default ();
+      waiter->func = func;
+      waiter->user_data = user_data;
+      waiter->size = (gsize) 1 << size_class (size);
+      pool->waiters = g_list_append (pool->waiters, waiter);
+    }
+
+  g_mutex_unlock (&pool->mutex);
+
+  return buffer;
+}
+
+/* Must be called from the thread which called _buffer_pool_alloc_or_wait() */
+void
+_buffer_pool_cancel_wait (BufferPool *pool,
+    gpointer user_data)
+{
+  GList *l;
+
+  g_mutex_lock (&pool->mutex);
+  for (l = pool->waiters; l != NULL; l = l->next)
+    {
+      Waiter *waiter = l->data;
+
+      if (waiter->user_data == user_data)
+        {
+          pool->waiters = g_list_delete_link (pool->waiters, l);
+          waiter_free (waiter);
+          break;
+        }
+    }
+  g_mutex_unlock (&pool->mutex);
+}
+
+void
+_buffer_pool_log_occupancy (BufferPool *pool)
+{
+  g_mutex_lock (&pool->mutex);
+  g_debug ("Buffer pool: %" G_GSIZE_FORMAT " KiB used, %" G_GSIZE_FORMAT
+      " KiB cached, cap %" G_GSIZE_FORMAT " KiB, %u sessions waiting",
+      pool->used / 1024, pool->cached / 1024, pool->cap / 1024,
+      g_list_length (pool->waiters));
+  g_mutex_unlock (&pool->mutex);
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2010 Xavier Claessens <xclaesse@gmail.com>
+ * Copyright (C) 2010 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA  02110-1301  USA
+ */
+
+#ifndef __BUFFER_POOL_H__
+#define __BUFFER_POOL_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _BufferPool BufferPool;
+
+typedef void (*BufferPoolReadyFunc) (gpointer user_data);
+
+BufferPool *_buffer_pool_new (gsize cap);
+
+void _buffer_pool_free (BufferPool *pool);
+
+gpointer _buffer_pool_alloc (BufferPool *pool, gsize size);
+
+void _buffer_pool_release (BufferPool *pool, gpointer buffer, gsize size);
+
+gpointer _buffer_pool_alloc_or_wait (BufferPool *pool, gsize size,
+    BufferPoolReadyFunc func, gpointer user_data);
+
+void _buffer_pool_cancel_wait (BufferPool *pool, gpointer user_data);
+
+void _buffer_pool_log_occupancy (BufferPool *pool);
+
+G_END_DECLS
+
+#endif /* #ifndef __BUFFER_POOL_H__*/
@@ -20,12 +20,26 @@
 
 #include "config.h"
 
+#include <errno.h>
+#include <unistd.h>
+
+#include <glib/gstdio.h>
+#include <gio/gunixconnection.h>
+#include <gio/gunixsocketaddress.h>
+
 #include "client-helpers.h"
+#include "relay.h"
+#include "trace.h"
 
 typedef struct
 {
   GSocketConnection *connection;
   TpChannel *channel;
+  gchar *contact_id;
+
+  /* When the channel was requested and the tube offered, for tracing */
+  gint64 request_time;
+  gint64 offer_time;
 } CreateTubeData;
 
 static void
@@ -33,6 +47,7 @@ create_tube_data_free (CreateTubeData *data)
 {
   tp_clear_object (&data->connection);
   tp_clear_object (&data->channel);
+  g_free (data->contact_id);
 
   g_slice_free (CreateTubeData, data);
 }
@@ -86,6 +101,9 @@ create_tube_incoming_cb (TpStreamTubeChannel *channel,
   CreateTubeData *data;
 
   data = g_simple_async_result_get_op_res_gpointer (simple);
+  _trace_phase ("wait-incoming", data->contact_id, data->offer_time,
+      g_get_monotonic_time ());
+
   data->connection = tp_stream_tube_connection_get_socket_connection (
       tube_connection);
   g_object_ref (data->connection);
@@ -99,8 +117,13 @@ create_tube_offer_cb (GObject *object,
     gpointer user_data)
 {
   GSimpleAsyncResult *simple = user_data;
+  CreateTubeData *data;
   GError *error = NULL;
 
+  data = g_simple_async_result_get_op_res_gpointer (simple);
+  _trace_phase ("offer-tube", data->contact_id, data->offer_time,
+      g_get_monotonic_time ());
+
   if (!tp_stream_tube_channel_offer_finish (TP_STREAM_TUBE_CHANNEL (object),
       res, &error))
     create_tube_complete (simple, error);
@@ -119,6 +142,8 @@ create_channel_cb (GObject *acr,
   GError *error = NULL;
 
   data = g_simple_async_result_get_op_res_gpointer (simple);
+  _trace_phase ("request-channel", data->contact_id, data->request_time,
+      g_get_monotonic_time ());
 
   data->channel = tp_account_channel_request_create_and_handle_channel_finish (
       TP_ACCOUNT_CHANNEL_REQUEST (acr), res, NULL, &error);
@@ -144,6 +169,7 @@ create_channel_cb (GObject *acr,
       G_CALLBACK (create_tube_incoming_cb),
       g_object_ref (simple), (GClosureNotify) g_object_unref, 0);
 
+  data->offer_time = g_get_monotonic_time ();
   tp_stream_tube_channel_offer_async (TP_STREAM_TUBE_CHANNEL (data->channel),
       NULL, create_tube_offer_cb, g_object_ref (simple));
 
@@ -153,6 +179,7 @@ create_channel_cb (GObject *acr,
 void
 _client_create_tube_async (TpAccount *account,
     const gchar *contact_id,
+    const gchar *service,
     GAsyncReadyCallback callback,
     gpointer user_data)
 {
@@ -165,6 +192,7 @@ _client_create_tube_async (TpAccount *account,
       _client_create_tube_finish);
 
   data = g_slice_new0 (CreateTubeData);
+  data->contact_id = g_strdup (contact_id);
   g_simple_async_result_set_op_res_gpointer (simple, data,
       (GDestroyNotify) create_tube_data_free);
 
@@ -176,10 +204,11 @@ _client_create_tube_async (TpAccount *account,
       TP_PROP_CHANNEL_TARGET_ID, G_TYPE_STRING,
         contact_id,
       TP_PROP_CHANNEL_TYPE_STREAM_TUBE_SERVICE, G_TYPE_STRING,
-        TUBE_SERVICE,
+        service,
       NULL);
 
   acr = tp_account_channel_request_new (account, request, G_MAXINT64);
+  data->request_time = g_get_monotonic_time ();
   tp_account_channel_request_create_and_handle_channel_async (acr,
       NULL, create_channel_cb, simple);
 
@@ -229,6 +258,9 @@ _client_create_local_socket (GError **error)
       inet_address = g_inet_address_new_loopback (G_SOCKET_FAMILY_IPV4);
       socket_address = g_inet_socket_address_new (inet_address, 0);
       g_socket_bind (socket, socket_address, FALSE, error);
+
+      /* Accepted connections inherit it */
+      _relay_set_nodelay (socket);
     }
 
   tp_clear_object (&inet_address);
@@ -237,6 +269,38 @@ _client_create_local_socket (GError **error)
   return socket;
 }
 
+static void
+add_common_args (GPtrArray *args,
+    const gchar *contact_id,
+    const gchar *username,
+    gchar **ssh_opts)
+{
+  gchar *str;
+  gchar **opt;
+
+  if (contact_id != NULL)
+    {
+      str = g_strdup_printf ("-oHostKeyAlias=%s", contact_id);
+      g_ptr_array_add (args, str);
+    }
+
+  if (!tp_str_empty (username))
+    {
+      g_ptr_array_add (args, g_strdup ("-l"));
+      g_ptr_array_add (args, g_strdup (username));
+    }
+
+  if (ssh_opts != NULL)
+    {
+      for (opt = ssh_opts; *opt != NULL; opt++)
+        {
+          g_ptr_array_add (args, g_strdup (*opt));
+        }
+    }
+
+  g_ptr_array_add (args, NULL);
+}
+
 GStrv
 _client_create_exec_args (GSocket *socket,
     const gchar *contact_id,
@@ -249,7 +313,6 @@ _client_create_exec_args (GSocket *socket,
   guint16 port;
   gchar *host;
   gchar *str;
-  gchar **opt;
 
   /* Get the local host and port on which sshd is running */
   socket_address = g_socket_get_local_address (socket, NULL);
@@ -268,29 +331,170 @@ _client_create_exec_args (GSocket *socket,
   str = g_strdup_printf ("%d", port);
   g_ptr_array_add (args, str);
 
-  if (contact_id != NULL)
+  add_common_args (args, contact_id, username, ssh_opts);
+
+  return (gchar **) g_ptr_array_free (args, FALSE);
+}
+
+/* ssh expands %-tokens in ProxyCommand */
+static gchar *
+escape_percent (const gchar *str)
+{
+  GString *escaped;
+  const gchar *p;
+
+  escaped = g_string_new (NULL);
+  for (p = str; *p != '\0'; p++)
     {
-      str = g_strdup_printf ("-oHostKeyAlias=%s", contact_id);
-      g_ptr_array_add (args, str);
+      if (*p == '%')
+        g_string_append_c (escaped, '%');
+      g_string_append_c (escaped, *p);
     }
 
-  if (!tp_str_empty (username))
+  return g_string_free (escaped, FALSE);
+}
+
+GStrv
+_client_create_fdpass_exec_args (const gchar *program,
+    const gchar *socket_path,
+    const gchar *contact_id,
+    const gchar *username,
+    gchar **ssh_opts)
+{
+  GPtrArray *args;
+  gchar *quoted_program;
+  gchar *quoted_path;
+  gchar *command;
+  gchar *escaped;
+
+  /* ssh runs "program --fdpass-helper socket_path" which gives it the tube
+   * socket, ssh then talks directly to the tube. */
+  quoted_program = g_shell_quote (program);
+  quoted_path = g_shell_quote (socket_path);
+  command = g_strdup_printf ("exec %s --fdpass-helper %s", quoted_program,
+      quoted_path);
+  escaped = escape_percent (command);
+
+  args = g_ptr_array_new_with_free_func (g_free);
+  g_ptr_array_add (args, g_strdup ("ssh"));
+  /* Not the contact: ssh would take a JID's user part as login, apply the
+   * user's Host stanzas, or parse a leading '-' as an option. Host keys are
+   * checked against HostKeyAlias. */
+  g_ptr_array_add (args, g_strdup ("localhost"));
+  g_ptr_array_add (args, g_strdup ("-oProxyUseFdpass=yes"));
+  g_ptr_array_add (args, g_strdup_printf ("-oProxyCommand=%s", escaped));
+
+  add_common_args (args, contact_id, username, ssh_opts);
+
+  g_free (quoted_program);
+  g_free (quoted_path);
+  g_free (command);
+  g_free (escaped);
+
+  return (gchar **) g_ptr_array_free (args, FALSE);
+}
+
+gboolean
+_client_fdpass_helper (const gchar *socket_path,
+    GError **error)
+{
+  GSocketClient *client;
+  GSocketAddress *address;
+  GSocketConnection *connection = NULL;
+  GSocket *out_socket = NULL;
+  GSocketConnection *out_connection = NULL;
+  gint fd = -1;
+  gboolean success = FALSE;
+
+  /* Get the tube socket from ssh-contact */
+  client = g_socket_client_new ();
+  address = g_unix_socket_address_new (socket_path);
+  connection = g_socket_client_connect (client,
+      G_SOCKET_CONNECTABLE (address), NULL, error);
+  if (connection == NULL)
+    goto OUT;
+
+  fd = g_unix_connection_receive_fd (G_UNIX_CONNECTION (connection), NULL,
+      error);
+  if (fd < 0)
+    goto OUT;
+
+  /* With ProxyUseFdpass, our stdout is a unix socket on which ssh waits for
+   * the fd to use for the connection */
+  out_socket = g_socket_new_from_fd (STDOUT_FILENO, error);
+  if (out_socket == NULL)
+    goto OUT;
+
+  out_connection = g_socket_connection_factory_create_connection (out_socket);
+  if (!G_IS_UNIX_CONNECTION (out_connection))
     {
-      g_ptr_array_add (args, g_strdup ("-l"));
-      g_ptr_array_add (args, g_strdup (username));
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+          "stdout is not a unix socket, is ProxyUseFdpass enabled?");
+      goto OUT;
     }
 
-  if (ssh_opts != NULL)
+  success = g_unix_connection_send_fd (G_UNIX_CONNECTION (out_connection),
+      fd, NULL, error);
+
+OUT:
+  if (fd >= 0)
+    close (fd);
+
+  tp_clear_object (&client);
+  tp_clear_object (&address);
+  tp_clear_object (&connection);
+  tp_clear_object (&out_socket);
+  tp_clear_object (&out_connection);
+
+  return success;
+}
+
+/* Bind a unix socket at @path, replacing it if whoever listened there is
+ * gone */
+GSocketListener *
+_client_listen_unix (const gchar *path,
+    GError **error)
+{
+  GSocketAddress *address;
+  GSocketClient *client;
+  GSocketConnection *connection;
+  GSocketListener *listener = NULL;
+  gchar *dirname;
+
+  dirname = g_path_get_dirname (path);
+  if (g_mkdir_with_parents (dirname, 0700) < 0)
     {
-      for (opt = ssh_opts; *opt != NULL; opt++)
-        {
-          g_ptr_array_add (args, g_strdup (*opt));
-        }
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+          "Can't create %s: %s", dirname, g_strerror (errno));
+      g_free (dirname);
+      return NULL;
     }
+  g_free (dirname);
 
-  g_ptr_array_add (args, NULL);
+  address = g_unix_socket_address_new (path);
+  client = g_socket_client_new ();
 
-  return (gchar **) g_ptr_array_free (args, FALSE);
+  connection = g_socket_client_connect (client,
+      G_SOCKET_CONNECTABLE (address), NULL, NULL);
+  if (connection != NULL)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_EXISTS,
+          "Another process is already listening on %s", path);
+      g_object_unref (connection);
+      goto OUT;
+    }
+  g_unlink (path);
+
+  listener = g_socket_listener_new ();
+  if (!g_socket_listener_add_address (listener, address,
+      G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_DEFAULT, NULL, NULL, error))
+    tp_clear_object (&listener);
+
+OUT:
+  g_object_unref (address);
+  g_object_unref (client);
+
+  return listener;
 }
 
 gboolean
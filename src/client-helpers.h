@@ -27,7 +27,8 @@
 G_BEGIN_DECLS
 
 void _client_create_tube_async (TpAccount *account,
-    const gchar *contact_id, GAsyncReadyCallback callback, gpointer user_data);
+    const gchar *contact_id, const gchar *service,
+    GAsyncReadyCallback callback, gpointer user_data);
 
 GSocketConnection *_client_create_tube_finish (GAsyncResult *res,
     TpChannel **channel, GError **error);
@@ -37,6 +38,14 @@ GSocket *_client_create_local_socket (GError **error);
 GStrv _client_create_exec_args (GSocket *socket, const gchar *contact_id,
     const gchar *username, gchar **ssh_opts);
 
+GStrv _client_create_fdpass_exec_args (const gchar *program,
+    const gchar *socket_path, const gchar *contact_id, const gchar *username,
+    gchar **ssh_opts);
+
+gboolean _client_fdpass_helper (const gchar *socket_path, GError **error);
+
+GSocketListener *_client_listen_unix (const gchar *path, GError **error);
+
 gboolean _capabilities_has_stream_tube (TpCapabilities *caps);
 
 G_END_DECLS
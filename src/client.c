@@ -20,14 +20,35 @@
 
 #include "config.h"
 
+#include <signal.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <unistd.h>
 
+#include <glib/gstdio.h>
 #include <gio/gio.h>
+#include <gio/gunixconnection.h>
+#include <gio/gunixfdmessage.h>
+#include <gio/gunixinputstream.h>
+#include <gio/gunixsocketaddress.h>
 #include <telepathy-glib/telepathy-glib.h>
 
+#include "agent.h"
 #include "client-helpers.h"
+#include "contact-cache.h"
+#include "fanout.h"
+#include "mux.h"
+#include "mux-master.h"
+#include "relay.h"
+#include "stdio-relay.h"
+#include "trace.h"
+
+/* Seconds the mux master keeps the tube after its last session */
+#define DEFAULT_MUX_LINGER 300
+
+/* Contacts running the --fanout command at the same time */
+#define DEFAULT_FANOUT_PARALLEL 8
 
 typedef struct
 {
@@ -38,10 +59,62 @@ typedef struct
   gchar *contact_id;
   gchar *login;
   gchar **ssh_opts;
+  RelayEngine relay_engine;
+  gboolean fdpass;
+  /* Relay the tube on stdin and stdout, we are ssh's ProxyCommand */
+  gboolean stdio;
+
+  /* Private socket where the ProxyCommand gets the tube from */
+  gchar *fdpass_dir;
+  gchar *fdpass_path;
+  /* The ProxyCommand, waiting for the tube */
+  GSocketConnection *fdpass_connection;
+
+  /* Share one tube per contact with other sessions */
+  gboolean mux;
+  guint mux_linger;
+  gchar *mux_path;
+
+  /* The resident agent, it gives us the tube and keeps it until we leave */
+  GSocketConnection *agent_connection;
+
+  /* Run the command on many contacts, all of them when fanout_ids is NULL */
+  gboolean fanout;
+  gchar **fanout_ids;
+  guint fanout_parallel;
+
+  TpSimpleClientFactory *factory;
+
+  /* Contacts from the cache, and the ones offered in the prompt */
+  GPtrArray *cached;
+  GPtrArray *candidates;
+  /* Picked from a cached prompt, started once live contacts confirm it */
+  CachedContact *chosen;
+  GIOChannel *stdin_channel;
+  guint stdin_watch;
+  gboolean tube_started;
+
+  /* Accounts being prepared, and what we learned from the ready ones */
+  guint n_preparing;
+  gboolean preparation_done;
+  GList *prepared_accounts;
+  GPtrArray *live_contacts;
 
   TpChannel *channel;
   GSocketConnection *tube_connection;
   GSocketConnection *ssh_connection;
+  /* ssh is spawned while the tube is negotiated, it gets the tube once both
+   * are there */
+  GPid ssh_pid;
+  gboolean session_started;
+
+  /* Setup timestamps, for --trace */
+  gint64 start_time;
+  gint64 prepare_time;
+  gint64 prompt_time;
+  gint64 tube_time;
+  gint64 spawn_time;
+  RelayStats *relay_stats;
 
   gboolean success:1;
 } ClientContext;
@@ -72,6 +145,11 @@ throw_error_message (ClientContext *context,
 {
   g_print ("Error: %s\n", message);
   context->success = FALSE;
+
+  /* Don't leave ssh waiting for a tube that will never come */
+  if (context->ssh_pid != 0 && !context->session_started)
+    kill (context->ssh_pid, SIGTERM);
+
   leave (context);
 }
 
@@ -89,6 +167,7 @@ ssh_client_watch_cb (GPid pid,
 {
   ClientContext *context = user_data;
 
+  context->ssh_pid = 0;
   leave (context);
   g_spawn_close_pid (pid);
 }
@@ -101,7 +180,16 @@ splice_cb (GObject *source_object,
   ClientContext *context = user_data;
   GError *error = NULL;
 
-  if (!g_io_stream_splice_finish (res, &error))
+  if (context->relay_stats != NULL &&
+      context->relay_stats->first_byte_time != 0)
+    {
+      _trace_phase ("first-byte", NULL, context->relay_stats->start_time,
+          context->relay_stats->first_byte_time);
+      _trace_phase ("setup", NULL, context->start_time,
+          context->relay_stats->first_byte_time);
+    }
+
+  if (!_relay_splice_finish (res, &error))
     throw_error (context, error);
   else
     leave (context);
@@ -109,6 +197,19 @@ splice_cb (GObject *source_object,
   g_clear_error (&error);
 }
 
+/* Both ssh and the tube are connected, splice them */
+static void
+start_relay (ClientContext *context)
+{
+  context->session_started = TRUE;
+  if (_trace_enabled ())
+    context->relay_stats = _relay_stats_new ();
+
+  _relay_splice_async (G_IO_STREAM (context->tube_connection),
+      G_IO_STREAM (context->ssh_connection), context->relay_engine,
+      context->relay_stats, NULL, NULL, splice_cb, context);
+}
+
 static void
 ssh_socket_connected_cb (GObject *source_object,
     GAsyncResult *res,
@@ -127,43 +228,168 @@ ssh_socket_connected_cb (GObject *source_object,
       return;
     }
 
-  /* Splice tube and ssh connections */
-  g_io_stream_splice_async (G_IO_STREAM (context->tube_connection),
-      G_IO_STREAM (context->ssh_connection), G_IO_STREAM_SPLICE_NONE,
-      G_PRIORITY_DEFAULT, NULL, splice_cb, context);
+  _trace_phase ("ssh-connect", NULL, context->spawn_time,
+      g_get_monotonic_time ());
+
+  /* ssh waits for the server's banner, it doesn't mind */
+  if (context->tube_connection == NULL)
+    {
+      g_debug ("ssh connected, waiting for the tube");
+      return;
+    }
+
+  start_relay (context);
 }
 
 static void
-create_tube_cb (GObject *source_object,
+fdpass_cleanup (ClientContext *context)
+{
+  if (context->fdpass_path != NULL)
+    g_unlink (context->fdpass_path);
+  if (context->fdpass_dir != NULL)
+    g_rmdir (context->fdpass_dir);
+
+  tp_clear_pointer (&context->fdpass_path, g_free);
+  tp_clear_pointer (&context->fdpass_dir, g_free);
+}
+
+/* Both the ProxyCommand and the tube are connected. From now on ssh talks
+ * directly to the tube, we only wait for it to exit. */
+static void
+fdpass_send_tube (ClientContext *context)
+{
+  GSocket *socket;
+  GError *error = NULL;
+
+  context->session_started = TRUE;
+  _trace_phase ("setup", NULL, context->start_time, g_get_monotonic_time ());
+
+  socket = g_socket_connection_get_socket (context->tube_connection);
+  if (!g_unix_connection_send_fd (G_UNIX_CONNECTION (
+          context->fdpass_connection), g_socket_get_fd (socket), NULL,
+          &error))
+    throw_error (context, error);
+
+  g_clear_error (&error);
+  tp_clear_object (&context->fdpass_connection);
+}
+
+static void
+fdpass_connected_cb (GObject *source_object,
     GAsyncResult *res,
     gpointer user_data)
 {
   ClientContext *context = user_data;
-  GSocketListener *listener;
-  GSocket *socket;
-  GStrv args = NULL;
-  GPid pid;
+  GSocketListener *listener = G_SOCKET_LISTENER (source_object);
   GError *error = NULL;
 
-  context->tube_connection = _client_create_tube_finish (res, &context->channel,
-      &error);
-  if (error != NULL)
+  /* Only ssh's ProxyCommand is expected, nobody else may connect */
+  fdpass_cleanup (context);
+
+  context->fdpass_connection = g_socket_listener_accept_finish (listener, res,
+      NULL, &error);
+  if (context->fdpass_connection == NULL)
     {
       throw_error (context, error);
       g_clear_error (&error);
       return;
     }
 
-  g_signal_connect (context->channel, "invalidated",
-      G_CALLBACK (channel_invalidated_cb), context);
+  _trace_phase ("ssh-connect", "fdpass", context->spawn_time,
+      g_get_monotonic_time ());
+
+  if (context->tube_connection == NULL)
+    {
+      g_debug ("ssh connected, waiting for the tube");
+      return;
+    }
+
+  fdpass_send_tube (context);
+}
+
+static gchar *
+find_program (const gchar *argv0)
+{
+  gchar *cwd;
+  gchar *path;
+
+  if (g_path_is_absolute (argv0))
+    return g_strdup (argv0);
+
+  if (strchr (argv0, G_DIR_SEPARATOR) == NULL)
+    return g_find_program_in_path (argv0);
+
+  cwd = g_get_current_dir ();
+  path = g_build_filename (cwd, argv0, NULL);
+  g_free (cwd);
+
+  return path;
+}
+
+/* Hand the tube's socket to ssh with ProxyUseFdpass, so we don't have to
+ * relay anything */
+static GStrv
+listen_fdpass (ClientContext *context,
+    GError **error)
+{
+  GSocketListener *listener = NULL;
+  GSocketAddress *address = NULL;
+  gchar *program;
+  GStrv args = NULL;
+
+  program = find_program (context->argv0);
+  if (program == NULL)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+          "Can't find %s executable", context->argv0);
+      goto OUT;
+    }
+
+  context->fdpass_dir = g_dir_make_tmp ("ssh-contact-XXXXXX", error);
+  if (context->fdpass_dir == NULL)
+    goto OUT;
+  context->fdpass_path = g_build_filename (context->fdpass_dir, "fdpass",
+      NULL);
+
+  listener = g_socket_listener_new ();
+  address = g_unix_socket_address_new (context->fdpass_path);
+  if (!g_socket_listener_add_address (listener, address, G_SOCKET_TYPE_STREAM,
+      G_SOCKET_PROTOCOL_DEFAULT, NULL, NULL, error))
+    goto OUT;
+
+  g_socket_listener_accept_async (listener, NULL,
+      fdpass_connected_cb, context);
+
+  args = _client_create_fdpass_exec_args (program, context->fdpass_path,
+      context->contact_id, context->login, context->ssh_opts);
+
+OUT:
+  if (args == NULL)
+    fdpass_cleanup (context);
+
+  g_free (program);
+  tp_clear_object (&listener);
+  tp_clear_object (&address);
+
+  return args;
+}
+
+/* Let ssh connect to a loopback socket that we splice with the tube */
+static GStrv
+listen_loopback (ClientContext *context,
+    GError **error)
+{
+  GSocketListener *listener;
+  GSocket *socket;
+  GStrv args = NULL;
 
   listener = g_socket_listener_new ();
-  socket = _client_create_local_socket (&error);
+  socket = _client_create_local_socket (error);
   if (socket == NULL)
     goto OUT;
-  if (!g_socket_listen (socket, &error))
+  if (!g_socket_listen (socket, error))
     goto OUT;
-  if (!g_socket_listener_add_socket (listener, socket, NULL, &error))
+  if (!g_socket_listener_add_socket (listener, socket, NULL, error))
     goto OUT;
 
   g_socket_listener_accept_async (listener, NULL,
@@ -172,211 +398,1146 @@ create_tube_cb (GObject *source_object,
   args = _client_create_exec_args (socket, context->contact_id,
       context->login, context->ssh_opts);
 
+OUT:
+  tp_clear_object (&listener);
+  tp_clear_object (&socket);
+
+  return args;
+}
+
+/* Run ssh, it connects to us and gets context->tube_connection once it's
+ * there. Returns FALSE if that failed, after throwing the error. */
+static gboolean
+spawn_ssh (ClientContext *context)
+{
+  GStrv args = NULL;
+  GPid pid;
+  gint64 start;
+  GError *error = NULL;
+
+  if (context->fdpass)
+    {
+      args = listen_fdpass (context, &error);
+      if (args == NULL)
+        {
+          g_debug ("Can't pass the tube to ssh, using loopback: %s",
+              error->message);
+          g_clear_error (&error);
+        }
+    }
+
+  if (args == NULL)
+    args = listen_loopback (context, &error);
+  if (args == NULL)
+    goto OUT;
+
   /* spawn ssh client */
+  start = g_get_monotonic_time ();
   if (g_spawn_async (NULL, args, NULL,
       G_SPAWN_SEARCH_PATH | G_SPAWN_CHILD_INHERITS_STDIN |
       G_SPAWN_DO_NOT_REAP_CHILD, NULL, NULL, &pid, &error))
     {
+      context->ssh_pid = pid;
       g_child_watch_add (pid, ssh_client_watch_cb, context);
     }
+  context->spawn_time = g_get_monotonic_time ();
+  _trace_phase ("spawn-ssh", NULL, start, context->spawn_time);
 
 OUT:
 
   if (error != NULL)
-    throw_error (context, error);
+    {
+      throw_error (context, error);
+      g_clear_error (&error);
+      g_strfreev (args);
+      return FALSE;
+    }
 
-  g_clear_error (&error);
-  tp_clear_object (&listener);
-  tp_clear_object (&socket);
   g_strfreev (args);
+
+  return TRUE;
 }
 
 static void
-start_tube (ClientContext *context,
-    TpContact *contact)
+stdio_relay_cb (GObject *source_object,
+    GAsyncResult *res,
+    gpointer user_data)
 {
-  TpAccount *account;
+  ClientContext *context = user_data;
+  GError *error = NULL;
+
+  if (!_stdio_relay_finish (res, &error))
+    throw_error (context, error);
+  else
+    leave (context);
 
-  account = tp_connection_get_account (tp_contact_get_connection (contact));
+  g_clear_error (&error);
+}
 
-  if (context->account_path == NULL || context->contact_id == NULL)
+/* context->tube_connection is ready, give it to ssh if it's connected
+ * already, or once it is */
+static void
+start_session (ClientContext *context)
+{
+  if (context->stdio)
     {
-      g_print ("\nTo avoid interactive mode, you can use that command:\n"
-          "%s --account %s --contact %s\n", context->argv0,
-          tp_proxy_get_object_path (account),
-          tp_contact_get_identifier (contact));
+      context->session_started = TRUE;
+      _trace_phase ("setup", NULL, context->start_time,
+          g_get_monotonic_time ());
+      _stdio_relay_async (context->tube_connection, NULL, stdio_relay_cb,
+          context);
+      return;
     }
 
-  _client_create_tube_async (account, tp_contact_get_identifier (contact),
-      create_tube_cb, context);
+  if (context->ssh_connection != NULL)
+    start_relay (context);
+  else if (context->fdpass_connection != NULL)
+    fdpass_send_tube (context);
 }
 
 static void
-choose_contact (ClientContext *context,
-    GList *accounts)
+create_tube_cb (GObject *source_object,
+    GAsyncResult *res,
+    gpointer user_data)
 {
-  GPtrArray *candidates;
-  GList *l;
-  GString *text;
-  gchar buffer[10];
-  gchar *str;
+  ClientContext *context = user_data;
+  GError *error = NULL;
 
-  text = g_string_new (NULL);
-  candidates = g_ptr_array_new_with_free_func (g_object_unref);
-  for (l = accounts; l != NULL; l = l->next)
+  context->tube_connection = _client_create_tube_finish (res, &context->channel,
+      &error);
+  if (error != NULL)
     {
-      TpAccount *account = l->data;
-      TpConnection *connection;
-      TpCapabilities *caps;
-      GPtrArray *contacts;
-      GString *subtext;
-      gboolean found = FALSE;
-      guint i;
-
-      connection = tp_account_get_connection (account);
-      if (connection == NULL)
-        continue;
-
-      caps = tp_connection_get_capabilities (connection);
-      if (!_capabilities_has_stream_tube (caps))
-        continue;
-
-      subtext = g_string_new (NULL);
-      contacts = tp_connection_dup_contact_list (connection);
-      for (i = 0; i < contacts->len; i++)
-        {
-          TpContact *contact = g_ptr_array_index (contacts, i);
+      throw_error (context, error);
+      g_clear_error (&error);
+      return;
+    }
 
-          caps = tp_contact_get_capabilities (contact);
-          if (!_capabilities_has_stream_tube (caps))
-            continue;
+  g_signal_connect (context->channel, "invalidated",
+      G_CALLBACK (channel_invalidated_cb), context);
 
-          if (context->contact_id != NULL &&
-              tp_strdiff (context->contact_id,
-                  tp_contact_get_identifier (contact)))
-            continue;
+  _trace_phase ("create-tube", tp_channel_get_identifier (context->channel),
+      context->tube_time, g_get_monotonic_time ());
 
-          found = TRUE;
-          g_ptr_array_add (candidates, g_object_ref (contact));
+  start_session (context);
+}
 
-          g_string_append_printf (subtext, "  %d) %s (%s)\n", candidates->len,
-              tp_contact_get_alias (contact),
-              tp_contact_get_identifier (contact));
-        }
-      g_ptr_array_unref (contacts);
+/* The connection to the mux master is a stream of its tube, ssh can use it
+ * exactly like a tube of its own */
+static GSocketConnection *
+connect_mux_control (ClientContext *context,
+    GError **error)
+{
+  GSocketClient *client;
+  GSocketAddress *address;
+  GSocketConnection *connection;
+
+  client = g_socket_client_new ();
+  address = g_unix_socket_address_new (context->mux_path);
+  connection = g_socket_client_connect (client, G_SOCKET_CONNECTABLE (address),
+      NULL, error);
+  g_object_unref (address);
+  g_object_unref (client);
+
+  return connection;
+}
 
-      if (found)
-        {
-          g_string_append_printf (text,
-              "Account %s (%s):\n%s",
-              tp_account_get_display_name (l->data),
-              tp_account_get_protocol (l->data),
-              subtext->str);
-        }
-      g_string_free (subtext, TRUE);
-    }
+static void
+mux_master_ready_cb (GObject *source_object,
+    GAsyncResult *res,
+    gpointer user_data)
+{
+  ClientContext *context = user_data;
+  GDataInputStream *stream = G_DATA_INPUT_STREAM (source_object);
+  gchar *line;
+  GError *error = NULL;
 
-  if (candidates->len == 0)
+  line = g_data_input_stream_read_line_finish (stream, res, NULL, &error);
+  if (line == NULL)
     {
-      throw_error_message (context, "No suitable contact");
+      if (error == NULL)
+        g_set_error (&error, G_IO_ERROR, G_IO_ERROR_FAILED,
+            "Mux master exited");
       goto OUT;
     }
 
-  if (candidates->len == 1 && context->contact_id != NULL)
+  if (tp_strdiff (line, "ready"))
     {
-      start_tube (context, g_ptr_array_index (candidates, 0));
+      g_set_error (&error, G_IO_ERROR, G_IO_ERROR_FAILED,
+          "Mux master failed: %s", g_str_has_prefix (line, "error: ") ?
+          line + strlen ("error: ") : line);
       goto OUT;
     }
 
-  g_print ("%sWhich contact to use? ", text->str);
-  str = fgets (buffer, sizeof (buffer), stdin);
-  if (str != NULL)
-    {
-      guint i;
+  _trace_phase ("spawn-mux-master", NULL, context->tube_time,
+      g_get_monotonic_time ());
 
-      str[strlen (str) - 1] = '\0';
-      i = atoi (str) - 1;
+  context->tube_connection = connect_mux_control (context, &error);
+  if (context->tube_connection != NULL)
+    start_session (context);
 
-      if (i < candidates->len)
-        {
-          start_tube (context, g_ptr_array_index (candidates, i));
-          goto OUT;
-        }
-    }
+OUT:
+  if (error != NULL)
+    throw_error (context, error);
 
-  throw_error_message (context, "Invalid contact number");
+  g_clear_error (&error);
+  g_free (line);
+  g_object_unref (stream);
+}
 
-OUT:
-  g_ptr_array_unref (candidates);
-  g_string_free (text, TRUE);
+static void
+mux_master_child_setup (gpointer user_data)
+{
+  /* Don't die with the terminal of the session that started us */
+  setsid ();
 }
 
+static gboolean
+spawn_mux_master (ClientContext *context,
+    const gchar *account_path,
+    const gchar *contact_id,
+    GError **error)
+{
+  GDataInputStream *stream;
+  GInputStream *pipe_stream;
+  gchar *program;
+  gchar *linger;
+  gint stdout_fd;
+  gboolean success;
+
+  program = find_program (context->argv0);
+  if (program == NULL)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+          "Can't find %s executable", context->argv0);
+      return FALSE;
+    }
+
+  linger = g_strdup_printf ("%u", context->mux_linger);
+  {
+    gchar *args[] = { program, "--mux-master", "--account",
+        (gchar *) account_path, "--contact", (gchar *) contact_id,
+        "--mux-linger", linger, NULL };
+
+    /* Not reaped by us, the master outlives this session */
+    success = g_spawn_async_with_pipes (NULL, args, NULL,
+        G_SPAWN_STDERR_TO_DEV_NULL, mux_master_child_setup, NULL, NULL,
+        NULL, &stdout_fd, NULL, error);
+  }
+  g_free (linger);
+  g_free (program);
+
+  if (!success)
+    return FALSE;
+
+  /* It says "ready" once the control socket is bound, connections are then
+   * queued until the tube is up */
+  pipe_stream = g_unix_input_stream_new (stdout_fd, TRUE);
+  stream = g_data_input_stream_new (pipe_stream);
+  g_data_input_stream_read_line_async (stream, G_PRIORITY_DEFAULT, NULL,
+      mux_master_ready_cb, context);
+  g_object_unref (pipe_stream);
+
+  return TRUE;
+}
+
+/* Join the tube of a running mux master, or start one */
 static void
-account_prepared_cb (GObject *object,
-    GAsyncResult *res,
-    gpointer user_data)
+start_mux_stream (ClientContext *context,
+    const gchar *account_path,
+    const gchar *contact_id)
 {
-  TpAccount *account = TP_ACCOUNT (object);
-  ClientContext *context = user_data;
-  GList *accounts;
   GError *error = NULL;
 
-  if (!tp_proxy_prepare_finish (TP_PROXY (account), res, &error))
+  context->mux_path = _mux_control_path (account_path, contact_id);
+
+  context->tube_connection = connect_mux_control (context, &error);
+  if (context->tube_connection != NULL)
     {
-      throw_error (context, error);
-      g_clear_error (&error);
+      g_debug ("Joining running mux master at %s", context->mux_path);
+      start_session (context);
       return;
     }
 
-  accounts = g_list_prepend (NULL, account);
-  choose_contact (context, accounts);
-  g_list_free (accounts);
+  g_debug ("No mux master running: %s", error->message);
+  g_clear_error (&error);
+
+  if (!spawn_mux_master (context, account_path, contact_id, &error))
+    {
+      throw_error (context, error);
+      g_clear_error (&error);
+    }
 }
 
 static void
-account_manager_prepared_cb (GObject *object,
-    GAsyncResult *res,
-    gpointer user_data)
+start_tube (ClientContext *context,
+    const gchar *account_path,
+    const gchar *contact_id)
 {
-  TpAccountManager *manager = TP_ACCOUNT_MANAGER (object);
-  ClientContext *context = user_data;
-  GList *accounts;
+  TpAccount *account;
   GError *error = NULL;
 
-  if (!tp_proxy_prepare_finish (TP_PROXY (manager), res, &error))
+  context->tube_started = TRUE;
+  context->tube_time = g_get_monotonic_time ();
+  _trace_instant ("start-tube", contact_id);
+
+  account = tp_simple_client_factory_ensure_account (context->factory,
+      account_path, NULL, &error);
+  if (account == NULL)
     {
       throw_error (context, error);
       g_clear_error (&error);
       return;
     }
 
-  accounts = tp_account_manager_get_valid_accounts (manager);
-  choose_contact (context, accounts);
-  g_list_free (accounts);
+  if (!context->stdio &&
+      (context->account_path == NULL || context->contact_id == NULL))
+    {
+      g_print ("\nTo avoid interactive mode, you can use that command:\n"
+          "%s --account %s --contact %s\n", context->argv0,
+          account_path, contact_id);
+    }
+
+  /* Process startup, config parsing and key loading happen while the tube
+   * is negotiated, which takes seconds */
+  if (!context->stdio && !spawn_ssh (context))
+    goto OUT;
+
+  if (context->mux)
+    start_mux_stream (context, account_path, contact_id);
+  else
+    _client_create_tube_async (account, contact_id, TUBE_SERVICE,
+        create_tube_cb, context);
+
+OUT:
+  g_object_unref (account);
 }
 
-static void
-client_context_clear (ClientContext *context)
+/* Connect to the resident agent, if one is running */
+static GSocketConnection *
+connect_agent (GError **error)
 {
-  tp_clear_pointer (&context->loop, g_main_loop_unref);
-  g_free (context->argv0);
-  g_free (context->account_path);
-  g_free (context->contact_id);
-  g_free (context->login);
-  g_strfreev (context->ssh_opts);
-
-  tp_clear_object (&context->channel);
-  tp_clear_object (&context->tube_connection);
-  tp_clear_object (&context->ssh_connection);
+  GSocketClient *client;
+  GSocketAddress *address;
+  GSocketConnection *connection;
+  gchar *path;
+
+  path = _agent_socket_path ();
+  client = g_socket_client_new ();
+  address = g_unix_socket_address_new (path);
+  connection = g_socket_client_connect (client, G_SOCKET_CONNECTABLE (address),
+      NULL, error);
+  g_object_unref (address);
+  g_object_unref (client);
+  g_free (path);
+
+  return connection;
 }
 
-int
-main (gint argc, gchar *argv[])
+/* The agent sends the tube's socket, or an error message */
+static gboolean
+agent_reply_cb (GSocket *socket,
+    GIOCondition condition,
+    gpointer user_data)
 {
-  TpDBusDaemon *dbus;
-  TpSimpleClientFactory *factory;
+  ClientContext *context = user_data;
+  GSocketControlMessage **messages = NULL;
+  GSocket *tube_socket;
+  GInputVector vector;
+  gchar buffer[1024];
+  gint n_messages = 0;
+  gint *fds = NULL;
+  gint n_fds = 0;
+  gssize len;
+  gint i;
   GError *error = NULL;
-  ClientContext context = { 0, };
+
+  vector.buffer = buffer;
+  vector.size = sizeof (buffer) - 1;
+  len = g_socket_receive_message (socket, NULL, &vector, 1, &messages,
+      &n_messages, NULL, NULL, &error);
+  if (len < 0)
+    goto OUT;
+
+  if (n_messages == 1 && G_IS_UNIX_FD_MESSAGE (messages[0]))
+    fds = g_unix_fd_message_steal_fds (G_UNIX_FD_MESSAGE (messages[0]),
+        &n_fds);
+
+  if (n_fds != 1)
+    {
+      buffer[len] = '\0';
+      g_strchomp (buffer);
+      g_set_error (&error, G_IO_ERROR, G_IO_ERROR_FAILED, "Agent failed: %s",
+          len == 0 ? "it exited" : g_str_has_prefix (buffer, "error: ") ?
+          buffer + strlen ("error: ") : buffer);
+      goto OUT;
+    }
+
+  _trace_phase ("agent-tube", context->contact_id, context->tube_time,
+      g_get_monotonic_time ());
+
+  tube_socket = g_socket_new_from_fd (fds[0], &error);
+  if (tube_socket == NULL)
+    goto OUT;
+  fds[0] = -1;
+
+  context->tube_connection = g_socket_connection_factory_create_connection (
+      tube_socket);
+  g_object_unref (tube_socket);
+  start_session (context);
+
+OUT:
+  if (error != NULL)
+    throw_error (context, error);
+
+  for (i = 0; i < n_fds; i++)
+    {
+      if (fds[i] >= 0)
+        close (fds[i]);
+    }
+  g_free (fds);
+  for (i = 0; i < n_messages; i++)
+    g_object_unref (messages[i]);
+  g_free (messages);
+  g_clear_error (&error);
+
+  return FALSE;
+}
+
+/* The agent has accounts and contacts prepared already, it can request the
+ * tube right away */
+static gboolean
+start_agent_tube (gpointer user_data)
+{
+  ClientContext *context = user_data;
+  GOutputStream *output;
+  GSocket *socket;
+  GSource *source;
+  gchar *request;
+  GError *error = NULL;
+
+  context->tube_started = TRUE;
+  context->tube_time = g_get_monotonic_time ();
+  _trace_instant ("start-tube", context->contact_id);
+
+  if (!context->stdio && !spawn_ssh (context))
+    return FALSE;
+
+  output = g_io_stream_get_output_stream (
+      G_IO_STREAM (context->agent_connection));
+  request = g_strdup_printf ("%s\t%s\n", context->contact_id,
+      context->account_path != NULL ? context->account_path : "");
+  if (!g_output_stream_write_all (output, request, strlen (request), NULL,
+      NULL, &error))
+    {
+      throw_error (context, error);
+      g_clear_error (&error);
+      goto OUT;
+    }
+
+  socket = g_socket_connection_get_socket (context->agent_connection);
+  source = g_socket_create_source (socket, G_IO_IN, NULL);
+  g_source_set_callback (source, (GSourceFunc) agent_reply_cb, context, NULL);
+  g_source_attach (source, NULL);
+  g_source_unref (source);
+
+OUT:
+  g_free (request);
+
+  return FALSE;
+}
+
+static gboolean
+stdin_cb (GIOChannel *channel,
+    GIOCondition condition,
+    gpointer user_data)
+{
+  ClientContext *context = user_data;
+  gchar *line = NULL;
+
+  context->stdin_watch = 0;
+  _trace_phase ("prompt", NULL, context->prompt_time, g_get_monotonic_time ());
+
+  if (g_io_channel_read_line (channel, &line, NULL, NULL,
+      NULL) == G_IO_STATUS_NORMAL)
+    {
+      guint i;
+
+      i = atoi (line) - 1;
+
+      if (i < context->candidates->len)
+        {
+          CachedContact *candidate;
+
+          candidate = g_ptr_array_index (context->candidates, i);
+
+          /* The contact may not handle the tube anymore, choose_contact()
+           * starts it once accounts are prepared */
+          if (!context->preparation_done)
+            {
+              context->chosen = candidate;
+              goto OUT;
+            }
+
+          start_tube (context, candidate->account_path,
+              candidate->contact_id);
+          goto OUT;
+        }
+    }
+
+  throw_error_message (context, "Invalid contact number");
+
+OUT:
+  g_free (line);
+
+  return FALSE;
+}
+
+/* Ask which of context->candidates to use. This does not block the main loop
+ * so the contact cache can be reconciled in the meantime. */
+static void
+prompt_contact (ClientContext *context)
+{
+  GString *text;
+  const gchar *account_path = NULL;
+  guint i;
+
+  /* stdin belongs to ssh */
+  if (context->stdio)
+    {
+      throw_error_message (context,
+          "Several accounts have that contact, choose one with --account");
+      return;
+    }
+
+  text = g_string_new (NULL);
+  for (i = 0; i < context->candidates->len; i++)
+    {
+      CachedContact *candidate = g_ptr_array_index (context->candidates, i);
+
+      /* Contacts of the same account are next to each other */
+      if (tp_strdiff (account_path, candidate->account_path))
+        {
+          g_string_append_printf (text, "Account %s (%s):\n",
+              candidate->account_name, candidate->protocol);
+          account_path = candidate->account_path;
+        }
+
+      g_string_append_printf (text, "  %d) %s (%s)\n", i + 1,
+          candidate->alias, candidate->contact_id);
+    }
+
+  g_print ("%sWhich contact to use? ", text->str);
+  g_string_free (text, TRUE);
+
+  context->prompt_time = g_get_monotonic_time ();
+  if (context->stdin_channel == NULL)
+    context->stdin_channel = g_io_channel_unix_new (STDIN_FILENO);
+  context->stdin_watch = g_io_add_watch (context->stdin_channel,
+      G_IO_IN | G_IO_HUP | G_IO_ERR, stdin_cb, context);
+}
+
+/* Returns the contacts matching --account and --contact */
+static GPtrArray *
+filter_contacts (ClientContext *context,
+    GPtrArray *contacts)
+{
+  GPtrArray *result;
+  guint i;
+
+  result = g_ptr_array_new ();
+  for (i = 0; i < contacts->len; i++)
+    {
+      CachedContact *contact = g_ptr_array_index (contacts, i);
+
+      if (context->account_path != NULL &&
+          tp_strdiff (context->account_path, contact->account_path))
+        continue;
+
+      if (context->contact_id != NULL &&
+          tp_strdiff (context->contact_id, contact->contact_id))
+        continue;
+
+      g_ptr_array_add (result, contact);
+    }
+
+  return result;
+}
+
+static GPtrArray *
+copy_contacts (GPtrArray *contacts)
+{
+  GPtrArray *copy;
+  guint i;
+
+  copy = g_ptr_array_new_with_free_func (
+      (GDestroyNotify) _cached_contact_free);
+  for (i = 0; i < contacts->len; i++)
+    {
+      CachedContact *contact = g_ptr_array_index (contacts, i);
+
+      g_ptr_array_add (copy, _cached_contact_new (contact->account_path,
+          contact->account_name, contact->protocol, contact->contact_id,
+          contact->alias));
+    }
+
+  return copy;
+}
+
+static gboolean
+contact_equal (CachedContact *a,
+    CachedContact *b)
+{
+  return !tp_strdiff (a->account_path, b->account_path) &&
+      !tp_strdiff (a->contact_id, b->contact_id);
+}
+
+/* Returns the contact of @contacts equal to @contact, or NULL */
+static CachedContact *
+find_contact (GPtrArray *contacts,
+    CachedContact *contact)
+{
+  guint i;
+
+  for (i = 0; i < contacts->len; i++)
+    {
+      if (contact_equal (g_ptr_array_index (contacts, i), contact))
+        return g_ptr_array_index (contacts, i);
+    }
+
+  return NULL;
+}
+
+static gboolean
+same_contacts (GPtrArray *a,
+    GPtrArray *b)
+{
+  guint i;
+
+  if (a->len != b->len)
+    return FALSE;
+
+  for (i = 0; i < a->len; i++)
+    {
+      if (!contact_equal (g_ptr_array_index (a, i), g_ptr_array_index (b, i)))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Offer the contacts we knew last time, before Telepathy gives us its view.
+ * If that's not enough, choose_contact() will do it once accounts are
+ * prepared. */
+static gboolean
+choose_cached_contact (gpointer user_data)
+{
+  ClientContext *context = user_data;
+  GPtrArray *matches;
+
+  /* Fan-out needs every capable contact, not what was there last time */
+  if (context->fanout)
+    return FALSE;
+
+  matches = filter_contacts (context, context->cached);
+
+  if (context->contact_id != NULL)
+    {
+      if (matches->len == 1)
+        {
+          CachedContact *contact = g_ptr_array_index (matches, 0);
+
+          start_tube (context, contact->account_path, contact->contact_id);
+        }
+    }
+  else if (matches->len > 0)
+    {
+      context->candidates = copy_contacts (matches);
+      prompt_contact (context);
+    }
+
+  g_ptr_array_unref (matches);
+
+  return FALSE;
+}
+
+/* Replace cached contacts of @accounts by @contacts and save the cache */
+static void
+update_contact_cache (ClientContext *context,
+    GList *accounts,
+    GPtrArray *contacts)
+{
+  GPtrArray *updated;
+  GHashTable *prepared;
+  GList *l;
+  guint i;
+  GError *error = NULL;
+
+  prepared = g_hash_table_new (g_str_hash, g_str_equal);
+  for (l = accounts; l != NULL; l = l->next)
+    {
+      g_hash_table_insert (prepared,
+          (gpointer) tp_proxy_get_object_path (l->data), l->data);
+    }
+
+  updated = g_ptr_array_new ();
+  for (i = 0; i < context->cached->len; i++)
+    {
+      CachedContact *contact = g_ptr_array_index (context->cached, i);
+
+      if (!g_hash_table_lookup (prepared, contact->account_path))
+        g_ptr_array_add (updated, contact);
+    }
+  for (i = 0; i < contacts->len; i++)
+    g_ptr_array_add (updated, g_ptr_array_index (contacts, i));
+
+  if (!_contact_cache_save (updated, &error))
+    {
+      g_debug ("Can't save contact cache: %s", error->message);
+      g_clear_error (&error);
+    }
+
+  g_ptr_array_unref (updated);
+  g_hash_table_unref (prepared);
+}
+
+/* Append contacts of @account that can handle our tube to @contacts */
+static void
+collect_contacts (TpAccount *account,
+    GPtrArray *contacts)
+{
+  TpConnection *connection;
+  TpCapabilities *caps;
+  GPtrArray *account_contacts;
+  guint i;
+
+  connection = tp_account_get_connection (account);
+  if (connection == NULL)
+    return;
+
+  caps = tp_connection_get_capabilities (connection);
+  if (!_capabilities_has_stream_tube (caps))
+    return;
+
+  account_contacts = tp_connection_dup_contact_list (connection);
+  for (i = 0; i < account_contacts->len; i++)
+    {
+      TpContact *contact = g_ptr_array_index (account_contacts, i);
+
+      caps = tp_contact_get_capabilities (contact);
+      if (!_capabilities_has_stream_tube (caps))
+        continue;
+
+      g_ptr_array_add (contacts, _cached_contact_new (
+          tp_proxy_get_object_path (account),
+          tp_account_get_display_name (account),
+          tp_account_get_protocol (account),
+          tp_contact_get_identifier (contact),
+          tp_contact_get_alias (contact)));
+    }
+  g_ptr_array_unref (account_contacts);
+}
+
+static void
+fanout_cb (GObject *source_object,
+    GAsyncResult *res,
+    gpointer user_data)
+{
+  ClientContext *context = user_data;
+  GError *error = NULL;
+
+  if (!_fanout_run_finish (res, &error))
+    {
+      throw_error (context, error);
+      g_clear_error (&error);
+      return;
+    }
+
+  context->success = TRUE;
+  leave (context);
+}
+
+/* Run the command on the contacts of --contact, or all of @matches */
+static void
+start_fanout (ClientContext *context,
+    GPtrArray *matches)
+{
+  GPtrArray *contacts;
+  guint i;
+  guint j;
+
+  contacts = g_ptr_array_new ();
+  for (i = 0; context->fanout_ids != NULL && context->fanout_ids[i] != NULL;
+      i++)
+    {
+      for (j = 0; j < matches->len; j++)
+        {
+          CachedContact *contact = g_ptr_array_index (matches, j);
+
+          if (!tp_strdiff (contact->contact_id, context->fanout_ids[i]))
+            {
+              g_ptr_array_add (contacts, contact);
+              break;
+            }
+        }
+
+      if (j == matches->len)
+        {
+          gchar *message;
+
+          message = g_strdup_printf ("Contact %s is not available",
+              context->fanout_ids[i]);
+          throw_error_message (context, message);
+          g_free (message);
+          goto OUT;
+        }
+    }
+
+  if (context->fanout_ids == NULL)
+    {
+      for (i = 0; i < matches->len; i++)
+        g_ptr_array_add (contacts, g_ptr_array_index (matches, i));
+    }
+
+  context->tube_started = TRUE;
+  _fanout_run_async (context->factory, contacts, context->login,
+      context->ssh_opts, context->relay_engine, context->fanout_parallel,
+      fanout_cb, context);
+
+OUT:
+  g_ptr_array_unref (contacts);
+}
+
+/* Called once every account is prepared, or as soon as the tube got started
+ * since we don't care about remaining accounts anymore. */
+static void
+choose_contact (ClientContext *context)
+{
+  GPtrArray *matches;
+
+  context->preparation_done = TRUE;
+  _trace_instant ("choose-contact", NULL);
+
+  update_contact_cache (context, context->prepared_accounts,
+      context->live_contacts);
+
+  /* The cache or an early match already did the job */
+  if (context->tube_started)
+    return;
+
+  matches = filter_contacts (context, context->live_contacts);
+
+  /* The prompt offered cached contacts, reconcile it with Telepathy */
+  if (context->candidates != NULL)
+    {
+      if (context->chosen != NULL)
+        {
+          CachedContact *contact;
+
+          contact = find_contact (matches, context->chosen);
+          if (contact != NULL)
+            {
+              start_tube (context, contact->account_path,
+                  contact->contact_id);
+              goto OUT;
+            }
+
+          g_print ("%s can't be used anymore\n", context->chosen->contact_id);
+          context->chosen = NULL;
+        }
+      else if (same_contacts (context->candidates, matches))
+        {
+          goto OUT;
+        }
+
+      if (context->stdin_watch != 0)
+        {
+          g_source_remove (context->stdin_watch);
+          context->stdin_watch = 0;
+        }
+      tp_clear_pointer (&context->candidates, g_ptr_array_unref);
+      g_print ("\nThe contact list changed.\n");
+    }
+
+  if (matches->len == 0)
+    {
+      throw_error_message (context, "No suitable contact");
+    }
+  else if (context->fanout)
+    {
+      start_fanout (context, matches);
+    }
+  else if (matches->len == 1 && context->contact_id != NULL)
+    {
+      CachedContact *contact = g_ptr_array_index (matches, 0);
+
+      start_tube (context, contact->account_path, contact->contact_id);
+    }
+  else
+    {
+      context->candidates = copy_contacts (matches);
+      prompt_contact (context);
+    }
+
+OUT:
+  g_ptr_array_unref (matches);
+}
+
+static void
+account_prepared_cb (GObject *object,
+    GAsyncResult *res,
+    gpointer user_data)
+{
+  TpAccount *account = TP_ACCOUNT (object);
+  ClientContext *context = user_data;
+  GError *error = NULL;
+  guint first;
+  guint i;
+
+  context->n_preparing--;
+
+  /* The tube already started, results of remaining accounts are dropped */
+  if (context->preparation_done)
+    return;
+
+  _trace_phase ("prepare-account", tp_proxy_get_object_path (account),
+      context->prepare_time, g_get_monotonic_time ());
+
+  if (!tp_proxy_prepare_finish (TP_PROXY (account), res, &error))
+    {
+      /* Only fatal when that's the account user asked for */
+      if (context->account_path != NULL)
+        {
+          throw_error (context, error);
+          g_clear_error (&error);
+          return;
+        }
+
+      g_debug ("Can't prepare account %s: %s",
+          tp_proxy_get_object_path (account), error->message);
+      g_clear_error (&error);
+      goto OUT;
+    }
+
+  first = context->live_contacts->len;
+  collect_contacts (account, context->live_contacts);
+  context->prepared_accounts = g_list_prepend (context->prepared_accounts,
+      g_object_ref (account));
+
+  /* Don't wait for slower accounts if that's the contact we want */
+  if (context->contact_id != NULL && !context->tube_started)
+    {
+      for (i = first; i < context->live_contacts->len; i++)
+        {
+          CachedContact *contact;
+
+          contact = g_ptr_array_index (context->live_contacts, i);
+          if (!tp_strdiff (contact->contact_id, context->contact_id))
+            {
+              start_tube (context, contact->account_path,
+                  contact->contact_id);
+              break;
+            }
+        }
+    }
+
+OUT:
+  if (context->n_preparing == 0 || context->tube_started)
+    choose_contact (context);
+}
+
+static void
+prepare_account (ClientContext *context,
+    TpAccount *account)
+{
+  GQuark features[] = { TP_ACCOUNT_FEATURE_CONNECTION, 0 };
+
+  context->n_preparing++;
+  tp_proxy_prepare_async (account, features, account_prepared_cb, context);
+}
+
+static void
+account_manager_prepared_cb (GObject *object,
+    GAsyncResult *res,
+    gpointer user_data)
+{
+  TpAccountManager *manager = TP_ACCOUNT_MANAGER (object);
+  ClientContext *context = user_data;
+  GList *accounts;
+  GList *l;
+  GError *error = NULL;
+
+  if (!tp_proxy_prepare_finish (TP_PROXY (manager), res, &error))
+    {
+      throw_error (context, error);
+      g_clear_error (&error);
+      return;
+    }
+
+  _trace_phase ("prepare-account-manager", NULL, context->prepare_time,
+      g_get_monotonic_time ());
+  context->prepare_time = g_get_monotonic_time ();
+
+  /* Prepare all accounts concurrently and handle each as soon as it's ready,
+   * instead of waiting for the slowest one */
+  accounts = tp_account_manager_get_valid_accounts (manager);
+  for (l = accounts; l != NULL; l = l->next)
+    prepare_account (context, l->data);
+
+  if (accounts == NULL)
+    choose_contact (context);
+
+  g_list_free (accounts);
+}
+
+/* Prepare accounts to find contacts that can handle our tube, and offer the
+ * ones from the cache meanwhile */
+static gboolean
+start_contact_scan (ClientContext *context,
+    gint64 start,
+    GError **error)
+{
+  TpSimpleClientFactory *factory = context->factory;
+
+  /* Account features are not set on the factory, otherwise preparing the
+   * account manager would wait for every account's connection and contact
+   * list. prepare_account() asks for them one account at a time. */
+  tp_simple_client_factory_add_connection_features_varargs (factory,
+      TP_CONNECTION_FEATURE_CONTACT_LIST,
+      TP_CONNECTION_FEATURE_CAPABILITIES,
+      0);
+  tp_simple_client_factory_add_contact_features_varargs (factory,
+      TP_CONTACT_FEATURE_ALIAS,
+      TP_CONTACT_FEATURE_CAPABILITIES,
+      TP_CONTACT_FEATURE_INVALID);
+  _trace_phase ("dbus-setup", NULL, start, g_get_monotonic_time ());
+  context->prepare_time = g_get_monotonic_time ();
+
+  /* If user gave an account path, prepare only that account, otherwise prepare
+   * the whole account manager. */
+  if (context->account_path != NULL)
+    {
+      TpAccount *account;
+
+      account = tp_simple_client_factory_ensure_account (factory,
+          context->account_path, NULL, error);
+      if (account == NULL)
+        return FALSE;
+
+      prepare_account (context, account);
+      g_object_unref (account);
+    }
+  else
+    {
+      TpAccountManager *manager;
+
+      manager = tp_account_manager_new_with_factory (factory);
+
+      tp_proxy_prepare_async (manager, NULL,
+          account_manager_prepared_cb, context);
+      g_object_unref (manager);
+    }
+
+  /* Meanwhile, offer the contacts we knew last time */
+  context->cached = _contact_cache_load ();
+  g_idle_add (choose_cached_contact, context);
+
+  return TRUE;
+}
+
+/* Both --account and --contact were given, there is nothing to choose */
+static gboolean
+start_direct_tube (gpointer user_data)
+{
+  ClientContext *context = user_data;
+
+  start_tube (context, context->account_path, context->contact_id);
+
+  return FALSE;
+}
+
+/* In --stdio mode, our stdout is ssh's connection */
+static void
+print_to_stderr (const gchar *string)
+{
+  fputs (string, stderr);
+}
+
+/* Same, GLib's default handler prints debug and info messages to stdout */
+static void
+log_to_stderr (const gchar *log_domain,
+    GLogLevelFlags log_level,
+    const gchar *message,
+    gpointer user_data)
+{
+  const gchar *domains;
+
+  /* Filtered like the default handler does */
+  if (log_level & (G_LOG_LEVEL_DEBUG | G_LOG_LEVEL_INFO))
+    {
+      domains = g_getenv ("G_MESSAGES_DEBUG");
+      if (domains == NULL)
+        return;
+
+      if (tp_strdiff (domains, "all") &&
+          (log_domain == NULL || strstr (domains, log_domain) == NULL))
+        return;
+    }
+
+  if (log_domain != NULL)
+    fprintf (stderr, "%s: %s\n", log_domain, message);
+  else
+    fprintf (stderr, "%s\n", message);
+}
+
+static void
+client_context_clear (ClientContext *context)
+{
+  tp_clear_pointer (&context->loop, g_main_loop_unref);
+  g_free (context->argv0);
+  g_free (context->account_path);
+  g_free (context->contact_id);
+  g_free (context->login);
+  g_strfreev (context->ssh_opts);
+  fdpass_cleanup (context);
+  g_free (context->mux_path);
+  tp_clear_object (&context->agent_connection);
+  g_strfreev (context->fanout_ids);
+
+  if (context->stdin_watch != 0)
+    g_source_remove (context->stdin_watch);
+  tp_clear_pointer (&context->stdin_channel, g_io_channel_unref);
+  tp_clear_pointer (&context->cached, g_ptr_array_unref);
+  tp_clear_pointer (&context->candidates, g_ptr_array_unref);
+  tp_clear_object (&context->factory);
+  g_list_free_full (context->prepared_accounts, g_object_unref);
+  tp_clear_pointer (&context->live_contacts, g_ptr_array_unref);
+
+  tp_clear_object (&context->channel);
+  tp_clear_object (&context->tube_connection);
+  tp_clear_object (&context->ssh_connection);
+  tp_clear_object (&context->fdpass_connection);
+  tp_clear_pointer (&context->relay_stats, _relay_stats_free);
+}
+
+int
+main (gint argc, gchar *argv[])
+{
+  TpDBusDaemon *dbus;
+  TpSimpleClientFactory *factory;
+  GError *error = NULL;
+  ClientContext context = { 0, };
+  gchar *relay_engine = NULL;
+  gchar *fdpass_helper = NULL;
+  gchar *trace_file = NULL;
+  gint buffer_min = RELAY_DEFAULT_BUFFER_MIN;
+  gint buffer_max = RELAY_DEFAULT_BUFFER_MAX;
+  gint64 start;
+  gboolean mux_master = FALSE;
+  gboolean agent = FALSE;
+  gboolean no_agent = FALSE;
+  gint mux_linger = DEFAULT_MUX_LINGER;
+  gint fanout_parallel = DEFAULT_FANOUT_PARALLEL;
+  gchar *stdio_contact = NULL;
   GOptionContext *optcontext;
   GOptionEntry options[] = {
       { "account", 'a',
@@ -391,6 +1552,72 @@ main (gint argc, gchar *argv[])
         0, G_OPTION_ARG_STRING, &context.login,
         "Specifies the user to log in as on the remote machine",
         NULL },
+      { "relay-engine", 0,
+        0, G_OPTION_ARG_STRING, &relay_engine,
+        "How to relay data: auto, gio, splice or uring (default: auto)",
+        "ENGINE" },
+      { "relay-buffer-min", 0,
+        0, G_OPTION_ARG_INT, &buffer_min,
+        "Smallest relay buffer, used by interactive sessions (default: "
+        G_STRINGIFY (RELAY_DEFAULT_BUFFER_MIN) ")",
+        "BYTES" },
+      { "relay-buffer-max", 0,
+        0, G_OPTION_ARG_INT, &buffer_max,
+        "Largest relay buffer, reached by bulk transfers (default: "
+        G_STRINGIFY (RELAY_DEFAULT_BUFFER_MAX) ")",
+        "BYTES" },
+      { "fdpass", 0,
+        0, G_OPTION_ARG_NONE, &context.fdpass,
+        "Give the tube directly to ssh with ProxyUseFdpass instead of "
+        "relaying it (needs OpenSSH >= 6.5)",
+        NULL },
+      { "trace", 0,
+        0, G_OPTION_ARG_FILENAME, &trace_file,
+        "Write connection setup timings to FILE, in Chrome trace event "
+        "format (default: $SSH_CONTACT_TRACE)",
+        "FILE" },
+      { "mux", 0,
+        0, G_OPTION_ARG_NONE, &context.mux,
+        "Share one tube per contact between ssh sessions",
+        NULL },
+      { "mux-linger", 0,
+        0, G_OPTION_ARG_INT, &mux_linger,
+        "Keep a shared tube open SECONDS after its last session (default: "
+        G_STRINGIFY (DEFAULT_MUX_LINGER) ")",
+        "SECONDS" },
+      { "stdio", 0,
+        0, G_OPTION_ARG_STRING, &stdio_contact,
+        "Relay a tube to CONTACT on stdin and stdout instead of running ssh, "
+        "for use as ssh's ProxyCommand",
+        "CONTACT" },
+      { "fanout", 0,
+        0, G_OPTION_ARG_NONE, &context.fanout,
+        "Run the ssh command on every suitable contact concurrently, or on "
+        "the comma separated contacts of --contact, and print their output "
+        "prefixed by contact",
+        NULL },
+      { "parallel", 0,
+        0, G_OPTION_ARG_INT, &fanout_parallel,
+        "Contacts to run the --fanout command on at the same time (default: "
+        G_STRINGIFY (DEFAULT_FANOUT_PARALLEL) ")",
+        "N" },
+      { "agent", 0,
+        0, G_OPTION_ARG_NONE, &agent,
+        "Run the resident agent, which keeps accounts and contacts prepared "
+        "for other ssh-contact runs",
+        NULL },
+      { "no-agent", 0,
+        0, G_OPTION_ARG_NONE, &no_agent,
+        "Don't ask the resident agent for the tube",
+        NULL },
+      { "mux-master", 0,
+        G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_NONE, &mux_master,
+        NULL,
+        NULL },
+      { "fdpass-helper", 0,
+        G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_FILENAME, &fdpass_helper,
+        NULL,
+        NULL },
       { G_OPTION_REMAINING, 0,
         0, G_OPTION_ARG_STRING_ARRAY, &context.ssh_opts,
         NULL,
@@ -400,6 +1627,8 @@ main (gint argc, gchar *argv[])
 
   g_type_init ();
 
+  context.start_time = g_get_monotonic_time ();
+
   optcontext = g_option_context_new ("-- [OPTIONS FOR SSH CLIENT]");
   g_option_context_add_main_entries (optcontext, options, NULL);
   if (!g_option_context_parse (optcontext, &argc, &argv, &error))
@@ -410,72 +1639,208 @@ main (gint argc, gchar *argv[])
     }
   g_option_context_free (optcontext);
 
+  /* We are ssh's ProxyCommand, stdout belongs to ssh */
+  if (fdpass_helper != NULL)
+    {
+      gboolean success;
+
+      success = _client_fdpass_helper (fdpass_helper, &error);
+      if (!success)
+        g_printerr ("Error: %s\n", error->message);
+
+      g_clear_error (&error);
+      g_free (fdpass_helper);
+      g_free (relay_engine);
+      g_free (trace_file);
+      client_context_clear (&context);
+
+      return success ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+  if (mux_linger < 0)
+    {
+      g_print ("Invalid mux linger time %d\n", mux_linger);
+      g_free (relay_engine);
+      g_free (trace_file);
+      client_context_clear (&context);
+      return EXIT_FAILURE;
+    }
+  context.mux_linger = mux_linger;
+
+  /* We were spawned by start_mux_stream(), keep the tube open for sessions
+   * to come */
+  if (mux_master)
+    {
+      gboolean success = FALSE;
+
+      if (context.account_path == NULL || context.contact_id == NULL)
+        g_set_error (&error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+            "--mux-master needs --account and --contact");
+      else
+        success = _mux_master_run (context.account_path, context.contact_id,
+            context.mux_linger, &error);
+
+      if (!success)
+        g_debug ("Mux master: %s", error->message);
+
+      g_clear_error (&error);
+      g_free (relay_engine);
+      g_free (trace_file);
+      client_context_clear (&context);
+
+      return success ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+  if (agent)
+    {
+      gboolean success;
+
+      tp_debug_set_flags (g_getenv ("SSH_CONTACT_DEBUG"));
+
+      success = _agent_run (&error);
+      if (!success)
+        g_print ("Error: %s\n", error->message);
+
+      g_clear_error (&error);
+      g_free (relay_engine);
+      g_free (trace_file);
+      client_context_clear (&context);
+
+      return success ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+  if (stdio_contact != NULL)
+    {
+      g_set_print_handler (print_to_stderr);
+      g_log_set_default_handler (log_to_stderr, NULL);
+
+      if (context.contact_id != NULL || context.fanout || context.fdpass)
+        {
+          g_print ("--stdio can't be used with --contact, --fanout or "
+              "--fdpass\n");
+          g_free (stdio_contact);
+          g_free (relay_engine);
+          g_free (trace_file);
+          client_context_clear (&context);
+          return EXIT_FAILURE;
+        }
+
+      context.stdio = TRUE;
+      context.contact_id = stdio_contact;
+    }
+
+  if (context.fanout)
+    {
+      const gchar *message = NULL;
+
+      if (fanout_parallel <= 0)
+        message = "Invalid --parallel value";
+      else if (context.ssh_opts == NULL)
+        message = "--fanout needs a command, give it after --";
+      else if (context.mux || context.fdpass)
+        message = "--fanout can't be used with --mux or --fdpass";
+
+      if (message != NULL)
+        {
+          g_print ("%s\n", message);
+          g_free (relay_engine);
+          g_free (trace_file);
+          client_context_clear (&context);
+          return EXIT_FAILURE;
+        }
+
+      context.fanout_parallel = fanout_parallel;
+      if (context.contact_id != NULL)
+        {
+          context.fanout_ids = g_strsplit (context.contact_id, ",", -1);
+          tp_clear_pointer (&context.contact_id, g_free);
+        }
+    }
+
+  if (relay_engine != NULL &&
+      !_relay_engine_from_string (relay_engine, &context.relay_engine))
+    {
+      g_print ("Unknown relay engine '%s'\n", relay_engine);
+      g_free (relay_engine);
+      g_free (trace_file);
+      return EXIT_FAILURE;
+    }
+  g_free (relay_engine);
+
+  if (buffer_min <= 0 || buffer_max < buffer_min)
+    {
+      g_print ("Invalid relay buffer sizes: %d to %d\n", buffer_min,
+          buffer_max);
+      g_free (trace_file);
+      return EXIT_FAILURE;
+    }
+  _relay_set_buffer_size (buffer_min, buffer_max);
+
+  if (trace_file == NULL)
+    trace_file = g_strdup (g_getenv ("SSH_CONTACT_TRACE"));
+  if (trace_file != NULL && trace_file[0] != '\0')
+    _trace_open (trace_file);
+  g_free (trace_file);
+
   context.argv0 = g_strdup (argv[0]);
   g_set_application_name (PACKAGE_NAME);
   tp_debug_set_flags (g_getenv ("SSH_CONTACT_DEBUG"));
 
+  context.live_contacts = g_ptr_array_new_with_free_func (
+      (GDestroyNotify) _cached_contact_free);
+
+  start = g_get_monotonic_time ();
   dbus = tp_dbus_daemon_dup (&error);
   if (dbus == NULL)
     goto OUT;
 
-  /* Create a factory and define the features we need */
+  /* Fixup account path if needed */
+  if (context.account_path != NULL &&
+      !g_str_has_prefix (context.account_path, TP_ACCOUNT_OBJECT_PATH_BASE))
+    {
+      gchar *account_id = context.account_path;
+
+      context.account_path = g_strconcat (TP_ACCOUNT_OBJECT_PATH_BASE,
+          account_id, NULL);
+
+      g_free (account_id);
+    }
+
   factory = (TpSimpleClientFactory *) tp_automatic_client_factory_new (dbus);
-  tp_simple_client_factory_add_account_features_varargs (factory,
-      TP_ACCOUNT_FEATURE_CONNECTION,
-      0);
-  tp_simple_client_factory_add_connection_features_varargs (factory,
-      TP_CONNECTION_FEATURE_CONTACT_LIST,
-      TP_CONNECTION_FEATURE_CAPABILITIES,
-      0);
-  tp_simple_client_factory_add_contact_features_varargs (factory,
-      TP_CONTACT_FEATURE_ALIAS,
-      TP_CONTACT_FEATURE_CAPABILITIES,
-      TP_CONTACT_FEATURE_INVALID);
+  context.factory = factory;
   g_object_unref (dbus);
 
-  /* If user gave an account path, prepare only that account, otherwise prepare
-   * the whole account manager. */
-  if (context.account_path != NULL)
+  /* The agent knows the contact already, and has our account prepared */
+  if (context.contact_id != NULL && !context.fanout && !context.mux &&
+      !no_agent)
     {
-      TpAccount *account;
-      GArray *features;
-
-      /* Fixup account path if needed */
-      if (!g_str_has_prefix (context.account_path, TP_ACCOUNT_OBJECT_PATH_BASE))
+      context.agent_connection = connect_agent (&error);
+      if (context.agent_connection == NULL)
         {
-          gchar *account_id = context.account_path;
-
-          context.account_path = g_strconcat (TP_ACCOUNT_OBJECT_PATH_BASE,
-            account_id, NULL);
-
-           g_free (account_id);
+          g_debug ("No agent running: %s", error->message);
+          g_clear_error (&error);
         }
+    }
 
-      account = tp_simple_client_factory_ensure_account (factory,
-          context.account_path, NULL, &error);
-      if (account == NULL)
-        goto OUT;
-
-      features = tp_simple_client_factory_dup_account_features (factory,
-          account);
-
-      tp_proxy_prepare_async (account, (GQuark *) features->data,
-          account_prepared_cb, &context);
-
-      g_object_unref (account);
-      g_array_unref (features);
+  /* Scripted use: the channel dispatcher only needs the account path and the
+   * contact identifier, so request the tube right away instead of preparing
+   * the account and downloading its roster. An offline account or a contact
+   * without the tube capability makes the request fail. */
+  if (context.agent_connection != NULL)
+    {
+      _trace_phase ("dbus-setup", NULL, start, g_get_monotonic_time ());
+      g_idle_add (start_agent_tube, &context);
     }
-  else
+  else if (context.account_path != NULL && context.contact_id != NULL &&
+      !context.fanout)
     {
-      TpAccountManager *manager;
-
-      manager = tp_account_manager_new_with_factory (factory);
-
-      tp_proxy_prepare_async (manager, NULL,
-          account_manager_prepared_cb, &context);
-      g_object_unref (manager);
+      _trace_phase ("dbus-setup", NULL, start, g_get_monotonic_time ());
+      g_idle_add (start_direct_tube, &context);
+    }
+  else if (!start_contact_scan (&context, start, &error))
+    {
+      goto OUT;
     }
-  g_object_unref (factory);
 
   context.loop = g_main_loop_new (NULL, FALSE);
   g_main_loop_run (context.loop);
@@ -489,6 +1854,13 @@ OUT:
     }
 
   g_clear_error (&error);
+
+  if (!_trace_close (&error))
+    {
+      g_print ("Can't write trace: %s\n", error->message);
+      g_clear_error (&error);
+    }
+
   client_context_clear (&context);
 
   return context.success ? EXIT_SUCCESS : EXIT_FAILURE;
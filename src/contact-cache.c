@@ -0,0 +1,218 @@
+/*
+ * Copyright (C) 2010 Xavier Claessens <xclaesse@gmail.com>
+ * Copyright (C) 2010 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include "contact-cache.h"
+
+/* File layout: a header followed by n_contacts records, each made of
+ * N_FIELDS nul-terminated UTF-8 strings. Bump CACHE_VERSION whenever this
+ * changes, old caches are then ignored. */
+#define CACHE_MAGIC "SSHCTCT"
+#define CACHE_VERSION 1
+#define N_FIELDS 5
+
+typedef struct
+{
+  gchar magic[8];
+  guint32 version;
+  guint32 n_contacts;
+} CacheHeader;
+
+CachedContact *
+_cached_contact_new (const gchar *account_path,
+    const gchar *account_name,
+    const gchar *protocol,
+    const gchar *contact_id,
+    const gchar *alias)
+{
+  CachedContact *contact;
+
+  contact = g_slice_new0 (CachedContact);
+  contact->account_path = g_strdup (account_path);
+  contact->account_name = g_strdup (account_name ? account_name : "");
+  contact->protocol = g_strdup (protocol ? protocol : "");
+  contact->contact_id = g_strdup (contact_id);
+  contact->alias = g_strdup (alias ? alias : contact_id);
+
+  return contact;
+}
+
+void
+_cached_contact_free (CachedContact *contact)
+{
+  g_free (contact->account_path);
+  g_free (contact->account_name);
+  g_free (contact->protocol);
+  g_free (contact->contact_id);
+  g_free (contact->alias);
+
+  g_slice_free (CachedContact, contact);
+}
+
+static gchar *
+cache_filename (void)
+{
+  return g_build_filename (g_get_user_cache_dir (), "ssh-contact",
+      "contacts.cache", NULL);
+}
+
+/* Returns the next string in the mapped file, or NULL if it's truncated */
+static const gchar *
+next_field (const gchar **p,
+    const gchar *end)
+{
+  const gchar *field = *p;
+  const gchar *nul;
+
+  nul = memchr (field, '\0', end - field);
+  if (nul == NULL)
+    return NULL;
+
+  *p = nul + 1;
+
+  return field;
+}
+
+/* The cache is only an optimisation, any problem with it just gives an empty
+ * list and we wait for Telepathy like if it didn't exist. */
+GPtrArray *
+_contact_cache_load (void)
+{
+  GPtrArray *contacts;
+  GMappedFile *file;
+  gchar *filename;
+  const CacheHeader *header;
+  const gchar *p;
+  const gchar *end;
+  guint32 n_contacts;
+  guint i;
+  GError *error = NULL;
+
+  contacts = g_ptr_array_new_with_free_func (
+      (GDestroyNotify) _cached_contact_free);
+
+  filename = cache_filename ();
+  file = g_mapped_file_new (filename, FALSE, &error);
+  if (file == NULL)
+    {
+      g_debug ("No contact cache: %s", error->message);
+      goto OUT;
+    }
+
+  p = g_mapped_file_get_contents (file);
+  end = p + g_mapped_file_get_length (file);
+  header = (const CacheHeader *) p;
+
+  if (end - p < (gssize) sizeof (CacheHeader) ||
+      memcmp (header->magic, CACHE_MAGIC, sizeof (header->magic)) != 0 ||
+      GUINT32_FROM_LE (header->version) != CACHE_VERSION)
+    {
+      g_debug ("Ignoring contact cache with unknown format");
+      goto OUT;
+    }
+
+  n_contacts = GUINT32_FROM_LE (header->n_contacts);
+  p += sizeof (CacheHeader);
+
+  for (i = 0; i < n_contacts; i++)
+    {
+      const gchar *fields[N_FIELDS];
+      guint j;
+
+      for (j = 0; j < N_FIELDS; j++)
+        {
+          fields[j] = next_field (&p, end);
+          if (fields[j] == NULL)
+            {
+              g_debug ("Contact cache is truncated, ignoring it");
+              g_ptr_array_set_size (contacts, 0);
+              goto OUT;
+            }
+        }
+
+      g_ptr_array_add (contacts, _cached_contact_new (fields[0], fields[1],
+          fields[2], fields[3], fields[4]));
+    }
+
+OUT:
+  if (file != NULL)
+    g_mapped_file_unref (file);
+
+  g_free (filename);
+  g_clear_error (&error);
+
+  return contacts;
+}
+
+gboolean
+_contact_cache_save (GPtrArray *contacts,
+    GError **error)
+{
+  GString *data;
+  CacheHeader header = { CACHE_MAGIC, };
+  gchar *filename;
+  gchar *dirname;
+  gboolean success = FALSE;
+  guint i;
+
+  header.version = GUINT32_TO_LE (CACHE_VERSION);
+  header.n_contacts = GUINT32_TO_LE (contacts->len);
+
+  data = g_string_new_len ((const gchar *) &header, sizeof (header));
+  for (i = 0; i < contacts->len; i++)
+    {
+      CachedContact *contact = g_ptr_array_index (contacts, i);
+
+      /* Include the nul terminators */
+      g_string_append_len (data, contact->account_path,
+          strlen (contact->account_path) + 1);
+      g_string_append_len (data, contact->account_name,
+          strlen (contact->account_name) + 1);
+      g_string_append_len (data, contact->protocol,
+          strlen (contact->protocol) + 1);
+      g_string_append_len (data, contact->contact_id,
+          strlen (contact->contact_id) + 1);
+      g_string_append_len (data, contact->alias,
+          strlen (contact->alias) + 1);
+    }
+
+  filename = cache_filename ();
+  dirname = g_path_get_dirname (filename);
+  if (g_mkdir_with_parents (dirname, 0700) < 0)
+    {
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+          "Can't create %s: %s", dirname, g_strerror (errno));
+      goto OUT;
+    }
+
+  /* Atomically replaces the file, readers never see a partial cache */
+  success = g_file_set_contents (filename, data->str, data->len, error);
+
+OUT:
+  g_string_free (data, TRUE);
+  g_free (filename);
+  g_free (dirname);
+
+  return success;
+}
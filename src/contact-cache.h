@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2010 Xavier Claessens <xclaesse@gmail.com>
+ * Copyright (C) 2010 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA  02110-1301  USA
+ */
+
+#ifndef __CONTACT_CACHE_H__
+#define __CONTACT_CACHE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* A contact that advertised our tube service last time we looked */
+typedef struct
+{
+  gchar *account_path;
+  gchar *account_name;
+  gchar *protocol;
+  gchar *contact_id;
+  gchar *alias;
+} CachedContact;
+
+CachedContact *_cached_contact_new (const gchar *account_path,
+    const gchar *account_name, const gchar *protocol, const gchar *contact_id,
+    const gchar *alias);
+
+void _cached_contact_free (CachedContact *contact);
+
+GPtrArray *_contact_cache_load (void);
+
+gboolean _contact_cache_save (GPtrArray *contacts, GError **error);
+
+G_END_DECLS
+
+#endif /* #ifndef __CONTACT_CACHE_H__*/
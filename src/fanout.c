@@ -0,0 +1,505 @@
+/*
+ * Copyright (C) 2010 Xavier Claessens <xclaesse@gmail.com>
+ * Copyright (C) 2010 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <sys/wait.h>
+
+#include <gio/gio.h>
+#include <gio/gunixinputstream.h>
+#include <telepathy-glib/telepathy-glib.h>
+
+#include "client-helpers.h"
+#include "contact-cache.h"
+#include "fanout.h"
+
+/* Run the same ssh command on many contacts, at most @parallel at a time.
+ * Each job has its own tube and ssh client, relayed through a loopback
+ * socket like a regular session. Lines ssh prints are prefixed by the
+ * contact they come from. */
+
+/* Longest prefix, longer contact ids don't get aligned */
+#define FANOUT_PREFIX_MAX 32
+
+typedef struct _FanoutData FanoutData;
+
+typedef struct
+{
+  FanoutData *fanout;
+  gchar *account_path;
+  gchar *contact_id;
+
+  TpChannel *channel;
+  GSocketConnection *tube_connection;
+  GSocketConnection *ssh_connection;
+  /* Cancelled once ssh exited, to stop accepting and relaying */
+  GCancellable *cancellable;
+
+  /* Operations to wait for before the job is over */
+  guint n_pending;
+  gint status;
+  GError *error;
+} FanoutJob;
+
+struct _FanoutData
+{
+  GSimpleAsyncResult *simple;
+  TpSimpleClientFactory *factory;
+  gchar *login;
+  gchar **ssh_opts;
+  RelayEngine engine;
+  guint parallel;
+
+  GQueue queue;
+  guint n_running;
+  guint n_jobs;
+  guint n_failed;
+  gint prefix_width;
+  gboolean completed;
+};
+
+/* One of ssh's stdout or stderr */
+typedef struct
+{
+  FanoutJob *job;
+  GDataInputStream *stream;
+  gboolean is_stderr;
+} FanoutOutput;
+
+static void fanout_next (FanoutData *fanout);
+
+static void
+fanout_job_free (FanoutJob *job)
+{
+  g_free (job->account_path);
+  g_free (job->contact_id);
+  tp_clear_object (&job->channel);
+  tp_clear_object (&job->tube_connection);
+  tp_clear_object (&job->ssh_connection);
+  tp_clear_object (&job->cancellable);
+  g_clear_error (&job->error);
+
+  g_slice_free (FanoutJob, job);
+}
+
+static void
+fanout_data_free (FanoutData *fanout)
+{
+  g_queue_foreach (&fanout->queue, (GFunc) fanout_job_free, NULL);
+  g_queue_clear (&fanout->queue);
+  g_object_unref (fanout->factory);
+  g_free (fanout->login);
+  g_strfreev (fanout->ssh_opts);
+
+  g_slice_free (FanoutData, fanout);
+}
+
+static void
+fanout_print (FanoutJob *job,
+    gboolean is_stderr,
+    const gchar *line)
+{
+  FanoutData *fanout = job->fanout;
+
+  /* Whole lines at once, so jobs don't garble each other's output */
+  if (is_stderr)
+    g_printerr ("%-*s | %s\n", fanout->prefix_width, job->contact_id, line);
+  else
+    g_print ("%-*s | %s\n", fanout->prefix_width, job->contact_id, line);
+}
+
+static void
+fanout_job_fail (FanoutJob *job,
+    const GError *error)
+{
+  if (job->error == NULL)
+    job->error = g_error_copy (error);
+
+  g_cancellable_cancel (job->cancellable);
+}
+
+static void
+channel_closed_cb (GObject *source_object,
+    GAsyncResult *res,
+    gpointer user_data)
+{
+  FanoutJob *job = user_data;
+  FanoutData *fanout = job->fanout;
+  GError *error = NULL;
+
+  if (!tp_channel_close_finish (job->channel, res, &error))
+    {
+      g_debug ("Can't close tube to %s: %s", job->contact_id, error->message);
+      g_clear_error (&error);
+    }
+
+  fanout_job_free (job);
+  fanout->n_running--;
+  fanout_next (fanout);
+}
+
+/* Everything the job started is over, report how it went */
+static void
+fanout_job_over (FanoutJob *job)
+{
+  FanoutData *fanout = job->fanout;
+  gchar *message = NULL;
+
+  if (job->error != NULL)
+    message = g_strdup_printf ("Error: %s", job->error->message);
+  else if (!WIFEXITED (job->status))
+    message = g_strdup ("ssh exited abnormally");
+  else if (WEXITSTATUS (job->status) != 0)
+    message = g_strdup_printf ("ssh exited with status %d",
+        WEXITSTATUS (job->status));
+
+  if (message != NULL)
+    {
+      fanout_print (job, TRUE, message);
+      fanout->n_failed++;
+      g_free (message);
+    }
+
+  if (job->channel != NULL && tp_proxy_get_invalidated (job->channel) == NULL)
+    {
+      tp_channel_close_async (job->channel, channel_closed_cb, job);
+      return;
+    }
+
+  fanout_job_free (job);
+  fanout->n_running--;
+  fanout_next (fanout);
+}
+
+static void
+fanout_job_done (FanoutJob *job)
+{
+  g_assert (job->n_pending > 0);
+
+  job->n_pending--;
+  if (job->n_pending == 0)
+    fanout_job_over (job);
+}
+
+static void
+output_read_cb (GObject *source_object,
+    GAsyncResult *res,
+    gpointer user_data)
+{
+  FanoutOutput *output = user_data;
+  FanoutJob *job = output->job;
+  gchar *line;
+  GError *error = NULL;
+
+  line = g_data_input_stream_read_line_finish (output->stream, res, NULL,
+      &error);
+  if (line == NULL)
+    {
+      if (error != NULL)
+        {
+          g_debug ("Can't read ssh output for %s: %s", job->contact_id,
+              error->message);
+          g_clear_error (&error);
+        }
+
+      g_object_unref (output->stream);
+      g_slice_free (FanoutOutput, output);
+      fanout_job_done (job);
+      return;
+    }
+
+  fanout_print (job, output->is_stderr, line);
+  g_free (line);
+
+  g_data_input_stream_read_line_async (output->stream, G_PRIORITY_DEFAULT,
+      NULL, output_read_cb, output);
+}
+
+static void
+fanout_job_read_output (FanoutJob *job,
+    gint fd,
+    gboolean is_stderr)
+{
+  FanoutOutput *output;
+  GInputStream *pipe_stream;
+
+  output = g_slice_new0 (FanoutOutput);
+  output->job = job;
+  output->is_stderr = is_stderr;
+
+  pipe_stream = g_unix_input_stream_new (fd, TRUE);
+  output->stream = g_data_input_stream_new (pipe_stream);
+  g_object_unref (pipe_stream);
+
+  job->n_pending++;
+  g_data_input_stream_read_line_async (output->stream, G_PRIORITY_DEFAULT,
+      NULL, output_read_cb, output);
+}
+
+static void
+ssh_client_watch_cb (GPid pid,
+    gint status,
+    gpointer user_data)
+{
+  FanoutJob *job = user_data;
+
+  job->status = status;
+  g_spawn_close_pid (pid);
+
+  /* ssh may have exited before connecting to us */
+  g_cancellable_cancel (job->cancellable);
+  fanout_job_done (job);
+}
+
+static void
+splice_cb (GObject *source_object,
+    GAsyncResult *res,
+    gpointer user_data)
+{
+  FanoutJob *job = user_data;
+  GError *error = NULL;
+
+  /* ssh's exit status tells whether the command worked */
+  if (!_relay_splice_finish (res, &error) &&
+      !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    g_debug ("Relay for %s failed: %s", job->contact_id, error->message);
+  g_clear_error (&error);
+
+  /* The tube is closed, let ssh know */
+  g_io_stream_close (G_IO_STREAM (job->ssh_connection), NULL, NULL);
+  fanout_job_done (job);
+}
+
+static void
+ssh_socket_connected_cb (GObject *source_object,
+    GAsyncResult *res,
+    gpointer user_data)
+{
+  FanoutJob *job = user_data;
+  GSocketListener *listener = G_SOCKET_LISTENER (source_object);
+  GError *error = NULL;
+
+  job->ssh_connection = g_socket_listener_accept_finish (listener, res, NULL,
+      &error);
+  if (job->ssh_connection == NULL)
+    {
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        fanout_job_fail (job, error);
+      g_clear_error (&error);
+      goto OUT;
+    }
+
+  job->n_pending++;
+  _relay_splice_async (G_IO_STREAM (job->tube_connection),
+      G_IO_STREAM (job->ssh_connection), job->fanout->engine, NULL, NULL,
+      job->cancellable, splice_cb, job);
+
+OUT:
+  fanout_job_done (job);
+}
+
+/* Run ssh with its output piped to us, connecting to a loopback socket that
+ * we relay to the tube */
+static void
+fanout_job_spawn (FanoutJob *job)
+{
+  FanoutData *fanout = job->fanout;
+  GSocketListener *listener;
+  GSocket *socket;
+  GStrv args = NULL;
+  GPid pid;
+  gint stdout_fd;
+  gint stderr_fd;
+  GError *error = NULL;
+
+  listener = g_socket_listener_new ();
+  socket = _client_create_local_socket (&error);
+  if (socket == NULL)
+    goto OUT;
+  if (!g_socket_listen (socket, &error))
+    goto OUT;
+  if (!g_socket_listener_add_socket (listener, socket, NULL, &error))
+    goto OUT;
+
+  args = _client_create_exec_args (socket, job->contact_id, fanout->login,
+      fanout->ssh_opts);
+
+  /* stdin is /dev/null, jobs can't share our terminal */
+  if (!g_spawn_async_with_pipes (NULL, args, NULL,
+      G_SPAWN_SEARCH_PATH | G_SPAWN_DO_NOT_REAP_CHILD, NULL, NULL, &pid,
+      NULL, &stdout_fd, &stderr_fd, &error))
+    goto OUT;
+
+  job->n_pending++;
+  g_child_watch_add (pid, ssh_client_watch_cb, job);
+  fanout_job_read_output (job, stdout_fd, FALSE);
+  fanout_job_read_output (job, stderr_fd, TRUE);
+
+  job->n_pending++;
+  g_socket_listener_accept_async (listener, job->cancellable,
+      ssh_socket_connected_cb, job);
+
+OUT:
+  if (error != NULL)
+    fanout_job_fail (job, error);
+
+  g_clear_error (&error);
+  g_strfreev (args);
+  tp_clear_object (&listener);
+  tp_clear_object (&socket);
+}
+
+static void
+create_tube_cb (GObject *source_object,
+    GAsyncResult *res,
+    gpointer user_data)
+{
+  FanoutJob *job = user_data;
+  GError *error = NULL;
+
+  job->tube_connection = _client_create_tube_finish (res, &job->channel,
+      &error);
+  if (job->tube_connection == NULL)
+    {
+      fanout_job_fail (job, error);
+      g_clear_error (&error);
+    }
+  else
+    {
+      fanout_job_spawn (job);
+    }
+
+  fanout_job_done (job);
+}
+
+static void
+fanout_job_start (FanoutJob *job)
+{
+  TpAccount *account;
+  GError *error = NULL;
+
+  /* Held until we're done starting, so a failure can't end the job early */
+  job->n_pending = 1;
+
+  account = tp_simple_client_factory_ensure_account (job->fanout->factory,
+      job->account_path, NULL, &error);
+  if (account == NULL)
+    {
+      fanout_job_fail (job, error);
+      g_clear_error (&error);
+      goto OUT;
+    }
+
+  job->n_pending++;
+  _client_create_tube_async (account, job->contact_id, TUBE_SERVICE,
+      create_tube_cb, job);
+  g_object_unref (account);
+
+OUT:
+  fanout_job_done (job);
+}
+
+/* Start queued jobs while there is room, complete once they are all over */
+static void
+fanout_next (FanoutData *fanout)
+{
+  GSimpleAsyncResult *simple = fanout->simple;
+
+  while (fanout->n_running < fanout->parallel &&
+      !g_queue_is_empty (&fanout->queue))
+    {
+      fanout->n_running++;
+      fanout_job_start (g_queue_pop_head (&fanout->queue));
+    }
+
+  /* Jobs failing right away call us back from within the loop above */
+  if (fanout->n_running > 0 || fanout->completed)
+    return;
+
+  fanout->completed = TRUE;
+
+  if (fanout->n_failed > 0)
+    g_simple_async_result_set_error (simple, G_IO_ERROR, G_IO_ERROR_FAILED,
+        "%u of %u contacts failed", fanout->n_failed, fanout->n_jobs);
+
+  g_simple_async_result_complete_in_idle (simple);
+  g_object_unref (simple);
+}
+
+/* Run ssh with @ssh_opts on each of @contacts, an array of CachedContact */
+void
+_fanout_run_async (TpSimpleClientFactory *factory,
+    GPtrArray *contacts,
+    const gchar *login,
+    gchar **ssh_opts,
+    RelayEngine engine,
+    guint parallel,
+    GAsyncReadyCallback callback,
+    gpointer user_data)
+{
+  FanoutData *fanout;
+  guint i;
+
+  g_return_if_fail (parallel > 0);
+
+  fanout = g_slice_new0 (FanoutData);
+  fanout->simple = g_simple_async_result_new (NULL, callback, user_data,
+      _fanout_run_async);
+  fanout->factory = g_object_ref (factory);
+  fanout->login = g_strdup (login);
+  fanout->ssh_opts = g_strdupv (ssh_opts);
+  fanout->engine = engine;
+  fanout->parallel = parallel;
+  g_queue_init (&fanout->queue);
+  g_simple_async_result_set_op_res_gpointer (fanout->simple, fanout,
+      (GDestroyNotify) fanout_data_free);
+
+  for (i = 0; i < contacts->len; i++)
+    {
+      CachedContact *contact = g_ptr_array_index (contacts, i);
+      FanoutJob *job;
+
+      job = g_slice_new0 (FanoutJob);
+      job->fanout = fanout;
+      job->account_path = g_strdup (contact->account_path);
+      job->contact_id = g_strdup (contact->contact_id);
+      job->cancellable = g_cancellable_new ();
+      g_queue_push_tail (&fanout->queue, job);
+
+      fanout->prefix_width = MAX (fanout->prefix_width,
+          (gint) MIN (strlen (contact->contact_id), FANOUT_PREFIX_MAX));
+    }
+  fanout->n_jobs = contacts->len;
+
+  fanout_next (fanout);
+}
+
+/* Fails if any contact failed, each of them was already reported */
+gboolean
+_fanout_run_finish (GAsyncResult *res,
+    GError **error)
+{
+  g_return_val_if_fail (g_simple_async_result_is_valid (res, NULL,
+      _fanout_run_async), FALSE);
+
+  return !g_simple_async_result_propagate_error (G_SIMPLE_ASYNC_RESULT (res),
+      error);
+}
@@ -0,0 +1,368 @@
+/*
+ * Copyright (C) 2010 Xavier Claessens <xclaesse@gmail.com>
+ * Copyright (C) 2010 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "metrics.h"
+#include "scheduler.h"
+
+/* Counters for alerting, written in the Prometheus text format so the
+ * node exporter's textfile collector can pick them up */
+
+#define METRICS_PREFIX "ssh_contact_"
+
+/* Upper bounds of backend connect latency buckets, in µs */
+static const gint64 connect_buckets[] = {
+  1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+  1000000, 2500000, 5000000, 10000000,
+};
+
+struct _Metrics
+{
+  /* Not owned, they outlive us */
+  Stats *stats;
+  SessionTable *sessions;
+  /* NULL when tubes go to an inetd-style command */
+  BackendGroup *backends;
+
+  guint64 tubes_accepted;
+  /* GQuark -> owned guint64, failed tubes by error domain */
+  GHashTable *tubes_failed;
+
+  /* Last bucket is +Inf */
+  guint64 connect_latency[G_N_ELEMENTS (connect_buckets) + 1];
+  guint64 connect_count;
+  gint64 connect_sum;
+
+  gchar *path;
+  guint timeout_id;
+};
+
+static void
+metrics_header (GString *out,
+    const gchar *name,
+    const gchar *type,
+    const gchar *help)
+{
+  g_string_append_printf (out, "# HELP " METRICS_PREFIX "%s %s\n", name, help);
+  g_string_append_printf (out, "# TYPE " METRICS_PREFIX "%s %s\n", name, type);
+}
+
+static void
+metrics_format_connect_latency (Metrics *metrics,
+    GString *out)
+{
+  guint64 cumulative = 0;
+  guint i;
+
+  metrics_header (out, "backend_connect_seconds", "histogram",
+      "Time to connect to the sshd");
+
+  for (i = 0; i < G_N_ELEMENTS (connect_buckets); i++)
+    {
+      cumulative += metrics->connect_latency[i];
+      g_string_append_printf (out,
+          METRICS_PREFIX "backend_connect_seconds_bucket{le=\"%g\"} %"
+          G_GUINT64_FORMAT "\n",
+          connect_buckets[i] / (gdouble) G_USEC_PER_SEC, cumulative);
+    }
+  cumulative += metrics->connect_latency[i];
+  g_string_append_printf (out,
+      METRICS_PREFIX "backend_connect_seconds_bucket{le=\"+Inf\"} %"
+      G_GUINT64_FORMAT "\n", cumulative);
+
+  g_string_append_printf (out,
+      METRICS_PREFIX "backend_connect_seconds_sum %g\n",
+      metrics->connect_sum / (gdouble) G_USEC_PER_SEC);
+  g_string_append_printf (out,
+      METRICS_PREFIX "backend_connect_seconds_count %" G_GUINT64_FORMAT "\n",
+      metrics->connect_count);
+}
+
+/* Label values are backend addresses, which may contain anything */
+static gchar *
+metrics_escape_label (const gchar *value)
+{
+  GString *escaped;
+  const gchar *p;
+
+  escaped = g_string_new (NULL);
+  for (p = value; *p != '\0'; p++)
+    {
+      if (*p == '\n')
+        {
+          g_string_append (escaped, "\\n");
+          continue;
+        }
+
+      if (*p == '\\' || *p == '"')
+        g_string_append_c (escaped, '\\');
+      g_string_append_c (escaped, *p);
+    }
+
+  return g_string_free (escaped, FALSE);
+}
+
+/* Samples of each family must be grouped after its header, so they are
+ * gathered per family first */
+static void
+metrics_format_backends (Metrics *metrics,
+    GString *out)
+{
+  GString *up;
+  GString *active;
+  GString *connected;
+  GString *failed;
+  guint i;
+
+  if (metrics->backends == NULL)
+    return;
+
+  up = g_string_new (NULL);
+  active = g_string_new (NULL);
+  connected = g_string_new (NULL);
+  failed = g_string_new (NULL);
+
+  for (i = 0; i < _backend_group_get_size (metrics->backends); i++)
+    {
+      Backend *backend = _backend_group_get (metrics->backends, i);
+      guint n_active;
+      guint64 n_connected;
+      guint64 n_failed;
+      gchar *label;
+
+      _backend_get_counts (backend, &n_active, &n_connected, &n_failed);
+      label = metrics_escape_label (_backend_get_address (backend));
+
+      g_string_append_printf (up,
+          METRICS_PREFIX "backend_up{backend=\"%s\"} %d\n", label,
+          _backend_is_available (backend) ? 1 : 0);
+      g_string_append_printf (active,
+          METRICS_PREFIX "backend_connections{backend=\"%s\"} %u\n", label,
+          n_active);
+      g_string_append_printf (connected,
+          METRICS_PREFIX "backend_connections_total{backend=\"%s\"} %"
+          G_GUINT64_FORMAT "\n", label, n_connected);
+      g_string_append_printf (failed,
+          METRICS_PREFIX "backend_connect_failures_total{backend=\"%s\"} %"
+          G_GUINT64_FORMAT "\n", label, n_failed);
+
+      g_free (label);
+    }
+
+  metrics_header (out, "backend_up", "gauge",
+      "1 if the backend takes new connections, 0 if it's considered down");
+  g_string_append (out, up->str);
+  metrics_header (out, "backend_connections", "gauge",
+      "Connections to the backend being opened or open");
+  g_string_append (out, active->str);
+  metrics_header (out, "backend_connections_total", "counter",
+      "Connections the backend accepted");
+  g_string_append (out, connected->str);
+  metrics_header (out, "backend_connect_failures_total", "counter",
+      "Connections to the backend that failed or timed out");
+  g_string_append (out, failed->str);
+
+  g_string_free (up, TRUE);
+  g_string_free (active, TRUE);
+  g_string_free (connected, TRUE);
+  g_string_free (failed, TRUE);
+}
+
+static gchar *
+metrics_format (Metrics *metrics)
+{
+  GString *out;
+  GHashTableIter iter;
+  gpointer key;
+  gpointer value;
+  guint64 bytes[2];
+  guint64 n_wakeups;
+  guint64 n_turns;
+
+  out = g_string_new (NULL);
+
+  metrics_header (out, "sessions", "gauge", "Sessions currently open");
+  g_string_append_printf (out, METRICS_PREFIX "sessions %u\n",
+      _session_table_get_size (metrics->sessions));
+
+  metrics_header (out, "tubes_accepted_total", "counter",
+      "Tubes accepted since the service started");
+  g_string_append_printf (out,
+      METRICS_PREFIX "tubes_accepted_total %" G_GUINT64_FORMAT "\n",
+      metrics->tubes_accepted);
+
+  /* Error domains are quark names, nothing to escape there */
+  metrics_header (out, "tubes_failed_total", "counter",
+      "Sessions that ended with an error, by error domain, tubes refused "
+      "because every backend was down included");
+  g_hash_table_iter_init (&iter, metrics->tubes_failed);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      g_string_append_printf (out,
+          METRICS_PREFIX "tubes_failed_total{domain=\"%s\"} %"
+          G_GUINT64_FORMAT "\n",
+          g_quark_to_string (GPOINTER_TO_UINT (key)), *(guint64 *) value);
+    }
+
+  metrics_format_connect_latency (metrics, out);
+  metrics_format_backends (metrics, out);
+
+  /* Forward is tube to backend, see service.c */
+  _stats_get_bytes (metrics->stats, bytes);
+  metrics_header (out, "relayed_bytes_total", "counter",
+      "Bytes relayed between tubes and the sshd, mux sessions excluded");
+  g_string_append_printf (out,
+      METRICS_PREFIX "relayed_bytes_total{from=\"tube\"} %"
+      G_GUINT64_FORMAT "\n", bytes[RELAY_DIRECTION_FORWARD]);
+  g_string_append_printf (out,
+      METRICS_PREFIX "relayed_bytes_total{from=\"backend\"} %"
+      G_GUINT64_FORMAT "\n", bytes[RELAY_DIRECTION_BACKWARD]);
+
+  _scheduler_get_counts (&n_wakeups, &n_turns);
+  metrics_header (out, "relay_wakeups_total", "counter",
+      "Times relay threads woke up to move data");
+  g_string_append_printf (out,
+      METRICS_PREFIX "relay_wakeups_total %" G_GUINT64_FORMAT "\n",
+      n_wakeups);
+  metrics_header (out, "relay_turns_total", "counter",
+      "Turns relays got to move data, several per wakeup under load");
+  g_string_append_printf (out,
+      METRICS_PREFIX "relay_turns_total %" G_GUINT64_FORMAT "\n", n_turns);
+
+  return g_string_free (out, FALSE);
+}
+
+/* g_file_set_contents() renames a temporary file over @path, the collector
+ * never reads a partial file */
+static void
+metrics_write (Metrics *metrics)
+{
+  gchar *contents;
+  GError *error = NULL;
+
+  contents = metrics_format (metrics);
+  if (!g_file_set_contents (metrics->path, contents, -1, &error))
+    {
+      g_debug ("Can't write metrics: %s", error->message);
+      g_clear_error (&error);
+    }
+  g_free (contents);
+}
+
+static gboolean
+metrics_timeout_cb (gpointer user_data)
+{
+  metrics_write (user_data);
+
+  return TRUE;
+}
+
+Metrics *
+_metrics_new (Stats *stats,
+    SessionTable *sessions,
+    BackendGroup *backends)
+{
+  Metrics *metrics;
+
+  metrics = g_slice_new0 (Metrics);
+  metrics->stats = stats;
+  metrics->sessions = sessions;
+  metrics->backends = backends;
+  metrics->tubes_failed = g_hash_table_new_full (g_direct_hash,
+      g_direct_equal, NULL, g_free);
+
+  return metrics;
+}
+
+/* Writes the metrics a last time, if a file was given */
+void
+_metrics_free (Metrics *metrics)
+{
+  if (metrics->timeout_id != 0)
+    {
+      g_source_remove (metrics->timeout_id);
+      metrics_write (metrics);
+    }
+
+  g_hash_table_unref (metrics->tubes_failed);
+  g_free (metrics->path);
+
+  g_slice_free (Metrics, metrics);
+}
+
+/* Write the metrics to @path now, and every @interval seconds */
+void
+_metrics_write_file (Metrics *metrics,
+    const gchar *path,
+    guint interval)
+{
+  g_return_if_fail (metrics->path == NULL);
+  g_return_if_fail (interval > 0);
+
+  metrics->path = g_strdup (path);
+  metrics->timeout_id = g_timeout_add_seconds (interval, metrics_timeout_cb,
+      metrics);
+  metrics_write (metrics);
+}
+
+void
+_metrics_tube_accepted (Metrics *metrics)
+{
+  metrics->tubes_accepted++;
+}
+
+void
+_metrics_tube_failed (Metrics *metrics,
+    const GError *error)
+{
+  guint64 *count;
+
+  count = g_hash_table_lookup (metrics->tubes_failed,
+      GUINT_TO_POINTER (error->domain));
+  if (count == NULL)
+    {
+      count = g_new0 (guint64, 1);
+      g_hash_table_insert (metrics->tubes_failed,
+          GUINT_TO_POINTER (error->domain), count);
+    }
+
+  (*count)++;
+}
+
+/* @duration is in µs */
+void
+_metrics_backend_connected (Metrics *metrics,
+    gint64 duration)
+{
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (connect_buckets); i++)
+    {
+      if (duration <= connect_buckets[i])
+        break;
+    }
+
+  metrics->connect_latency[i]++;
+  metrics->connect_count++;
+  metrics->connect_sum += duration;
+}
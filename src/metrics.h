@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2010 Xavier Claessens <xclaesse@gmail.com>
+ * Copyright (C) 2010 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA  02110-1301  USA
+ */
+
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <gio/gio.h>
+
+#include "backend.h"
+#include "session-table.h"
+#include "stats.h"
+
+G_BEGIN_DECLS
+
+typedef struct _Metrics Metrics;
+
+Metrics *_metrics_new (Stats *stats, SessionTable *sessions,
+    BackendGroup *backends);
+
+void _metrics_free (Metrics *metrics);
+
+void _metrics_write_file (Metrics *metrics, const gchar *path,
+    guint interval);
+
+void _metrics_tube_accepted (Metrics *metrics);
+
+void _metrics_tube_failed (Metrics *metrics, const GError *error);
+
+void _metrics_backend_connected (Metrics *metrics, gint64 duration);
+
+G_END_DECLS
+
+#endif /* #ifndef __METRICS_H__*/
@@ -0,0 +1,289 @@
+/*
+ * Copyright (C) 2010 Xavier Claessens <xclaesse@gmail.com>
+ * Copyright (C) 2010 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+#include <telepathy-glib/telepathy-glib.h>
+
+#include "client-helpers.h"
+#include "mux.h"
+#include "mux-master.h"
+
+/* The mux master keeps one tube to a contact open, and carries every
+ * ssh-contact --mux session to that contact over it. Sessions connect to a
+ * unix socket, each connection becomes a stream of the mux. */
+
+typedef struct
+{
+  GMainLoop *loop;
+  gchar *control_path;
+  guint linger;
+  guint linger_id;
+
+  GSocketListener *listener;
+  TpChannel *channel;
+  Mux *mux;
+
+  GError *error;
+} MasterContext;
+
+static void
+master_quit (MasterContext *context,
+    const GError *error)
+{
+  if (error != NULL && context->error == NULL)
+    context->error = g_error_copy (error);
+
+  /* Nobody can use that socket anymore */
+  if (context->control_path != NULL)
+    g_unlink (context->control_path);
+
+  g_main_loop_quit (context->loop);
+}
+
+static gboolean
+linger_timeout_cb (gpointer user_data)
+{
+  MasterContext *context = user_data;
+
+  g_debug ("No session for %u seconds, closing the tube", context->linger);
+
+  context->linger_id = 0;
+  master_quit (context, NULL);
+
+  return FALSE;
+}
+
+static void
+master_update_linger (MasterContext *context)
+{
+  if (_mux_get_n_streams (context->mux) > 0)
+    {
+      if (context->linger_id != 0)
+        {
+          g_source_remove (context->linger_id);
+          context->linger_id = 0;
+        }
+    }
+  else if (context->linger_id == 0)
+    {
+      context->linger_id = g_timeout_add_seconds (context->linger,
+          linger_timeout_cb, context);
+    }
+}
+
+static void
+mux_stream_closed_cb (Mux *mux,
+    guint32 id,
+    gpointer user_data)
+{
+  master_update_linger (user_data);
+}
+
+static void
+mux_closed_cb (Mux *mux,
+    const GError *error,
+    gpointer user_data)
+{
+  master_quit (user_data, error);
+}
+
+static const MuxCallbacks mux_callbacks = {
+  NULL,
+  mux_stream_closed_cb,
+  mux_closed_cb,
+};
+
+static void
+control_accepted_cb (GObject *source_object,
+    GAsyncResult *res,
+    gpointer user_data)
+{
+  MasterContext *context = user_data;
+  GSocketConnection *connection;
+  GError *error = NULL;
+
+  connection = g_socket_listener_accept_finish (
+      G_SOCKET_LISTENER (source_object), res, NULL, &error);
+  if (connection == NULL)
+    {
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        master_quit (context, error);
+      g_clear_error (&error);
+      return;
+    }
+
+  g_debug ("New session on stream %u",
+      _mux_open_stream (context->mux, G_IO_STREAM (connection)));
+  master_update_linger (context);
+  g_object_unref (connection);
+
+  g_socket_listener_accept_async (context->listener, NULL,
+      control_accepted_cb, context);
+}
+
+static void
+channel_invalidated_cb (TpChannel *channel,
+    guint domain,
+    gint code,
+    gchar *message,
+    MasterContext *context)
+{
+  master_quit (context, NULL);
+}
+
+static void
+create_tube_cb (GObject *source_object,
+    GAsyncResult *res,
+    gpointer user_data)
+{
+  MasterContext *context = user_data;
+  GSocketConnection *tube_connection;
+  GError *error = NULL;
+
+  tube_connection = _client_create_tube_finish (res, &context->channel,
+      &error);
+  if (tube_connection == NULL)
+    {
+      master_quit (context, error);
+      g_clear_error (&error);
+      return;
+    }
+
+  g_signal_connect (context->channel, "invalidated",
+      G_CALLBACK (channel_invalidated_cb), context);
+
+  context->mux = _mux_new (G_IO_STREAM (tube_connection), &mux_callbacks,
+      context);
+  g_object_unref (tube_connection);
+
+  /* Sessions that connected while the tube was being created are waiting in
+   * the listen backlog */
+  g_socket_listener_accept_async (context->listener, NULL,
+      control_accepted_cb, context);
+  master_update_linger (context);
+}
+
+/* Tell whoever spawned us that the control socket can be used, and stop
+ * using stdout so it can go away */
+static void
+master_notify_ready (const GError *error)
+{
+  gint fd;
+
+  if (error != NULL)
+    printf ("error: %s\n", error->message);
+  else
+    printf ("ready\n");
+  fflush (stdout);
+
+  fd = open ("/dev/null", O_WRONLY);
+  if (fd >= 0)
+    {
+      dup2 (fd, STDOUT_FILENO);
+      close (fd);
+    }
+}
+
+gboolean
+_mux_master_run (const gchar *account_path,
+    const gchar *contact_id,
+    guint linger,
+    GError **error)
+{
+  MasterContext context = { 0, };
+  TpDBusDaemon *dbus = NULL;
+  TpSimpleClientFactory *factory = NULL;
+  TpAccount *account = NULL;
+  GError *listen_error = NULL;
+
+  context.control_path = _mux_control_path (account_path, contact_id);
+  context.linger = linger;
+
+  context.listener = _client_listen_unix (context.control_path,
+      &listen_error);
+  if (context.listener == NULL)
+    {
+      master_notify_ready (listen_error);
+      g_propagate_error (&context.error, listen_error);
+      tp_clear_pointer (&context.control_path, g_free);
+      goto OUT;
+    }
+  master_notify_ready (NULL);
+
+  dbus = tp_dbus_daemon_dup (&context.error);
+  if (dbus == NULL)
+    goto OUT;
+
+  factory = (TpSimpleClientFactory *) tp_automatic_client_factory_new (dbus);
+  account = tp_simple_client_factory_ensure_account (factory, account_path,
+      NULL, &context.error);
+  if (account == NULL)
+    goto OUT;
+
+  context.loop = g_main_loop_new (NULL, FALSE);
+
+  _client_create_tube_async (account, contact_id, TUBE_SERVICE_MUX,
+      create_tube_cb, &context);
+
+  g_main_loop_run (context.loop);
+
+OUT:
+  if (context.control_path != NULL)
+    g_unlink (context.control_path);
+
+  if (context.mux != NULL)
+    {
+      _mux_close (context.mux);
+      _mux_unref (context.mux);
+    }
+
+  if (context.channel != NULL)
+    {
+      g_signal_handlers_disconnect_by_func (context.channel,
+          channel_invalidated_cb, &context);
+      tp_channel_close_async (context.channel, NULL, NULL);
+    }
+
+  if (context.linger_id != 0)
+    g_source_remove (context.linger_id);
+
+  tp_clear_pointer (&context.loop, g_main_loop_unref);
+  tp_clear_object (&context.listener);
+  tp_clear_object (&context.channel);
+  tp_clear_object (&account);
+  tp_clear_object (&factory);
+  tp_clear_object (&dbus);
+  g_free (context.control_path);
+
+  if (context.error != NULL)
+    {
+      g_propagate_error (error, context.error);
+      return FALSE;
+    }
+
+  return TRUE;
+}
@@ -0,0 +1,731 @@
+/*
+ * Copyright (C) 2010 Xavier Claessens <xclaesse@gmail.com>
+ * Copyright (C) 2010 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "mux.h"
+
+/* Every frame starts with a header made of a big-endian guint32 stream id,
+ * a guint16 frame type and a guint16 payload length.
+ *
+ * OPEN    the client opened a new stream, no payload
+ * DATA    bytes for the stream
+ * EOF     the sender won't send more DATA on that stream
+ * CLOSE   the stream is aborted, in both directions
+ * WINDOW  a guint32 number of bytes the receiver consumed, the sender may
+ *         send that much more DATA
+ *
+ * Each side may have at most MUX_WINDOW_SIZE bytes of DATA in flight per
+ * stream, so a stream whose local end is slow never blocks the others. A peer
+ * sending more than that gets the stream closed, and OPEN beyond
+ * MUX_MAX_STREAMS streams is answered with CLOSE, so it can't make us queue
+ * unbounded data or open unbounded connections. */
+#define MUX_HEADER_SIZE 8
+#define MUX_CHUNK_SIZE (16 * 1024)
+#define MUX_WINDOW_SIZE (256 * 1024)
+#define MUX_MAX_STREAMS 64
+
+enum
+{
+  MUX_FRAME_OPEN = 1,
+  MUX_FRAME_DATA,
+  MUX_FRAME_EOF,
+  MUX_FRAME_CLOSE,
+  MUX_FRAME_WINDOW,
+};
+
+typedef struct
+{
+  gint ref_count;
+  Mux *mux;
+  guint32 id;
+  GIOStream *local;
+  GCancellable *cancellable;
+
+  guchar read_buffer[MUX_CHUNK_SIZE];
+  gboolean reading;
+  /* Bytes we may still send before the peer gives us more window */
+  gsize send_window;
+  /* EOF read from @local and sent to the peer */
+  gboolean local_eof;
+
+  /* DATA received from the peer, waiting to be written to @local */
+  GQueue write_queue;
+  /* Bytes received that we didn't give back as WINDOW yet */
+  gsize recv_pending;
+  gsize write_offset;
+  gboolean writing;
+  /* EOF received from the peer, and forwarded to @local */
+  gboolean remote_eof;
+  gboolean local_shutdown;
+
+  gboolean closed;
+} MuxStream;
+
+struct _Mux
+{
+  gint ref_count;
+  GIOStream *tube;
+  GCancellable *cancellable;
+  MuxCallbacks callbacks;
+  gpointer user_data;
+
+  /* guint32 id -> owned MuxStream */
+  GHashTable *streams;
+  guint32 next_id;
+
+  guchar read_buffer[MUX_CHUNK_SIZE + MUX_HEADER_SIZE];
+  GByteArray *input;
+
+  /* Frames waiting to be written to the tube */
+  GQueue output_queue;
+  gsize output_offset;
+  gboolean writing;
+
+  gboolean closed;
+};
+
+static void mux_stream_read (MuxStream *stream);
+static void mux_stream_flush (MuxStream *stream);
+static void mux_stream_close (MuxStream *stream, gboolean send_close);
+
+static MuxStream *
+mux_stream_ref (MuxStream *stream)
+{
+  stream->ref_count++;
+
+  return stream;
+}
+
+static void
+mux_stream_unref (MuxStream *stream)
+{
+  GByteArray *chunk;
+
+  if (--stream->ref_count > 0)
+    return;
+
+  while ((chunk = g_queue_pop_head (&stream->write_queue)) != NULL)
+    g_byte_array_unref (chunk);
+
+  /* No operation can be pending anymore, we can close it */
+  if (stream->local != NULL)
+    {
+      g_io_stream_close (stream->local, NULL, NULL);
+      g_object_unref (stream->local);
+    }
+
+  g_object_unref (stream->cancellable);
+  _mux_unref (stream->mux);
+
+  g_slice_free (MuxStream, stream);
+}
+
+static MuxStream *
+mux_stream_new (Mux *mux,
+    guint32 id)
+{
+  MuxStream *stream;
+
+  stream = g_slice_new0 (MuxStream);
+  stream->ref_count = 1;
+  stream->mux = _mux_ref (mux);
+  stream->id = id;
+  stream->cancellable = g_cancellable_new ();
+  stream->send_window = MUX_WINDOW_SIZE;
+  g_queue_init (&stream->write_queue);
+
+  g_hash_table_insert (mux->streams, GUINT_TO_POINTER (id), stream);
+
+  return stream;
+}
+
+static void mux_flush (Mux *mux);
+
+static void
+mux_send_frame (Mux *mux,
+    guint32 id,
+    guint16 type,
+    gconstpointer payload,
+    guint16 len)
+{
+  GByteArray *frame;
+  guint32 id_be = GUINT32_TO_BE (id);
+  guint16 type_be = GUINT16_TO_BE (type);
+  guint16 len_be = GUINT16_TO_BE (len);
+
+  if (mux->closed)
+    return;
+
+  frame = g_byte_array_sized_new (MUX_HEADER_SIZE + len);
+  g_byte_array_append (frame, (const guint8 *) &id_be, sizeof (id_be));
+  g_byte_array_append (frame, (const guint8 *) &type_be, sizeof (type_be));
+  g_byte_array_append (frame, (const guint8 *) &len_be, sizeof (len_be));
+  if (len > 0)
+    g_byte_array_append (frame, payload, len);
+
+  g_queue_push_tail (&mux->output_queue, frame);
+  mux_flush (mux);
+}
+
+static void
+mux_send_window (Mux *mux,
+    guint32 id,
+    guint32 increment)
+{
+  guint32 increment_be = GUINT32_TO_BE (increment);
+
+  mux_send_frame (mux, id, MUX_FRAME_WINDOW, &increment_be,
+      sizeof (increment_be));
+}
+
+static void
+mux_fail (Mux *mux,
+    const GError *error)
+{
+  GList *streams;
+  GList *l;
+
+  if (mux->closed)
+    return;
+
+  mux->closed = TRUE;
+  g_cancellable_cancel (mux->cancellable);
+
+  streams = g_hash_table_get_values (mux->streams);
+  for (l = streams; l != NULL; l = l->next)
+    mux_stream_close (l->data, FALSE);
+  g_list_free (streams);
+
+  if (mux->callbacks.closed != NULL)
+    mux->callbacks.closed (mux, error, mux->user_data);
+}
+
+static void
+tube_write_cb (GObject *source_object,
+    GAsyncResult *res,
+    gpointer user_data)
+{
+  Mux *mux = user_data;
+  GByteArray *frame;
+  gssize n;
+  GError *error = NULL;
+
+  n = g_output_stream_write_finish (G_OUTPUT_STREAM (source_object), res,
+      &error);
+  mux->writing = FALSE;
+
+  if (n < 0)
+    {
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        mux_fail (mux, error);
+      g_clear_error (&error);
+      goto OUT;
+    }
+
+  frame = g_queue_peek_head (&mux->output_queue);
+  mux->output_offset += n;
+  if (mux->output_offset == frame->len)
+    {
+      g_byte_array_unref (g_queue_pop_head (&mux->output_queue));
+      mux->output_offset = 0;
+    }
+
+  mux_flush (mux);
+
+OUT:
+  _mux_unref (mux);
+}
+
+static void
+mux_flush (Mux *mux)
+{
+  GOutputStream *output;
+  GByteArray *frame;
+
+  if (mux->writing || mux->closed)
+    return;
+
+  frame = g_queue_peek_head (&mux->output_queue);
+  if (frame == NULL)
+    return;
+
+  mux->writing = TRUE;
+  output = g_io_stream_get_output_stream (mux->tube);
+  g_output_stream_write_async (output, frame->data + mux->output_offset,
+      frame->len - mux->output_offset, G_PRIORITY_DEFAULT, mux->cancellable,
+      tube_write_cb, _mux_ref (mux));
+}
+
+static void
+mux_handle_frame (Mux *mux,
+    guint32 id,
+    guint16 type,
+    const guint8 *payload,
+    guint16 len)
+{
+  MuxStream *stream;
+  GByteArray *chunk;
+  guint32 increment;
+
+  stream = g_hash_table_lookup (mux->streams, GUINT_TO_POINTER (id));
+
+  switch (type)
+    {
+      case MUX_FRAME_OPEN:
+        if (stream != NULL || mux->callbacks.new_stream == NULL)
+          {
+            mux_send_frame (mux, id, MUX_FRAME_CLOSE, NULL, 0);
+            break;
+          }
+        if (g_hash_table_size (mux->streams) >= MUX_MAX_STREAMS)
+          {
+            g_debug ("Refusing mux stream %u, %u streams are open already",
+                id, MUX_MAX_STREAMS);
+            mux_send_frame (mux, id, MUX_FRAME_CLOSE, NULL, 0);
+            break;
+          }
+        mux_stream_new (mux, id);
+        mux->callbacks.new_stream (mux, id, mux->user_data);
+        break;
+
+      case MUX_FRAME_DATA:
+        /* Data still in flight for a stream we closed is dropped */
+        if (stream == NULL || len == 0)
+          break;
+        if (stream->recv_pending + len > MUX_WINDOW_SIZE)
+          {
+            g_debug ("Mux stream %u went over its window, closing it",
+                stream->id);
+            mux_stream_close (stream, TRUE);
+            break;
+          }
+        stream->recv_pending += len;
+        chunk = g_byte_array_sized_new (len);
+        g_byte_array_append (chunk, payload, len);
+        g_queue_push_tail (&stream->write_queue, chunk);
+        mux_stream_flush (stream);
+        break;
+
+      case MUX_FRAME_EOF:
+        if (stream == NULL)
+          break;
+        stream->remote_eof = TRUE;
+        mux_stream_flush (stream);
+        break;
+
+      case MUX_FRAME_CLOSE:
+        if (stream != NULL)
+          mux_stream_close (stream, FALSE);
+        break;
+
+      case MUX_FRAME_WINDOW:
+        if (stream == NULL || len != sizeof (increment))
+          break;
+        memcpy (&increment, payload, sizeof (increment));
+        stream->send_window += GUINT32_FROM_BE (increment);
+        mux_stream_read (stream);
+        break;
+
+      default:
+        g_debug ("Ignoring unknown mux frame type %u", type);
+        break;
+    }
+}
+
+static void mux_read (Mux *mux);
+
+static void
+tube_read_cb (GObject *source_object,
+    GAsyncResult *res,
+    gpointer user_data)
+{
+  Mux *mux = user_data;
+  gsize offset = 0;
+  gssize n;
+  GError *error = NULL;
+
+  n = g_input_stream_read_finish (G_INPUT_STREAM (source_object), res,
+      &error);
+  if (n <= 0)
+    {
+      /* n == 0 means the tube got closed */
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        mux_fail (mux, error);
+      g_clear_error (&error);
+      goto OUT;
+    }
+
+  g_byte_array_append (mux->input, mux->read_buffer, n);
+
+  /* Handle all complete frames */
+  while (!mux->closed && mux->input->len - offset >= MUX_HEADER_SIZE)
+    {
+      const guint8 *header = mux->input->data + offset;
+      guint32 id;
+      guint16 type;
+      guint16 len;
+
+      memcpy (&id, header, sizeof (id));
+      memcpy (&type, header + 4, sizeof (type));
+      memcpy (&len, header + 6, sizeof (len));
+      len = GUINT16_FROM_BE (len);
+
+      if (mux->input->len - offset < (guint) MUX_HEADER_SIZE + len)
+        break;
+
+      mux_handle_frame (mux, GUINT32_FROM_BE (id), GUINT16_FROM_BE (type),
+          header + MUX_HEADER_SIZE, len);
+      offset += MUX_HEADER_SIZE + len;
+    }
+  g_byte_array_remove_range (mux->input, 0, offset);
+
+  mux_read (mux);
+
+OUT:
+  _mux_unref (mux);
+}
+
+static void
+mux_read (Mux *mux)
+{
+  GInputStream *input;
+
+  if (mux->closed)
+    return;
+
+  input = g_io_stream_get_input_stream (mux->tube);
+  g_input_stream_read_async (input, mux->read_buffer,
+      sizeof (mux->read_buffer), G_PRIORITY_DEFAULT, mux->cancellable,
+      tube_read_cb, _mux_ref (mux));
+}
+
+static void
+mux_stream_close (MuxStream *stream,
+    gboolean send_close)
+{
+  Mux *mux = stream->mux;
+
+  if (stream->closed)
+    return;
+
+  stream->closed = TRUE;
+  g_cancellable_cancel (stream->cancellable);
+
+  if (send_close)
+    mux_send_frame (mux, stream->id, MUX_FRAME_CLOSE, NULL, 0);
+
+  /* Keep the stream alive until we're done with it */
+  mux_stream_ref (stream);
+  g_hash_table_remove (mux->streams, GUINT_TO_POINTER (stream->id));
+
+  if (mux->callbacks.stream_closed != NULL)
+    mux->callbacks.stream_closed (mux, stream->id, mux->user_data);
+
+  mux_stream_unref (stream);
+}
+
+/* Both directions got their EOF, nothing more will happen on that stream */
+static void
+mux_stream_check_done (MuxStream *stream)
+{
+  if (stream->local_eof && stream->local_shutdown)
+    mux_stream_close (stream, FALSE);
+}
+
+static void
+stream_read_cb (GObject *source_object,
+    GAsyncResult *res,
+    gpointer user_data)
+{
+  MuxStream *stream = user_data;
+  gssize n;
+  GError *error = NULL;
+
+  n = g_input_stream_read_finish (G_INPUT_STREAM (source_object), res,
+      &error);
+  stream->reading = FALSE;
+
+  if (stream->closed)
+    goto OUT;
+
+  if (n < 0)
+    {
+      g_debug ("Error reading mux stream %u: %s", stream->id, error->message);
+      mux_stream_close (stream, TRUE);
+      goto OUT;
+    }
+
+  if (n == 0)
+    {
+      stream->local_eof = TRUE;
+      mux_send_frame (stream->mux, stream->id, MUX_FRAME_EOF, NULL, 0);
+      mux_stream_check_done (stream);
+      goto OUT;
+    }
+
+  mux_send_frame (stream->mux, stream->id, MUX_FRAME_DATA,
+      stream->read_buffer, n);
+  stream->send_window -= n;
+  mux_stream_read (stream);
+
+OUT:
+  g_clear_error (&error);
+  mux_stream_unref (stream);
+}
+
+static void
+mux_stream_read (MuxStream *stream)
+{
+  GInputStream *input;
+
+  if (stream->reading || stream->closed || stream->local_eof ||
+      stream->local == NULL || stream->send_window == 0)
+    return;
+
+  stream->reading = TRUE;
+  input = g_io_stream_get_input_stream (stream->local);
+  g_input_stream_read_async (input, stream->read_buffer,
+      MIN (sizeof (stream->read_buffer), stream->send_window),
+      G_PRIORITY_DEFAULT, stream->cancellable, stream_read_cb,
+      mux_stream_ref (stream));
+}
+
+static void
+stream_write_cb (GObject *source_object,
+    GAsyncResult *res,
+    gpointer user_data)
+{
+  MuxStream *stream = user_data;
+  GByteArray *chunk;
+  gssize n;
+  GError *error = NULL;
+
+  n = g_output_stream_write_finish (G_OUTPUT_STREAM (source_object), res,
+      &error);
+  stream->writing = FALSE;
+
+  if (stream->closed)
+    goto OUT;
+
+  if (n < 0)
+    {
+      g_debug ("Error writing mux stream %u: %s", stream->id, error->message);
+      mux_stream_close (stream, TRUE);
+      goto OUT;
+    }
+
+  chunk = g_queue_peek_head (&stream->write_queue);
+  stream->write_offset += n;
+  if (stream->write_offset == chunk->len)
+    {
+      /* Let the peer send that much more */
+      mux_send_window (stream->mux, stream->id, chunk->len);
+      stream->recv_pending -= chunk->len;
+      g_byte_array_unref (g_queue_pop_head (&stream->write_queue));
+      stream->write_offset = 0;
+    }
+
+  mux_stream_flush (stream);
+
+OUT:
+  g_clear_error (&error);
+  mux_stream_unref (stream);
+}
+
+static void
+mux_stream_shutdown (MuxStream *stream)
+{
+  stream->local_shutdown = TRUE;
+
+  if (G_IS_SOCKET_CONNECTION (stream->local))
+    {
+      GSocket *socket;
+
+      socket = g_socket_connection_get_socket (
+          G_SOCKET_CONNECTION (stream->local));
+      g_socket_shutdown (socket, FALSE, TRUE, NULL);
+    }
+  else
+    {
+      g_output_stream_close (g_io_stream_get_output_stream (stream->local),
+          NULL, NULL);
+    }
+
+  mux_stream_check_done (stream);
+}
+
+static void
+mux_stream_flush (MuxStream *stream)
+{
+  GOutputStream *output;
+  GByteArray *chunk;
+
+  if (stream->writing || stream->closed || stream->local == NULL)
+    return;
+
+  chunk = g_queue_peek_head (&stream->write_queue);
+  if (chunk == NULL)
+    {
+      if (stream->remote_eof && !stream->local_shutdown)
+        mux_stream_shutdown (stream);
+      return;
+    }
+
+  stream->writing = TRUE;
+  output = g_io_stream_get_output_stream (stream->local);
+  g_output_stream_write_async (output, chunk->data + stream->write_offset,
+      chunk->len - stream->write_offset, G_PRIORITY_DEFAULT,
+      stream->cancellable, stream_write_cb, mux_stream_ref (stream));
+}
+
+Mux *
+_mux_new (GIOStream *tube,
+    const MuxCallbacks *callbacks,
+    gpointer user_data)
+{
+  Mux *mux;
+
+  mux = g_slice_new0 (Mux);
+  mux->ref_count = 1;
+  mux->tube = g_object_ref (tube);
+  mux->cancellable = g_cancellable_new ();
+  mux->callbacks = *callbacks;
+  mux->user_data = user_data;
+  mux->streams = g_hash_table_new_full (NULL, NULL, NULL,
+      (GDestroyNotify) mux_stream_unref);
+  mux->next_id = 1;
+  mux->input = g_byte_array_new ();
+  g_queue_init (&mux->output_queue);
+
+  mux_read (mux);
+
+  return mux;
+}
+
+Mux *
+_mux_ref (Mux *mux)
+{
+  mux->ref_count++;
+
+  return mux;
+}
+
+void
+_mux_unref (Mux *mux)
+{
+  GByteArray *frame;
+
+  if (--mux->ref_count > 0)
+    return;
+
+  while ((frame = g_queue_pop_head (&mux->output_queue)) != NULL)
+    g_byte_array_unref (frame);
+
+  g_hash_table_unref (mux->streams);
+  g_byte_array_unref (mux->input);
+  g_object_unref (mux->cancellable);
+  g_object_unref (mux->tube);
+
+  g_slice_free (Mux, mux);
+}
+
+/* Streams hold a ref on the mux, this must be called before dropping the last
+ * user ref. */
+void
+_mux_close (Mux *mux)
+{
+  mux_fail (mux, NULL);
+}
+
+guint32
+_mux_open_stream (Mux *mux,
+    GIOStream *local)
+{
+  guint32 id = mux->next_id++;
+
+  mux_send_frame (mux, id, MUX_FRAME_OPEN, NULL, 0);
+
+  mux_stream_new (mux, id);
+  _mux_attach_stream (mux, id, local);
+
+  return id;
+}
+
+void
+_mux_attach_stream (Mux *mux,
+    guint32 id,
+    GIOStream *local)
+{
+  MuxStream *stream;
+
+  stream = g_hash_table_lookup (mux->streams, GUINT_TO_POINTER (id));
+  if (stream == NULL)
+    {
+      /* The peer closed it meanwhile */
+      g_io_stream_close (local, NULL, NULL);
+      return;
+    }
+
+  stream->local = g_object_ref (local);
+  mux_stream_read (stream);
+  mux_stream_flush (stream);
+}
+
+void
+_mux_reject_stream (Mux *mux,
+    guint32 id)
+{
+  MuxStream *stream;
+
+  stream = g_hash_table_lookup (mux->streams, GUINT_TO_POINTER (id));
+  if (stream != NULL)
+    mux_stream_close (stream, TRUE);
+}
+
+guint
+_mux_get_n_streams (Mux *mux)
+{
+  return g_hash_table_size (mux->streams);
+}
+
+gchar *
+_mux_control_path (const gchar *account_path,
+    const gchar *contact_id)
+{
+  gchar *key;
+  gchar *checksum;
+  gchar *name;
+  gchar *path;
+
+  key = g_strdup_printf ("%s\n%s", account_path, contact_id);
+  checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA1, key, -1);
+  name = g_strdup_printf ("mux-%s", checksum);
+  path = g_build_filename (g_get_user_runtime_dir (), "ssh-contact", name,
+      NULL);
+
+  g_free (key);
+  g_free (checksum);
+  g_free (name);
+
+  return path;
+}
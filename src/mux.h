@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2010 Xavier Claessens <xclaesse@gmail.com>
+ * Copyright (C) 2010 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA  02110-1301  USA
+ */
+
+#ifndef __MUX_H__
+#define __MUX_H__
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+typedef struct _Mux Mux;
+
+typedef struct
+{
+  /* The peer opened stream @id, call _mux_attach_stream() or
+   * _mux_reject_stream() once we know where it goes. */
+  void (*new_stream) (Mux *mux, guint32 id, gpointer user_data);
+  /* Stream @id is over */
+  void (*stream_closed) (Mux *mux, guint32 id, gpointer user_data);
+  /* The tube is over, @error is NULL if it was closed cleanly */
+  void (*closed) (Mux *mux, const GError *error, gpointer user_data);
+} MuxCallbacks;
+
+Mux *_mux_new (GIOStream *tube, const MuxCallbacks *callbacks,
+    gpointer user_data);
+
+Mux *_mux_ref (Mux *mux);
+
+void _mux_unref (Mux *mux);
+
+void _mux_close (Mux *mux);
+
+guint32 _mux_open_stream (Mux *mux, GIOStream *local);
+
+void _mux_attach_stream (Mux *mux, guint32 id, GIOStream *local);
+
+void _mux_reject_stream (Mux *mux, guint32 id);
+
+guint _mux_get_n_streams (Mux *mux);
+
+gchar *_mux_control_path (const gchar *account_path, const gchar *contact_id);
+
+G_END_DECLS
+
+#endif /* #ifndef __MUX_H__*/
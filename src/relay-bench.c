@@ -0,0 +1,672 @@
+/*
+ * Copyright (C) 2010 Xavier Claessens <xclaesse@gmail.com>
+ * Copyright (C) 2010 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA  02110-1301  USA
+ */
+
+/* Measures the relay engines without Telepathy nor sshd: the tube and the
+ * sshd connection are socketpairs, the relay runs in a child process exactly
+ * like in ssh-contact-service, and we push data through it. With --sessions
+ * the child relays that many sessions from one thread, like a worker of the
+ * service does. */
+
+#include "config.h"
+
+/* Fortified read() and recv() are inline and can't be overridden */
+#undef _FORTIFY_SOURCE
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include <gio/gio.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "relay.h"
+
+#define BULK_CHUNK_SIZE (64 * 1024)
+
+#define MB (1024.0 * 1024.0)
+
+typedef struct
+{
+  guint64 n_syscalls;
+  guint64 cpu_usec;
+} BenchResult;
+
+/* The relay's syscalls are counted by overriding the libc functions used by
+ * GLib and relay.c. Only the relay child counts. */
+static gboolean counting = FALSE;
+static volatile gint n_syscalls = 0;
+
+#define REAL(func) \
+  static __typeof__ (func) *real_##func = NULL; \
+  if (G_UNLIKELY (real_##func == NULL)) \
+    real_##func = (__typeof__ (func) *) dlsym (RTLD_NEXT, #func); \
+  if (counting) \
+    g_atomic_int_inc (&n_syscalls);
+
+ssize_t
+read (int fd,
+    void *buf,
+    size_t count)
+{
+  REAL (read);
+  return real_read (fd, buf, count);
+}
+
+ssize_t
+write (int fd,
+    const void *buf,
+    size_t count)
+{
+  REAL (write);
+  return real_write (fd, buf, count);
+}
+
+ssize_t
+recv (int fd,
+    void *buf,
+    size_t len,
+    int flags)
+{
+  REAL (recv);
+  return real_recv (fd, buf, len, flags);
+}
+
+ssize_t
+send (int fd,
+    const void *buf,
+    size_t len,
+    int flags)
+{
+  REAL (send);
+  return real_send (fd, buf, len, flags);
+}
+
+ssize_t
+recvmsg (int fd,
+    struct msghdr *msg,
+    int flags)
+{
+  REAL (recvmsg);
+  return real_recvmsg (fd, msg, flags);
+}
+
+ssize_t
+sendmsg (int fd,
+    const struct msghdr *msg,
+    int flags)
+{
+  REAL (sendmsg);
+  return real_sendmsg (fd, msg, flags);
+}
+
+int
+poll (struct pollfd *fds,
+    nfds_t nfds,
+    int timeout)
+{
+  REAL (poll);
+  return real_poll (fds, nfds, timeout);
+}
+
+#ifdef HAVE_SPLICE
+ssize_t
+splice (int fd_in,
+    loff_t *off_in,
+    int fd_out,
+    loff_t *off_out,
+    size_t len,
+    unsigned int flags)
+{
+  REAL (splice);
+  return real_splice (fd_in, off_in, fd_out, off_out, len, flags);
+}
+#endif
+
+#ifdef HAVE_LIBURING
+/* Each submission is one io_uring_enter(), made by liburing itself */
+int
+io_uring_submit (struct io_uring *ring)
+{
+  REAL (io_uring_submit);
+  return real_io_uring_submit (ring);
+}
+#endif
+
+static guint64
+rusage_cpu_usec (void)
+{
+  struct rusage usage;
+
+  getrusage (RUSAGE_SELF, &usage);
+
+  return (guint64) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) *
+      G_USEC_PER_SEC + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+static gboolean
+write_all (gint fd,
+    const guint8 *data,
+    gsize len)
+{
+  while (len > 0)
+    {
+      gssize n = write (fd, data, len);
+
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return FALSE;
+
+      data += n;
+      len -= n;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+read_all (gint fd,
+    guint8 *data,
+    gsize len)
+{
+  while (len > 0)
+    {
+      gssize n = read (fd, data, len);
+
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return FALSE;
+
+      data += n;
+      len -= n;
+    }
+
+  return TRUE;
+}
+
+/* Relays still running in the child */
+static guint n_relays = 0;
+
+static void
+relay_done_cb (GObject *source_object,
+    GAsyncResult *res,
+    gpointer user_data)
+{
+  GMainLoop *loop = user_data;
+  GError *error = NULL;
+
+  if (!_relay_splice_finish (res, &error))
+    {
+      g_printerr ("Relay failed: %s\n", error->message);
+      g_clear_error (&error);
+    }
+
+  if (--n_relays == 0)
+    g_main_loop_quit (loop);
+}
+
+static GIOStream *
+stream_from_fd (gint fd)
+{
+  GSocket *socket;
+  GSocketConnection *connection;
+
+  socket = g_socket_new_from_fd (fd, NULL);
+  g_assert (socket != NULL);
+  connection = g_socket_connection_factory_create_connection (socket);
+  g_object_unref (socket);
+
+  return G_IO_STREAM (connection);
+}
+
+/* Child process: relay each of @tube_fds with the same index in @sshd_fds
+ * like ssh-contact-service does, then report what it cost through
+ * @result_fd */
+static void G_GNUC_NORETURN
+run_relay (RelayEngine engine,
+    const gint *tube_fds,
+    const gint *sshd_fds,
+    guint n_sessions,
+    gint result_fd)
+{
+  GMainLoop *loop;
+  BenchResult result;
+  guint64 cpu_start;
+  guint i;
+
+  loop = g_main_loop_new (NULL, FALSE);
+
+  cpu_start = rusage_cpu_usec ();
+  counting = TRUE;
+
+  for (i = 0; i < n_sessions; i++)
+    {
+      GIOStream *tube = stream_from_fd (tube_fds[i]);
+      GIOStream *sshd = stream_from_fd (sshd_fds[i]);
+
+      _relay_splice_async (tube, sshd, engine, NULL, NULL, NULL,
+          relay_done_cb, loop);
+      n_relays++;
+      g_object_unref (tube);
+      g_object_unref (sshd);
+    }
+  g_main_loop_run (loop);
+
+  counting = FALSE;
+  result.cpu_usec = rusage_cpu_usec () - cpu_start;
+  result.n_syscalls = g_atomic_int_get (&n_syscalls);
+
+  write_all (result_fd, (const guint8 *) &result, sizeof (result));
+
+  _exit (EXIT_SUCCESS);
+}
+
+typedef struct
+{
+  gint fd;
+  gsize total;
+} BulkWriter;
+
+static gpointer
+bulk_writer_thread (gpointer user_data)
+{
+  BulkWriter *writer = user_data;
+  guint8 *buffer;
+  gsize written = 0;
+
+  buffer = g_malloc0 (BULK_CHUNK_SIZE);
+  while (written < writer->total)
+    {
+      gsize len = MIN (BULK_CHUNK_SIZE, writer->total - written);
+
+      if (!write_all (writer->fd, buffer, len))
+        break;
+      written += len;
+    }
+  g_free (buffer);
+
+  shutdown (writer->fd, SHUT_WR);
+
+  return NULL;
+}
+
+/* Stream @total bytes as fast as possible, like scp */
+static gboolean
+run_bulk (gint tube_fd,
+    gint sshd_fd,
+    gsize total)
+{
+  BulkWriter writer = { tube_fd, total };
+  GThread *thread;
+  guint8 *buffer;
+  gsize received = 0;
+
+  thread = g_thread_new ("bench-writer", bulk_writer_thread, &writer);
+
+  buffer = g_malloc (BULK_CHUNK_SIZE);
+  while (received < total)
+    {
+      gssize n = read (sshd_fd, buffer, BULK_CHUNK_SIZE);
+
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        break;
+
+      received += n;
+    }
+  g_free (buffer);
+
+  g_thread_join (thread);
+
+  return received == total;
+}
+
+/* Send @n_messages of @payload bytes, each one waiting for the previous to
+ * get through, like keystrokes in an interactive session */
+static gboolean
+run_interactive (gint tube_fd,
+    gint sshd_fd,
+    gsize payload,
+    guint n_messages)
+{
+  guint8 *buffer;
+  gboolean success = TRUE;
+  guint i;
+
+  buffer = g_malloc0 (payload);
+  for (i = 0; i < n_messages && success; i++)
+    {
+      success = write_all (tube_fd, buffer, payload) &&
+          read_all (sshd_fd, buffer, payload);
+    }
+  g_free (buffer);
+
+  return success;
+}
+
+static void
+print_result (RelayEngine engine,
+    const gchar *test,
+    gsize total,
+    gint64 elapsed,
+    const BenchResult *result,
+    guint n_messages)
+{
+  gdouble mb = total / MB;
+
+  g_print ("%-7s %-16s %10.1f %12.1f %10.3f", _relay_engine_to_string (engine),
+      test, mb / (elapsed / (gdouble) G_USEC_PER_SEC),
+      result->n_syscalls / mb, result->cpu_usec / 1000.0 / mb);
+  if (n_messages > 0)
+    g_print (" %10.1f", elapsed / (gdouble) n_messages);
+  g_print ("\n");
+}
+
+/* Client side of one session, the tube's end and sshd's end */
+typedef struct
+{
+  gint tube_fd;
+  gint sshd_fd;
+  gsize payload;
+  gsize total;
+  guint n_messages;
+  gboolean success;
+} BenchSession;
+
+static gpointer
+session_thread (gpointer user_data)
+{
+  BenchSession *session = user_data;
+
+  if (session->n_messages > 0)
+    session->success = run_interactive (session->tube_fd, session->sshd_fd,
+        session->payload, session->n_messages);
+  else
+    session->success = run_bulk (session->tube_fd, session->sshd_fd,
+        session->total);
+
+  return NULL;
+}
+
+static void
+close_fds (gint *fds,
+    guint n_fds)
+{
+  guint i;
+
+  for (i = 0; i < n_fds; i++)
+    {
+      if (fds[i] >= 0)
+        close (fds[i]);
+      fds[i] = -1;
+    }
+}
+
+/* Run @n_sessions concurrently, each moving @total bytes. Fds are indexed
+ * by session, [0] is our end and [1] the relay's. */
+static gboolean
+run_bench (RelayEngine engine,
+    gsize payload,
+    gsize total,
+    guint n_messages,
+    guint n_sessions)
+{
+  gint *tube[2];
+  gint *sshd[2];
+  gint result_pipe[2] = { -1, -1 };
+  BenchSession *sessions;
+  GThread **threads;
+  BenchResult result;
+  gchar *test;
+  gint64 start;
+  gint64 elapsed;
+  gboolean success = FALSE;
+  pid_t pid;
+  guint i;
+
+  for (i = 0; i < 2; i++)
+    {
+      tube[i] = g_new (gint, n_sessions);
+      sshd[i] = g_new (gint, n_sessions);
+      memset (tube[i], -1, n_sessions * sizeof (gint));
+      memset (sshd[i], -1, n_sessions * sizeof (gint));
+    }
+  sessions = g_new0 (BenchSession, n_sessions);
+  threads = g_new0 (GThread *, n_sessions);
+
+  if (pipe2 (result_pipe, O_CLOEXEC) < 0)
+    {
+      g_printerr ("Can't create pipe: %s\n", g_strerror (errno));
+      goto OUT;
+    }
+
+  for (i = 0; i < n_sessions; i++)
+    {
+      gint fds[2];
+
+      if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0)
+        {
+          g_printerr ("Can't create sockets: %s\n", g_strerror (errno));
+          goto OUT;
+        }
+      tube[0][i] = fds[0];
+      tube[1][i] = fds[1];
+
+      if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0)
+        {
+          g_printerr ("Can't create sockets: %s\n", g_strerror (errno));
+          goto OUT;
+        }
+      sshd[0][i] = fds[1];
+      sshd[1][i] = fds[0];
+    }
+
+  pid = fork ();
+  if (pid < 0)
+    {
+      g_printerr ("Can't fork: %s\n", g_strerror (errno));
+      goto OUT;
+    }
+
+  if (pid == 0)
+    {
+      close_fds (tube[0], n_sessions);
+      close_fds (sshd[0], n_sessions);
+      close (result_pipe[0]);
+      run_relay (engine, tube[1], sshd[1], n_sessions, result_pipe[1]);
+    }
+
+  close_fds (tube[1], n_sessions);
+  close_fds (sshd[1], n_sessions);
+  close (result_pipe[1]);
+  result_pipe[1] = -1;
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < n_sessions; i++)
+    {
+      sessions[i].tube_fd = tube[0][i];
+      sessions[i].sshd_fd = sshd[0][i];
+      sessions[i].payload = payload;
+      sessions[i].total = total;
+      sessions[i].n_messages = n_messages;
+      threads[i] = g_thread_new ("bench-session", session_thread,
+          &sessions[i]);
+    }
+
+  success = TRUE;
+  for (i = 0; i < n_sessions; i++)
+    {
+      g_thread_join (threads[i]);
+      success &= sessions[i].success;
+    }
+  elapsed = MAX (g_get_monotonic_time () - start, 1);
+
+  /* EOF on both sides ends the relays */
+  close_fds (tube[0], n_sessions);
+  close_fds (sshd[0], n_sessions);
+
+  if (!read_all (result_pipe[0], (guint8 *) &result, sizeof (result)))
+    success = FALSE;
+  waitpid (pid, NULL, 0);
+
+  if (!success)
+    {
+      g_printerr ("%s relay lost data\n", _relay_engine_to_string (engine));
+      goto OUT;
+    }
+
+  test = g_strdup_printf (n_sessions > 1 ? "%s x%u" : "%s",
+      n_messages > 0 ? "interactive" : "bulk", n_sessions);
+  print_result (engine, test, total * n_sessions, elapsed, &result,
+      n_messages);
+  g_free (test);
+
+OUT:
+  for (i = 0; i < 2; i++)
+    {
+      close_fds (tube[i], n_sessions);
+      close_fds (sshd[i], n_sessions);
+      g_free (tube[i]);
+      g_free (sshd[i]);
+    }
+  if (result_pipe[0] >= 0)
+    close (result_pipe[0]);
+  if (result_pipe[1] >= 0)
+    close (result_pipe[1]);
+  g_free (sessions);
+  g_free (threads);
+
+  return success;
+}
+
+int
+main (gint argc, gchar *argv[])
+{
+  gchar *engine_name = NULL;
+  gint bulk_mb = 256;
+  gint n_messages = 20000;
+  gint payload = 64;
+  gint buffer_min = RELAY_DEFAULT_BUFFER_MIN;
+  gint buffer_max = RELAY_DEFAULT_BUFFER_MAX;
+  gint n_sessions = 1;
+  RelayEngine engines[] = { RELAY_ENGINE_GIO, RELAY_ENGINE_SPLICE,
+      RELAY_ENGINE_URING };
+  guint n_engines = G_N_ELEMENTS (engines);
+  gboolean success = TRUE;
+  GError *error = NULL;
+  GOptionContext *optcontext;
+  GOptionEntry options[] = {
+      { "engine", 0,
+        0, G_OPTION_ARG_STRING, &engine_name,
+        "Only measure that relay engine: auto, gio, splice or uring",
+        "ENGINE" },
+      { "bulk-mb", 0,
+        0, G_OPTION_ARG_INT, &bulk_mb,
+        "Megabytes to stream in the bulk test (default: 256)",
+        "MB" },
+      { "messages", 0,
+        0, G_OPTION_ARG_INT, &n_messages,
+        "Round trips in the interactive test (default: 20000)",
+        "N" },
+      { "payload", 0,
+        0, G_OPTION_ARG_INT, &payload,
+        "Bytes per interactive message (default: 64)",
+        "BYTES" },
+      { "buffer-min", 0,
+        0, G_OPTION_ARG_INT, &buffer_min,
+        "Smallest relay buffer (default: "
+        G_STRINGIFY (RELAY_DEFAULT_BUFFER_MIN) ")",
+        "BYTES" },
+      { "buffer-max", 0,
+        0, G_OPTION_ARG_INT, &buffer_max,
+        "Largest relay buffer (default: "
+        G_STRINGIFY (RELAY_DEFAULT_BUFFER_MAX) ")",
+        "BYTES" },
+      { "sessions", 0,
+        0, G_OPTION_ARG_INT, &n_sessions,
+        "Concurrent sessions relayed by one thread, each of them moving the "
+        "whole bulk and interactive data (default: 1)",
+        "N" },
+      { NULL }
+  };
+  guint i;
+
+  g_type_init ();
+
+  optcontext = g_option_context_new ("- benchmark the ssh-contact relay");
+  g_option_context_add_main_entries (optcontext, options, NULL);
+  if (!g_option_context_parse (optcontext, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      g_clear_error (&error);
+      g_option_context_free (optcontext);
+      return EXIT_FAILURE;
+    }
+  g_option_context_free (optcontext);
+
+  if (engine_name != NULL)
+    {
+      if (!_relay_engine_from_string (engine_name, &engines[0]))
+        {
+          g_printerr ("Unknown relay engine '%s'\n", engine_name);
+          g_free (engine_name);
+          return EXIT_FAILURE;
+        }
+      n_engines = 1;
+      g_free (engine_name);
+    }
+
+  if (bulk_mb <= 0 || n_messages <= 0 || payload <= 0 || buffer_min <= 0 ||
+      buffer_max < buffer_min || n_sessions <= 0)
+    {
+      g_printerr ("Sizes must be positive\n");
+      return EXIT_FAILURE;
+    }
+  _relay_set_buffer_size (buffer_min, buffer_max);
+
+  /* A dead relay must show up as an error, not kill us */
+  signal (SIGPIPE, SIG_IGN);
+
+  g_print ("%-7s %-16s %10s %12s %10s %10s\n", "engine", "test", "MB/s",
+      "syscalls/MB", "CPU ms/MB", "RTT us");
+
+  for (i = 0; i < n_engines; i++)
+    {
+      success &= run_bench (engines[i], BULK_CHUNK_SIZE,
+          (gsize) bulk_mb * 1024 * 1024, 0, n_sessions);
+      success &= run_bench (engines[i], payload,
+          (gsize) payload * n_messages, n_messages, n_sessions);
+    }
+
+  return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,1355 @@
+/*
+ * Copyright (C) 2010 Xavier Claessens <xclaesse@gmail.com>
+ * Copyright (C) 2010 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "relay.h"
+#include "scheduler.h"
+#ifdef HAVE_LIBURING
+#include "uring.h"
+#endif
+
+/* Waiting that long for data means the session was idle, buffers go back to
+ * their minimum size */
+#define RELAY_IDLE_TIME (G_USEC_PER_SEC)
+
+/* Traffic of a direction is classified over windows of that length */
+#define RELAY_RATE_WINDOW (G_USEC_PER_SEC / 10)
+
+/* Bytes per second above which a direction is a transfer, if its reads are
+ * not keystroke sized, and below which it is interactive again */
+#define RELAY_BULK_RATE (256 * 1024)
+#define RELAY_INTERACTIVE_RATE (32 * 1024)
+
+/* Bounds of each direction's buffer, or pipe capacity for splice */
+static gsize buffer_min = RELAY_DEFAULT_BUFFER_MIN;
+static gsize buffer_max = RELAY_DEFAULT_BUFFER_MAX;
+
+/* Where GIO engine buffers come from, NULL to use g_malloc() */
+static BufferPool *buffer_pool = NULL;
+
+static const gchar *engine_names[] = {
+  "auto",
+  "gio",
+  "splice",
+  "uring",
+};
+
+static const gchar *mode_names[] = {
+  "interactive",
+  "bulk",
+};
+
+static const gchar *direction_names[] = {
+  "forward",
+  "backward",
+};
+
+typedef struct _RelayData RelayData;
+
+#ifdef HAVE_LIBURING
+/* What the io_uring operation of a pump is for */
+typedef enum
+{
+  URING_STATE_WAIT_IN,
+  URING_STATE_READ,
+  URING_STATE_WAIT_OUT,
+  URING_STATE_WRITE,
+} UringState;
+#endif
+
+/* One direction of the relay */
+typedef struct
+{
+  RelayData *relay;
+  RelayDirection direction;
+  /* Reads happen during our turns */
+  SchedulerEntry entry;
+
+  /* Current buffer size, and the one to use once it's empty */
+  gsize size;
+  gsize wanted_size;
+  /* When we started waiting for data */
+  gint64 wait_time;
+
+  /* Traffic classification, bytes and reads of the current window */
+  RelayMode mode;
+  gint64 last_read;
+  gint64 window_start;
+  gsize window_bytes;
+  guint window_reads;
+  /* Bytes asked by the last read, less means the input is drained */
+  gsize requested;
+  /* Output socket if it's TCP, -1 otherwise */
+  gint cork_fd;
+  gboolean corked;
+
+  /* splice engine, the pipe is the buffer */
+  GSocket *in;
+  GSocket *out;
+  gint pipe_fds[2];
+  GSource *source;
+
+  /* GIO engine */
+  GInputStream *input;
+  GOutputStream *output;
+  guint8 *buffer;
+  gsize written;
+  /* Waiting for buffer_pool to have room */
+  gboolean waiting;
+
+#ifdef HAVE_LIBURING
+  /* io_uring engine, uses the GIO buffer which is one of the ring's
+   * registered buffers unless buffer_index is -1 */
+  UringRing *ring;
+  UringOp op;
+  UringState state;
+  gint in_fd;
+  gint out_fd;
+  gint buffer_index;
+#endif
+
+  /* Bytes read but not yet written, and when they were read */
+  gsize pending;
+  gint64 read_time;
+} RelayPump;
+
+struct _RelayData
+{
+  GSimpleAsyncResult *simple;
+  GIOStream *stream1;
+  GIOStream *stream2;
+  RelayStats *stats;
+  RateLimit *rate_limit;
+  /* Cancelled once the relay is over, to stop pending GIO operations */
+  GCancellable *cancellable;
+  GSource *cancel_source;
+  RelayPump pumps[2];
+  gsize buffer_min;
+  gsize buffer_max;
+  BufferPool *pool;
+  gboolean completed;
+};
+
+/* Bulk mode holds partial segments back while the input keeps up, and
+ * pushes them out as soon as it's drained: on a short read, and before every
+ * wait for input since a read filling its request may be the last one */
+static void
+relay_pump_cork (RelayPump *pump,
+    gboolean corked)
+{
+#ifdef TCP_CORK
+  gint value = corked;
+
+  if (pump->cork_fd < 0 || pump->corked == corked)
+    return;
+
+  if (setsockopt (pump->cork_fd, IPPROTO_TCP, TCP_CORK, &value,
+          sizeof (value)) < 0)
+    {
+      g_debug ("Can't %s relay socket: %s", corked ? "cork" : "uncork",
+          g_strerror (errno));
+      pump->cork_fd = -1;
+      return;
+    }
+
+  pump->corked = corked;
+#endif
+}
+
+static void
+relay_pump_set_mode (RelayPump *pump,
+    RelayMode mode,
+    guint64 rate)
+{
+  RelayStats *stats = pump->relay->stats;
+
+  if (pump->mode == mode)
+    return;
+
+  g_debug ("Relay %p %s now in %s mode, %" G_GUINT64_FORMAT " bytes/s",
+      pump->relay, direction_names[pump->direction], mode_names[mode], rate);
+
+  pump->mode = mode;
+  pump->entry.interactive = mode == RELAY_MODE_INTERACTIVE;
+  if (mode == RELAY_MODE_INTERACTIVE)
+    relay_pump_cork (pump, FALSE);
+
+  if (stats != NULL)
+    {
+      g_mutex_lock (&stats->mutex);
+      stats->mode[pump->direction] = mode;
+      stats->n_mode_switches[pump->direction]++;
+      g_mutex_unlock (&stats->mutex);
+    }
+}
+
+/* A direction is a transfer when it moves a lot of data in reads that are
+ * not keystrokes, over a whole window. Each burst after an idle period
+ * starts interactive, so the first keystrokes are never held back. */
+static void
+relay_pump_classify (RelayPump *pump,
+    gsize n)
+{
+  gint64 now = g_get_monotonic_time ();
+  gint64 elapsed;
+  guint64 rate;
+  gsize average;
+
+  if (now - pump->last_read > RELAY_IDLE_TIME)
+    {
+      relay_pump_set_mode (pump, RELAY_MODE_INTERACTIVE, 0);
+      pump->window_start = now;
+      pump->window_bytes = 0;
+      pump->window_reads = 0;
+    }
+  pump->last_read = now;
+
+  pump->window_bytes += n;
+  pump->window_reads++;
+
+  elapsed = now - pump->window_start;
+  if (elapsed < RELAY_RATE_WINDOW)
+    return;
+
+  rate = (guint64) pump->window_bytes * G_USEC_PER_SEC / elapsed;
+  average = pump->window_bytes / pump->window_reads;
+  pump->window_start = now;
+  pump->window_bytes = 0;
+  pump->window_reads = 0;
+
+  if (rate >= RELAY_BULK_RATE && average >= SCHEDULER_INTERACTIVE_SIZE)
+    relay_pump_set_mode (pump, RELAY_MODE_BULK, rate);
+  else if (rate < RELAY_INTERACTIVE_RATE ||
+      average < SCHEDULER_INTERACTIVE_SIZE)
+    relay_pump_set_mode (pump, RELAY_MODE_INTERACTIVE, rate);
+}
+
+/* Interactive directions keep small buffers and each write goes out right
+ * away. Bulk ones grow their buffer while reads fill it, so transfers need
+ * fewer syscalls, and coalesce writes into full segments. Also charges the
+ * contact's rate limit. */
+static void
+relay_pump_adapt (RelayPump *pump,
+    gsize n)
+{
+  RelayData *data = pump->relay;
+
+  if (data->rate_limit != NULL)
+    _rate_limit_consume (data->rate_limit, n);
+
+  relay_pump_classify (pump, n);
+
+  if (pump->mode == RELAY_MODE_INTERACTIVE ||
+      g_get_monotonic_time () - pump->wait_time > RELAY_IDLE_TIME)
+    pump->wanted_size = data->buffer_min;
+  else if (n >= pump->size)
+    pump->wanted_size = MIN (pump->size * 2, data->buffer_max);
+  else if (n < pump->size / 2)
+    pump->wanted_size = MAX (pump->size / 2, data->buffer_min);
+
+  relay_pump_cork (pump, pump->mode == RELAY_MODE_BULK &&
+      n >= pump->requested);
+}
+
+RelayStats *
+_relay_stats_new (void)
+{
+  RelayStats *stats;
+
+  stats = g_slice_new0 (RelayStats);
+  g_mutex_init (&stats->mutex);
+  stats->start_time = g_get_monotonic_time ();
+
+  return stats;
+}
+
+void
+_relay_stats_free (RelayStats *stats)
+{
+  g_mutex_clear (&stats->mutex);
+  g_slice_free (RelayStats, stats);
+}
+
+void
+_relay_stats_snapshot (RelayStats *stats,
+    RelayStats *snapshot)
+{
+  /* The mutex itself is not copied */
+  g_mutex_lock (&stats->mutex);
+  snapshot->start_time = stats->start_time;
+  snapshot->first_byte_time = stats->first_byte_time;
+  snapshot->end_time = stats->end_time;
+  memcpy (snapshot->bytes, stats->bytes, sizeof (stats->bytes));
+  memcpy (snapshot->n_reads, stats->n_reads, sizeof (stats->n_reads));
+  memcpy (snapshot->n_writes, stats->n_writes, sizeof (stats->n_writes));
+  memcpy (snapshot->latency, stats->latency, sizeof (stats->latency));
+  memcpy (snapshot->mode, stats->mode, sizeof (stats->mode));
+  memcpy (snapshot->n_mode_switches, stats->n_mode_switches,
+      sizeof (stats->n_mode_switches));
+  g_mutex_unlock (&stats->mutex);
+}
+
+static void
+relay_stats_read (RelayStats *stats,
+    RelayPump *pump,
+    gssize n)
+{
+  if (stats == NULL)
+    return;
+
+  g_mutex_lock (&stats->mutex);
+  stats->n_reads[pump->direction]++;
+  if (n > 0)
+    {
+      pump->read_time = g_get_monotonic_time ();
+      stats->bytes[pump->direction] += n;
+      if (stats->first_byte_time == 0)
+        stats->first_byte_time = pump->read_time;
+    }
+  g_mutex_unlock (&stats->mutex);
+}
+
+static void
+relay_stats_write (RelayStats *stats,
+    RelayPump *pump)
+{
+  guint bucket;
+
+  if (stats == NULL)
+    return;
+
+  g_mutex_lock (&stats->mutex);
+  stats->n_writes[pump->direction]++;
+  if (pump->pending == 0)
+    {
+      bucket = g_bit_storage (g_get_monotonic_time () - pump->read_time) - 1;
+      stats->latency[MIN (bucket, RELAY_LATENCY_BUCKETS - 1)]++;
+    }
+  g_mutex_unlock (&stats->mutex);
+}
+
+static void
+clear_source (GSource **source)
+{
+  if (*source == NULL)
+    return;
+
+  g_source_destroy (*source);
+  g_source_unref (*source);
+  *source = NULL;
+}
+
+static void
+relay_data_stop (RelayData *data)
+{
+  guint i;
+
+  clear_source (&data->cancel_source);
+  for (i = 0; i < G_N_ELEMENTS (data->pumps); i++)
+    {
+      clear_source (&data->pumps[i].source);
+      _scheduler_cancel (&data->pumps[i].entry);
+#ifdef HAVE_LIBURING
+      if (data->pumps[i].ring != NULL)
+        _uring_ring_cancel (data->pumps[i].ring, &data->pumps[i].op);
+#endif
+    }
+}
+
+static guint8 *
+relay_buffer_alloc (RelayData *data,
+    gsize size)
+{
+  if (data->pool == NULL)
+    return g_malloc (size);
+
+  return _buffer_pool_alloc (data->pool, size);
+}
+
+static void
+relay_buffer_free (RelayData *data,
+    RelayPump *pump)
+{
+  if (data->pool == NULL)
+    g_free (pump->buffer);
+  else
+    _buffer_pool_release (data->pool, pump->buffer, pump->size);
+
+  pump->buffer = NULL;
+}
+
+static void
+relay_data_free (RelayData *data)
+{
+  guint i;
+
+  relay_data_stop (data);
+
+  for (i = 0; i < G_N_ELEMENTS (data->pumps); i++)
+    {
+      RelayPump *pump = &data->pumps[i];
+
+      if (pump->pipe_fds[0] >= 0)
+        close (pump->pipe_fds[0]);
+      if (pump->pipe_fds[1] >= 0)
+        close (pump->pipe_fds[1]);
+      relay_buffer_free (data, pump);
+    }
+
+  g_clear_object (&data->stream1);
+  g_clear_object (&data->stream2);
+  g_clear_object (&data->cancellable);
+  if (data->rate_limit != NULL)
+    _rate_limit_unref (data->rate_limit);
+
+  g_slice_free (RelayData, data);
+}
+
+static void
+relay_complete (RelayData *data,
+    const GError *error)
+{
+  GSimpleAsyncResult *simple = data->simple;
+  guint i;
+
+  if (data->completed)
+    return;
+
+  data->completed = TRUE;
+  relay_data_stop (data);
+  g_cancellable_cancel (data->cancellable);
+
+  for (i = 0; i < G_N_ELEMENTS (data->pumps); i++)
+    {
+      if (!data->pumps[i].waiting)
+        continue;
+
+      /* Our own ref is still held, that one can't be the last */
+      _buffer_pool_cancel_wait (data->pool, &data->pumps[i]);
+      data->pumps[i].waiting = FALSE;
+      g_object_unref (simple);
+    }
+
+  if (data->stats != NULL)
+    {
+      g_mutex_lock (&data->stats->mutex);
+      data->stats->end_time = g_get_monotonic_time ();
+      g_mutex_unlock (&data->stats->mutex);
+    }
+
+  if (error != NULL)
+    g_simple_async_result_set_from_error (simple, error);
+
+  /* This drops the ref taken in _relay_splice_async(), @data could be freed */
+  g_simple_async_result_complete (simple);
+  g_object_unref (simple);
+}
+
+static void
+relay_pump_fail (RelayPump *pump,
+    gint errsv)
+{
+  GError *error;
+
+  error = g_error_new_literal (G_IO_ERROR, g_io_error_from_errno (errsv),
+      g_strerror (errsv));
+  relay_complete (pump->relay, error);
+  g_error_free (error);
+}
+
+static gboolean
+relay_cancelled_cb (GCancellable *cancellable,
+    gpointer user_data)
+{
+  RelayData *data = user_data;
+  GError *error = NULL;
+
+  g_cancellable_set_error_if_cancelled (cancellable, &error);
+  relay_complete (data, error);
+  g_clear_error (&error);
+
+  return FALSE;
+}
+
+static void gio_pump_write (RelayPump *pump);
+
+/* Pending operations hold a ref on data->simple, they only have to drop it
+ * once the relay completed */
+static void
+gio_read_cb (GObject *source_object,
+    GAsyncResult *res,
+    gpointer user_data)
+{
+  RelayPump *pump = user_data;
+  RelayData *data = pump->relay;
+  GSimpleAsyncResult *simple = data->simple;
+  gssize n;
+  GError *error = NULL;
+
+  n = g_input_stream_read_finish (G_INPUT_STREAM (source_object), res,
+      &error);
+  if (data->completed)
+    goto OUT;
+
+  relay_stats_read (data->stats, pump, n);
+
+  if (n <= 0)
+    {
+      /* EOF, the session is over */
+      relay_complete (data, error);
+      goto OUT;
+    }
+
+  relay_pump_adapt (pump, n);
+  pump->pending = n;
+  pump->written = 0;
+  gio_pump_write (pump);
+
+OUT:
+  g_clear_error (&error);
+  g_object_unref (simple);
+}
+
+static void
+gio_write_cb (GObject *source_object,
+    GAsyncResult *res,
+    gpointer user_data)
+{
+  RelayPump *pump = user_data;
+  RelayData *data = pump->relay;
+  GSimpleAsyncResult *simple = data->simple;
+  gssize n;
+  GError *error = NULL;
+
+  n = g_output_stream_write_finish (G_OUTPUT_STREAM (source_object), res,
+      &error);
+  if (data->completed)
+    goto OUT;
+
+  if (n < 0)
+    {
+      relay_complete (data, error);
+      goto OUT;
+    }
+
+  pump->pending -= n;
+  pump->written += n;
+  relay_stats_write (data->stats, pump);
+
+  if (pump->pending > 0)
+    gio_pump_write (pump);
+  else
+    _scheduler_schedule (&pump->entry);
+
+OUT:
+  g_clear_error (&error);
+  g_object_unref (simple);
+}
+
+/* Buffer pool has room again, for the GIO and io_uring engines */
+static void
+relay_pool_ready_cb (gpointer user_data)
+{
+  RelayPump *pump = user_data;
+  GSimpleAsyncResult *simple = pump->relay->simple;
+
+  pump->waiting = FALSE;
+  _scheduler_schedule (&pump->entry);
+  g_object_unref (simple);
+}
+
+/* Like relay_buffer_alloc(), but when the pool is full @pump stops reading
+ * until other sessions release memory, the peer gets backpressure from the
+ * socket. It gets another turn then. */
+static guint8 *
+relay_buffer_alloc_or_wait (RelayData *data,
+    RelayPump *pump,
+    gsize size)
+{
+  guint8 *buffer;
+
+  if (data->pool == NULL)
+    return g_malloc (size);
+
+  buffer = _buffer_pool_alloc_or_wait (data->pool, size, relay_pool_ready_cb,
+      pump);
+  if (buffer == NULL)
+    {
+      pump->waiting = TRUE;
+      g_object_ref (data->simple);
+    }
+
+  return buffer;
+}
+
+static gboolean
+gio_source_cb (GObject *stream,
+    gpointer user_data)
+{
+  RelayPump *pump = user_data;
+
+  g_source_unref (pump->source);
+  pump->source = NULL;
+
+  _scheduler_schedule (&pump->entry);
+
+  return FALSE;
+}
+
+/* Wait for input without a buffer if there is none yet, so idle sessions
+ * don't hold any. Returns FALSE if the input is readable, or can't tell, then
+ * the read is issued right away. */
+static gboolean
+gio_pump_wait (RelayPump *pump)
+{
+  GPollableInputStream *input;
+
+  if (!G_IS_POLLABLE_INPUT_STREAM (pump->input))
+    return FALSE;
+
+  input = G_POLLABLE_INPUT_STREAM (pump->input);
+  if (!g_pollable_input_stream_can_poll (input) ||
+      g_pollable_input_stream_is_readable (input))
+    return FALSE;
+
+  relay_buffer_free (pump->relay, pump);
+  relay_pump_cork (pump, FALSE);
+  pump->wait_time = g_get_monotonic_time ();
+
+  pump->source = g_pollable_input_stream_create_source (input, NULL);
+  g_source_set_callback (pump->source, (GSourceFunc) gio_source_cb, pump,
+      NULL);
+  g_source_attach (pump->source, g_main_context_get_thread_default ());
+
+  return TRUE;
+}
+
+/* Our turn came, read at most @budget bytes */
+static void
+gio_pump_turn (gpointer user_data,
+    gsize budget)
+{
+  RelayPump *pump = user_data;
+  RelayData *data = pump->relay;
+
+  if (gio_pump_wait (pump))
+    return;
+
+  /* Back from a long wait, traffic starts small again */
+  if (g_get_monotonic_time () - pump->wait_time > RELAY_IDLE_TIME)
+    pump->wanted_size = data->buffer_min;
+
+  /* The buffer is empty, now is the time to resize it */
+  if (pump->buffer != NULL && pump->wanted_size != pump->size)
+    relay_buffer_free (data, pump);
+
+  if (pump->buffer == NULL)
+    {
+      pump->buffer = relay_buffer_alloc (data, pump->wanted_size);
+
+      /* Under memory pressure, bulk transfers make do with small buffers */
+      if (pump->buffer == NULL)
+        {
+          pump->wanted_size = data->buffer_min;
+          pump->buffer = relay_buffer_alloc_or_wait (data, pump,
+              pump->wanted_size);
+          if (pump->buffer == NULL)
+            return;
+        }
+
+      pump->size = pump->wanted_size;
+    }
+
+  pump->wait_time = g_get_monotonic_time ();
+
+  pump->requested = MIN (pump->size, budget);
+  g_object_ref (data->simple);
+  g_input_stream_read_async (pump->input, pump->buffer, pump->requested,
+      G_PRIORITY_DEFAULT, data->cancellable, gio_read_cb, pump);
+}
+
+static void
+gio_pump_write (RelayPump *pump)
+{
+  RelayData *data = pump->relay;
+
+  g_object_ref (data->simple);
+  g_output_stream_write_async (pump->output, pump->buffer + pump->written,
+      pump->pending, G_PRIORITY_DEFAULT, data->cancellable, gio_write_cb,
+      pump);
+}
+
+static void
+relay_start_gio (RelayData *data)
+{
+  GIOStream *streams[] = { data->stream1, data->stream2 };
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (data->pumps); i++)
+    {
+      RelayPump *pump = &data->pumps[i];
+
+      pump->input = g_io_stream_get_input_stream (streams[i]);
+      pump->output = g_io_stream_get_output_stream (streams[1 - i]);
+      pump->wanted_size = data->buffer_min;
+      pump->entry.func = gio_pump_turn;
+    }
+
+  /* Reading right away could complete from within _relay_splice_async() */
+  for (i = 0; i < G_N_ELEMENTS (data->pumps); i++)
+    _scheduler_schedule (&data->pumps[i].entry);
+}
+
+#ifdef HAVE_SPLICE
+
+static gboolean
+splice_source_cb (GSocket *socket,
+    GIOCondition condition,
+    gpointer user_data)
+{
+  RelayPump *pump = user_data;
+
+  g_source_unref (pump->source);
+  pump->source = NULL;
+
+  _scheduler_schedule (&pump->entry);
+
+  return FALSE;
+}
+
+static void
+splice_pump_wait (RelayPump *pump,
+    GSocket *socket,
+    GIOCondition condition)
+{
+  if (condition == G_IO_IN)
+    {
+      relay_pump_cork (pump, FALSE);
+      pump->wait_time = g_get_monotonic_time ();
+    }
+
+  pump->source = g_socket_create_source (socket, condition, NULL);
+  g_source_set_callback (pump->source, (GSourceFunc) splice_source_cb, pump,
+      NULL);
+  g_source_attach (pump->source, g_main_context_get_thread_default ());
+}
+
+/* Resize the pipe, it must be empty */
+static void
+splice_pump_resize (RelayPump *pump)
+{
+#ifdef F_SETPIPE_SZ
+  gint size;
+
+  size = fcntl (pump->pipe_fds[1], F_SETPIPE_SZ, (gint) pump->wanted_size);
+  if (size < 0)
+    {
+      /* Unprivileged processes can't go above /proc/sys/fs/pipe-max-size */
+      g_debug ("Can't resize relay pipe to %" G_GSIZE_FORMAT " bytes: %s",
+          pump->wanted_size, g_strerror (errno));
+      pump->relay->buffer_max = pump->size;
+      pump->wanted_size = pump->size;
+      return;
+    }
+
+  /* The kernel rounds up to a power of two pages */
+  pump->size = pump->wanted_size = size;
+#else
+  pump->wanted_size = pump->size;
+#endif
+}
+
+/* Our turn came, move at most @budget bytes from @pump->in to @pump->out
+ * until one of them would block. Data is first spliced into the pipe then
+ * from the pipe to the output socket, it never gets copied to userspace. */
+static void
+splice_pump_turn (gpointer user_data,
+    gsize budget)
+{
+  RelayPump *pump = user_data;
+  RelayStats *stats = pump->relay->stats;
+  gint in_fd = g_socket_get_fd (pump->in);
+  gint out_fd = g_socket_get_fd (pump->out);
+  gssize n;
+
+  while (TRUE)
+    {
+      if (pump->pending == 0)
+        {
+          /* Budget exhausted, let other sessions have their turn */
+          if (budget == 0)
+            {
+              _scheduler_schedule (&pump->entry);
+              return;
+            }
+
+          if (pump->wanted_size != pump->size)
+            splice_pump_resize (pump);
+
+          pump->requested = MIN (pump->size, budget);
+          n = splice (in_fd, NULL, pump->pipe_fds[1], NULL, pump->requested,
+              SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+          relay_stats_read (stats, pump, n);
+          if (n == 0)
+            {
+              /* EOF, the session is over */
+              relay_complete (pump->relay, NULL);
+              return;
+            }
+          if (n < 0)
+            {
+              if (errno == EINTR)
+                continue;
+              if (errno == EAGAIN)
+                {
+                  splice_pump_wait (pump, pump->in, G_IO_IN);
+                  return;
+                }
+              relay_pump_fail (pump, errno);
+              return;
+            }
+          relay_pump_adapt (pump, n);
+          pump->pending = n;
+          budget -= n;
+        }
+
+      n = splice (pump->pipe_fds[0], NULL, out_fd, NULL, pump->pending,
+          SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          if (errno == EAGAIN)
+            {
+              splice_pump_wait (pump, pump->out, G_IO_OUT);
+              return;
+            }
+          relay_pump_fail (pump, errno);
+          return;
+        }
+
+      pump->pending -= n;
+      relay_stats_write (stats, pump);
+    }
+}
+
+static gboolean
+relay_start_splice (RelayData *data)
+{
+  GSocket *socket1;
+  GSocket *socket2;
+  guint i;
+
+  socket1 = g_socket_connection_get_socket (
+      G_SOCKET_CONNECTION (data->stream1));
+  socket2 = g_socket_connection_get_socket (
+      G_SOCKET_CONNECTION (data->stream2));
+
+  data->pumps[RELAY_DIRECTION_FORWARD].in = socket1;
+  data->pumps[RELAY_DIRECTION_FORWARD].out = socket2;
+  data->pumps[RELAY_DIRECTION_BACKWARD].in = socket2;
+  data->pumps[RELAY_DIRECTION_BACKWARD].out = socket1;
+
+  for (i = 0; i < G_N_ELEMENTS (data->pumps); i++)
+    {
+      RelayPump *pump = &data->pumps[i];
+
+      if (pipe2 (pump->pipe_fds, O_CLOEXEC) < 0)
+        {
+          g_debug ("Can't create pipe for splice relay: %s",
+              g_strerror (errno));
+          return FALSE;
+        }
+
+      /* That's the default capacity of a pipe */
+      pump->size = 16 * 4096;
+      pump->wanted_size = data->buffer_min;
+      pump->entry.func = splice_pump_turn;
+    }
+
+  /* Wait for data instead of pumping right away, so we never complete from
+   * within _relay_splice_async() */
+  for (i = 0; i < G_N_ELEMENTS (data->pumps); i++)
+    {
+      RelayPump *pump = &data->pumps[i];
+
+      splice_pump_wait (pump, pump->in, G_IO_IN);
+    }
+
+  return TRUE;
+}
+
+#endif /* HAVE_SPLICE */
+
+#ifdef HAVE_LIBURING
+
+static void uring_pump_write (RelayPump *pump);
+
+static void
+uring_pump_release_buffer (RelayPump *pump)
+{
+  if (pump->buffer_index >= 0)
+    {
+      _uring_ring_release_buffer (pump->ring, pump->buffer_index);
+      pump->buffer_index = -1;
+      pump->buffer = NULL;
+    }
+  else if (pump->buffer != NULL)
+    {
+      relay_buffer_free (pump->relay, pump);
+    }
+}
+
+/* Like GIO ones, queued operations hold a ref on data->simple */
+static void
+uring_pump_queued (RelayPump *pump,
+    gboolean queued)
+{
+  if (queued)
+    {
+      g_object_ref (pump->relay->simple);
+      return;
+    }
+
+  uring_pump_release_buffer (pump);
+  relay_pump_fail (pump, EBUSY);
+}
+
+static void
+uring_pump_wait (RelayPump *pump,
+    gint fd,
+    GIOCondition condition)
+{
+  if (condition == G_IO_IN)
+    {
+      relay_pump_cork (pump, FALSE);
+      pump->state = URING_STATE_WAIT_IN;
+      pump->wait_time = g_get_monotonic_time ();
+    }
+  else
+    {
+      pump->state = URING_STATE_WAIT_OUT;
+    }
+
+  uring_pump_queued (pump,
+      _uring_ring_poll (pump->ring, &pump->op, fd, condition));
+}
+
+/* Our turn came, read at most @budget bytes. The sockets are non-blocking,
+ * the read fails with EAGAIN instead of holding a buffer while idle. */
+static void
+uring_pump_turn (gpointer user_data,
+    gsize budget)
+{
+  RelayPump *pump = user_data;
+  RelayData *data = pump->relay;
+
+  pump->buffer = _uring_ring_alloc_buffer (pump->ring, &pump->buffer_index);
+  if (pump->buffer == NULL)
+    pump->buffer = relay_buffer_alloc_or_wait (data, pump, pump->size);
+  if (pump->buffer == NULL)
+    return;
+
+  pump->state = URING_STATE_READ;
+  pump->requested = MIN (pump->size, budget);
+  uring_pump_queued (pump, _uring_ring_read (pump->ring, &pump->op,
+      pump->in_fd, pump->buffer, pump->requested, pump->buffer_index));
+}
+
+static void
+uring_pump_read_done (RelayPump *pump,
+    gint res)
+{
+  RelayData *data = pump->relay;
+
+  relay_stats_read (data->stats, pump, res);
+
+  if (res == -EAGAIN || res == -EINTR)
+    {
+      uring_pump_release_buffer (pump);
+      uring_pump_wait (pump, pump->in_fd, G_IO_IN);
+      return;
+    }
+
+  if (res <= 0)
+    {
+      uring_pump_release_buffer (pump);
+      if (res == 0)
+        /* EOF, the session is over */
+        relay_complete (data, NULL);
+      else
+        relay_pump_fail (pump, -res);
+      return;
+    }
+
+  relay_pump_adapt (pump, res);
+  pump->pending = res;
+  pump->written = 0;
+  uring_pump_write (pump);
+}
+
+static void
+uring_pump_write (RelayPump *pump)
+{
+  pump->state = URING_STATE_WRITE;
+  uring_pump_queued (pump, _uring_ring_write (pump->ring, &pump->op,
+      pump->out_fd, pump->buffer + pump->written, pump->pending,
+      pump->buffer_index));
+}
+
+static void
+uring_pump_write_done (RelayPump *pump,
+    gint res)
+{
+  if (res == -EAGAIN || res == -EINTR)
+    {
+      /* The peer is slow, keep the buffer until it can take the rest */
+      uring_pump_wait (pump, pump->out_fd, G_IO_OUT);
+      return;
+    }
+
+  if (res < 0)
+    {
+      uring_pump_release_buffer (pump);
+      relay_pump_fail (pump, -res);
+      return;
+    }
+
+  pump->pending -= res;
+  pump->written += res;
+  relay_stats_write (pump->relay->stats, pump);
+
+  if (pump->pending > 0)
+    {
+      uring_pump_write (pump);
+      return;
+    }
+
+  uring_pump_release_buffer (pump);
+
+  /* After a keystroke the next read would most likely fail with EAGAIN,
+   * wait for data instead. Bulk transfers read again on their next turn. */
+  if (pump->entry.interactive)
+    uring_pump_wait (pump, pump->in_fd, G_IO_IN);
+  else
+    _scheduler_schedule (&pump->entry);
+}
+
+static void
+uring_pump_cb (gint res,
+    gpointer user_data)
+{
+  RelayPump *pump = user_data;
+  RelayData *data = pump->relay;
+  GSimpleAsyncResult *simple = data->simple;
+
+  if (data->completed)
+    {
+      uring_pump_release_buffer (pump);
+      goto OUT;
+    }
+
+  if (res < 0 && (pump->state == URING_STATE_WAIT_IN ||
+      pump->state == URING_STATE_WAIT_OUT))
+    {
+      relay_pump_fail (pump, -res);
+      goto OUT;
+    }
+
+  switch (pump->state)
+    {
+      case URING_STATE_WAIT_IN:
+        /* Data arrived, read it during our next turn */
+        _scheduler_schedule (&pump->entry);
+        break;
+      case URING_STATE_READ:
+        uring_pump_read_done (pump, res);
+        break;
+      case URING_STATE_WAIT_OUT:
+        uring_pump_write (pump);
+        break;
+      case URING_STATE_WRITE:
+        uring_pump_write_done (pump, res);
+        break;
+    }
+
+OUT:
+  g_object_unref (simple);
+}
+
+static gboolean
+relay_start_uring (RelayData *data)
+{
+  UringRing *ring;
+  gint fd1;
+  gint fd2;
+  guint i;
+
+  ring = _uring_ring_get ();
+  if (ring == NULL)
+    return FALSE;
+
+  fd1 = g_socket_get_fd (g_socket_connection_get_socket (
+      G_SOCKET_CONNECTION (data->stream1)));
+  fd2 = g_socket_get_fd (g_socket_connection_get_socket (
+      G_SOCKET_CONNECTION (data->stream2)));
+
+  data->pumps[RELAY_DIRECTION_FORWARD].in_fd = fd1;
+  data->pumps[RELAY_DIRECTION_FORWARD].out_fd = fd2;
+  data->pumps[RELAY_DIRECTION_BACKWARD].in_fd = fd2;
+  data->pumps[RELAY_DIRECTION_BACKWARD].out_fd = fd1;
+
+  for (i = 0; i < G_N_ELEMENTS (data->pumps); i++)
+    {
+      RelayPump *pump = &data->pumps[i];
+
+      /* Registered buffers have a fixed size, turns are bounded anyway */
+      pump->ring = ring;
+      pump->size = pump->wanted_size = URING_BUFFER_SIZE;
+      pump->entry.func = uring_pump_turn;
+      _uring_op_init (&pump->op, uring_pump_cb, pump);
+    }
+
+  /* Polls are only submitted once we return to the main loop, we never
+   * complete from within _relay_splice_async() */
+  for (i = 0; i < G_N_ELEMENTS (data->pumps); i++)
+    {
+      RelayPump *pump = &data->pumps[i];
+
+      uring_pump_wait (pump, pump->in_fd, G_IO_IN);
+    }
+
+  return TRUE;
+}
+
+#endif /* HAVE_LIBURING */
+
+static gboolean
+socket_is_tcp (GSocket *socket)
+{
+  GSocketFamily family = g_socket_get_family (socket);
+
+  return g_socket_get_socket_type (socket) == G_SOCKET_TYPE_STREAM &&
+      (family == G_SOCKET_FAMILY_IPV4 || family == G_SOCKET_FAMILY_IPV6);
+}
+
+/* Returns the fd of @stream if it's a TCP connection, with Nagle's
+ * algorithm disabled, -1 otherwise */
+static gint
+relay_stream_get_tcp_fd (GIOStream *stream)
+{
+  GSocket *socket;
+
+  if (!G_IS_SOCKET_CONNECTION (stream))
+    return -1;
+
+  socket = g_socket_connection_get_socket (G_SOCKET_CONNECTION (stream));
+  if (!socket_is_tcp (socket))
+    return -1;
+
+  _relay_set_nodelay (socket);
+
+  return g_socket_get_fd (socket);
+}
+
+static gboolean
+relay_can_splice (GIOStream *stream1,
+    GIOStream *stream2)
+{
+#ifdef HAVE_SPLICE
+  return G_IS_SOCKET_CONNECTION (stream1) && G_IS_SOCKET_CONNECTION (stream2);
+#else
+  return FALSE;
+#endif
+}
+
+gboolean
+_relay_engine_from_string (const gchar *str,
+    RelayEngine *engine)
+{
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (engine_names); i++)
+    {
+      if (g_ascii_strcasecmp (str, engine_names[i]) == 0)
+        {
+          *engine = i;
+          return TRUE;
+        }
+    }
+
+  return FALSE;
+}
+
+/* Must be called before any relay starts. @pool must outlive relays. */
+void
+_relay_set_buffer_pool (BufferPool *pool)
+{
+  buffer_pool = pool;
+}
+
+/* Must be called before any relay starts */
+void
+_relay_set_buffer_size (gsize min,
+    gsize max)
+{
+  g_return_if_fail (min > 0 && min <= max);
+
+  buffer_min = min;
+  buffer_max = max;
+}
+
+const gchar *
+_relay_engine_to_string (RelayEngine engine)
+{
+  g_return_val_if_fail (engine < G_N_ELEMENTS (engine_names), NULL);
+
+  return engine_names[engine];
+}
+
+const gchar *
+_relay_mode_to_string (RelayMode mode)
+{
+  g_return_val_if_fail (mode < G_N_ELEMENTS (mode_names), NULL);
+
+  return mode_names[mode];
+}
+
+/* Keystrokes must not wait for an ACK of the previous segment, relays do
+ * their own coalescing in bulk mode. Does nothing if @socket is not TCP. */
+void
+_relay_set_nodelay (GSocket *socket)
+{
+  gint value = 1;
+
+  if (!socket_is_tcp (socket))
+    return;
+
+  if (setsockopt (g_socket_get_fd (socket), IPPROTO_TCP, TCP_NODELAY, &value,
+          sizeof (value)) < 0)
+    g_debug ("Can't disable Nagle's algorithm: %s", g_strerror (errno));
+}
+
+/* @stats, if not NULL, must stay alive until the relay completes. Reads
+ * are charged to @rate_limit, if not NULL. */
+void
+_relay_splice_async (GIOStream *stream1,
+    GIOStream *stream2,
+    RelayEngine engine,
+    RelayStats *stats,
+    RateLimit *rate_limit,
+    GCancellable *cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data)
+{
+  GSimpleAsyncResult *simple;
+  RelayData *data;
+  guint i;
+
+  simple = g_simple_async_result_new (NULL, callback, user_data,
+      _relay_splice_async);
+
+  data = g_slice_new0 (RelayData);
+  data->simple = simple;
+  data->stream1 = g_object_ref (stream1);
+  data->stream2 = g_object_ref (stream2);
+  data->stats = stats;
+  if (rate_limit != NULL)
+    data->rate_limit = _rate_limit_ref (rate_limit);
+  data->buffer_min = buffer_min;
+  data->buffer_max = buffer_max;
+  data->pool = buffer_pool;
+  data->cancellable = g_cancellable_new ();
+  for (i = 0; i < G_N_ELEMENTS (data->pumps); i++)
+    {
+      data->pumps[i].relay = data;
+      data->pumps[i].direction = i;
+      data->pumps[i].pipe_fds[0] = -1;
+      data->pumps[i].pipe_fds[1] = -1;
+#ifdef HAVE_LIBURING
+      data->pumps[i].buffer_index = -1;
+#endif
+      /* The engine sets the turn function */
+      _scheduler_entry_init (&data->pumps[i].entry, NULL, &data->pumps[i],
+          data->rate_limit);
+    }
+  data->pumps[RELAY_DIRECTION_FORWARD].cork_fd =
+      relay_stream_get_tcp_fd (stream2);
+  data->pumps[RELAY_DIRECTION_BACKWARD].cork_fd =
+      relay_stream_get_tcp_fd (stream1);
+  g_simple_async_result_set_op_res_gpointer (simple, data,
+      (GDestroyNotify) relay_data_free);
+
+  if (cancellable != NULL)
+    {
+      data->cancel_source = g_cancellable_source_new (cancellable);
+      g_source_set_callback (data->cancel_source,
+          (GSourceFunc) relay_cancelled_cb, data, NULL);
+      g_source_attach (data->cancel_source,
+          g_main_context_get_thread_default ());
+    }
+
+  if (engine == RELAY_ENGINE_URING && G_IS_SOCKET_CONNECTION (stream1) &&
+      G_IS_SOCKET_CONNECTION (stream2))
+    {
+#ifdef HAVE_LIBURING
+      if (relay_start_uring (data))
+        return;
+#else
+      g_debug ("Built without io_uring support");
+#endif
+      /* Falls back to splice */
+    }
+
+  if (engine != RELAY_ENGINE_GIO && relay_can_splice (stream1, stream2))
+    {
+#ifdef HAVE_SPLICE
+      if (relay_start_splice (data))
+        return;
+#endif
+    }
+  else if (engine == RELAY_ENGINE_SPLICE || engine == RELAY_ENGINE_URING)
+    {
+      g_debug ("%s relay not possible for those streams, using GIO",
+          engine_names[engine]);
+    }
+
+  relay_start_gio (data);
+}
+
+gboolean
+_relay_splice_finish (GAsyncResult *res,
+    GError **error)
+{
+  g_return_val_if_fail (g_simple_async_result_is_valid (res, NULL,
+      _relay_splice_async), FALSE);
+
+  return !g_simple_async_result_propagate_error (G_SIMPLE_ASYNC_RESULT (res),
+      error);
+}
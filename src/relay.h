@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2010 Xavier Claessens <xclaesse@gmail.com>
+ * Copyright (C) 2010 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA  02110-1301  USA
+ */
+
+#ifndef __RELAY_H__
+#define __RELAY_H__
+
+#include <gio/gio.h>
+
+#include "buffer-pool.h"
+#include "scheduler.h"
+
+G_BEGIN_DECLS
+
+typedef enum
+{
+  /* splice(2) when both ends are sockets, GIO otherwise */
+  RELAY_ENGINE_AUTO,
+  /* Async GIO reads and writes, copies through userspace buffers */
+  RELAY_ENGINE_GIO,
+  /* splice(2) through a pipe, falls back to GIO if not possible */
+  RELAY_ENGINE_SPLICE,
+  /* Batched io_uring reads and writes, one syscall per main loop iteration
+   * for all the thread's relays. Falls back to splice, then GIO, if the
+   * kernel can't do it. */
+  RELAY_ENGINE_URING,
+} RelayEngine;
+
+/* Default bounds of relay buffers, they grow under bulk traffic */
+#define RELAY_DEFAULT_BUFFER_MIN 4096
+#define RELAY_DEFAULT_BUFFER_MAX 1048576
+
+/* Forwarding delays are counted in bucket i when below 2^(i+1) µs, the last
+ * bucket gets everything slower */
+#define RELAY_LATENCY_BUCKETS 20
+
+/* Direction of the data in RelayStats arrays */
+typedef enum
+{
+  /* Read from stream1, written to stream2 */
+  RELAY_DIRECTION_FORWARD,
+  /* Read from stream2, written to stream1 */
+  RELAY_DIRECTION_BACKWARD,
+} RelayDirection;
+
+/* How a direction of the relay is tuned, it switches with its traffic */
+typedef enum
+{
+  /* Keystrokes: small buffers, each write goes out right away */
+  RELAY_MODE_INTERACTIVE,
+  /* Transfers: growing buffers, writes coalesced into full segments */
+  RELAY_MODE_BULK,
+} RelayMode;
+
+/* What a relay did so far. It is updated from the thread running the relay,
+ * use _relay_stats_snapshot() to read it from another one. Times are
+ * g_get_monotonic_time() values, 0 when it didn't happen yet. */
+typedef struct
+{
+  GMutex mutex;
+
+  gint64 start_time;
+  gint64 first_byte_time;
+  gint64 end_time;
+
+  guint64 bytes[2];
+  guint64 n_reads[2];
+  guint64 n_writes[2];
+
+  /* Time between reading data and having written all of it */
+  guint64 latency[RELAY_LATENCY_BUCKETS];
+
+  RelayMode mode[2];
+  guint64 n_mode_switches[2];
+} RelayStats;
+
+RelayStats *_relay_stats_new (void);
+
+void _relay_stats_free (RelayStats *stats);
+
+void _relay_stats_snapshot (RelayStats *stats, RelayStats *snapshot);
+
+gboolean _relay_engine_from_string (const gchar *str, RelayEngine *engine);
+
+const gchar *_relay_engine_to_string (RelayEngine engine);
+
+const gchar *_relay_mode_to_string (RelayMode mode);
+
+void _relay_set_nodelay (GSocket *socket);
+
+void _relay_set_buffer_size (gsize min, gsize max);
+
+void _relay_set_buffer_pool (BufferPool *pool);
+
+void _relay_splice_async (GIOStream *stream1, GIOStream *stream2,
+    RelayEngine engine, RelayStats *stats, RateLimit *rate_limit,
+    GCancellable *cancellable,
+    GAsyncReadyCallback callback, gpointer user_data);
+
+gboolean _relay_splice_finish (GAsyncResult *res, GError **error);
+
+G_END_DECLS
+
+#endif /* #ifndef __RELAY_H__*/
@@ -0,0 +1,372 @@
+/*
+ * Copyright (C) 2010 Xavier Claessens <xclaesse@gmail.com>
+ * Copyright (C) 2010 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include "scheduler.h"
+
+/* Relays of a thread don't pump from their socket sources anymore, they get
+ * queued here and take turns moving at most SCHEDULER_QUANTUM bytes, so a
+ * bulk transfer can't starve other sessions. Interactive entries are served
+ * first. Entries of rate limited contacts wait for their token bucket to
+ * refill before getting a turn. */
+
+/* Tokens to wait for before giving a turn to a rate limited entry */
+#define RATE_LIMIT_MIN_TURN (16 * 1024)
+
+/* A dispatch gives turns until it spent that many µs, or handed out that
+ * many bytes of budget */
+#define SCHEDULER_DISPATCH_TIME 2000
+#define SCHEDULER_DISPATCH_BYTES (16 * SCHEDULER_QUANTUM)
+
+/* Turns a thread counts on its own before adding them to the totals */
+#define SCHEDULER_FLUSH_TURNS 1024
+
+struct _Scheduler
+{
+  GMainContext *context;
+  GQueue interactive;
+  GQueue bulk;
+  GSource *source;
+
+  /* Not yet added to the totals */
+  guint64 n_wakeups;
+  guint64 n_turns;
+};
+
+/* Of all threads, for metrics */
+static GMutex totals_mutex;
+static guint64 total_wakeups = 0;
+static guint64 total_turns = 0;
+
+/* A token bucket, shared by every session of a contact, from any thread */
+struct _RateLimit
+{
+  volatile gint ref_count;
+  GMutex mutex;
+  gdouble rate;
+  gdouble burst;
+  gdouble tokens;
+  gint64 last_refill;
+};
+
+static void
+scheduler_flush_counts (Scheduler *scheduler)
+{
+  g_mutex_lock (&totals_mutex);
+  total_wakeups += scheduler->n_wakeups;
+  total_turns += scheduler->n_turns;
+  g_mutex_unlock (&totals_mutex);
+
+  scheduler->n_wakeups = 0;
+  scheduler->n_turns = 0;
+}
+
+static void
+scheduler_free (Scheduler *scheduler)
+{
+  scheduler_flush_counts (scheduler);
+
+  if (scheduler->source != NULL)
+    {
+      g_source_destroy (scheduler->source);
+      g_source_unref (scheduler->source);
+    }
+  g_main_context_unref (scheduler->context);
+
+  g_slice_free (Scheduler, scheduler);
+}
+
+static GPrivate scheduler_key = G_PRIVATE_INIT (
+    (GDestroyNotify) scheduler_free);
+
+/* Each thread running relays has its own scheduler */
+static Scheduler *
+scheduler_get (void)
+{
+  Scheduler *scheduler;
+
+  scheduler = g_private_get (&scheduler_key);
+  if (scheduler == NULL)
+    {
+      scheduler = g_slice_new0 (Scheduler);
+      scheduler->context = g_main_context_ref_thread_default ();
+      g_queue_init (&scheduler->interactive);
+      g_queue_init (&scheduler->bulk);
+      g_private_set (&scheduler_key, scheduler);
+    }
+
+  return scheduler;
+}
+
+/* Refill the bucket, returns available tokens and if there are not enough
+ * for a turn, how long to wait */
+static gsize
+rate_limit_available (RateLimit *rate_limit,
+    gint64 *wait)
+{
+  gint64 now = g_get_monotonic_time ();
+  gdouble needed;
+  gsize available;
+
+  g_mutex_lock (&rate_limit->mutex);
+
+  rate_limit->tokens = MIN (rate_limit->burst, rate_limit->tokens +
+      rate_limit->rate * (now - rate_limit->last_refill) / G_USEC_PER_SEC);
+  rate_limit->last_refill = now;
+
+  needed = MIN (rate_limit->burst, RATE_LIMIT_MIN_TURN);
+  if (rate_limit->tokens < needed)
+    {
+      *wait = (needed - rate_limit->tokens) * G_USEC_PER_SEC /
+          rate_limit->rate;
+      available = 0;
+    }
+  else
+    {
+      available = rate_limit->tokens;
+    }
+
+  g_mutex_unlock (&rate_limit->mutex);
+
+  return available;
+}
+
+static gboolean
+entry_timer_cb (gpointer user_data)
+{
+  SchedulerEntry *entry = user_data;
+
+  g_source_unref (entry->timer);
+  entry->timer = NULL;
+  entry->scheduler = NULL;
+
+  _scheduler_schedule (entry);
+
+  return FALSE;
+}
+
+/* Give @entry its turn, or park it until its bucket refilled. Returns the
+ * budget it got, 0 if parked. */
+static gsize
+scheduler_run_entry (Scheduler *scheduler,
+    SchedulerEntry *entry)
+{
+  gsize budget = SCHEDULER_QUANTUM;
+  gint64 wait;
+
+  entry->scheduler = NULL;
+
+  if (entry->rate_limit != NULL)
+    {
+      gsize available = rate_limit_available (entry->rate_limit, &wait);
+
+      if (available == 0)
+        {
+          /* Not in any queue until the bucket refilled */
+          entry->scheduler = scheduler;
+          entry->timer = g_timeout_source_new (MAX (wait / 1000, 1));
+          g_source_set_callback (entry->timer, entry_timer_cb, entry, NULL);
+          g_source_attach (entry->timer, scheduler->context);
+          return 0;
+        }
+
+      budget = MIN (budget, available);
+    }
+
+  /* Busy threads may never run out of entries */
+  if (++scheduler->n_turns >= SCHEDULER_FLUSH_TURNS)
+    scheduler_flush_counts (scheduler);
+
+  /* @entry could be gone after that */
+  entry->func (entry->user_data, budget);
+
+  return budget;
+}
+
+/* Serve queued entries until there are none left, or this dispatch used its
+ * time or byte budget. Then socket sources get polled again, and we are
+ * dispatched on the next iteration if entries remain. */
+static gboolean
+scheduler_dispatch_cb (gpointer user_data)
+{
+  Scheduler *scheduler = user_data;
+  gint64 deadline = g_get_monotonic_time () + SCHEDULER_DISPATCH_TIME;
+  gsize bytes = 0;
+
+  while (bytes < SCHEDULER_DISPATCH_BYTES &&
+      g_get_monotonic_time () < deadline)
+    {
+      GList *link;
+
+      link = g_queue_pop_head_link (&scheduler->interactive);
+      if (link == NULL)
+        link = g_queue_pop_head_link (&scheduler->bulk);
+      if (link == NULL)
+        break;
+
+      bytes += scheduler_run_entry (scheduler, link->data);
+    }
+
+  /* Entries scheduled again during their turn are queued already */
+  if (g_queue_is_empty (&scheduler->interactive) &&
+      g_queue_is_empty (&scheduler->bulk))
+    {
+      g_source_unref (scheduler->source);
+      scheduler->source = NULL;
+      scheduler_flush_counts (scheduler);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+scheduler_wake (Scheduler *scheduler)
+{
+  if (scheduler->source != NULL)
+    return;
+
+  scheduler->n_wakeups++;
+  scheduler->source = g_idle_source_new ();
+  /* Like the socket sources, an idle priority could starve it */
+  g_source_set_priority (scheduler->source, G_PRIORITY_DEFAULT);
+  g_source_set_callback (scheduler->source, scheduler_dispatch_cb, scheduler,
+      NULL);
+  g_source_attach (scheduler->source, scheduler->context);
+}
+
+void
+_scheduler_entry_init (SchedulerEntry *entry,
+    SchedulerFunc func,
+    gpointer user_data,
+    RateLimit *rate_limit)
+{
+  entry->func = func;
+  entry->user_data = user_data;
+  entry->rate_limit = rate_limit;
+  entry->interactive = TRUE;
+  entry->scheduler = NULL;
+  entry->link.data = entry;
+  entry->link.next = entry->link.prev = NULL;
+  entry->timer = NULL;
+}
+
+/* Give @entry a turn once other entries of this thread had theirs */
+void
+_scheduler_schedule (SchedulerEntry *entry)
+{
+  Scheduler *scheduler;
+
+  if (entry->scheduler != NULL)
+    return;
+
+  scheduler = scheduler_get ();
+  entry->scheduler = scheduler;
+  g_queue_push_tail_link (entry->interactive ? &scheduler->interactive :
+      &scheduler->bulk, &entry->link);
+
+  scheduler_wake (scheduler);
+}
+
+void
+_scheduler_cancel (SchedulerEntry *entry)
+{
+  Scheduler *scheduler = entry->scheduler;
+
+  if (scheduler == NULL)
+    return;
+
+  if (entry->timer != NULL)
+    {
+      g_source_destroy (entry->timer);
+      g_source_unref (entry->timer);
+      entry->timer = NULL;
+    }
+  else if (entry->interactive)
+    {
+      g_queue_unlink (&scheduler->interactive, &entry->link);
+    }
+  else
+    {
+      g_queue_unlink (&scheduler->bulk, &entry->link);
+    }
+
+  entry->scheduler = NULL;
+}
+
+RateLimit *
+_rate_limit_new (guint64 bytes_per_second)
+{
+  RateLimit *rate_limit;
+
+  g_return_val_if_fail (bytes_per_second > 0, NULL);
+
+  rate_limit = g_slice_new0 (RateLimit);
+  rate_limit->ref_count = 1;
+  g_mutex_init (&rate_limit->mutex);
+  rate_limit->rate = bytes_per_second;
+  /* Allow bursts of a quarter of a second */
+  rate_limit->burst = MAX (rate_limit->rate / 4, RATE_LIMIT_MIN_TURN);
+  rate_limit->tokens = rate_limit->burst;
+  rate_limit->last_refill = g_get_monotonic_time ();
+
+  return rate_limit;
+}
+
+RateLimit *
+_rate_limit_ref (RateLimit *rate_limit)
+{
+  g_atomic_int_inc (&rate_limit->ref_count);
+
+  return rate_limit;
+}
+
+void
+_rate_limit_unref (RateLimit *rate_limit)
+{
+  if (!g_atomic_int_dec_and_test (&rate_limit->ref_count))
+    return;
+
+  g_mutex_clear (&rate_limit->mutex);
+  g_slice_free (RateLimit, rate_limit);
+}
+
+void
+_rate_limit_consume (RateLimit *rate_limit,
+    gsize n)
+{
+  g_mutex_lock (&rate_limit->mutex);
+  rate_limit->tokens -= n;
+  g_mutex_unlock (&rate_limit->mutex);
+}
+
+/* Times the schedulers of all threads were woken up after running out of
+ * entries, and turns they gave, so far. Busy threads report theirs every
+ * SCHEDULER_FLUSH_TURNS turns. */
+void
+_scheduler_get_counts (guint64 *n_wakeups,
+    guint64 *n_turns)
+{
+  g_mutex_lock (&totals_mutex);
+  *n_wakeups = total_wakeups;
+  *n_turns = total_turns;
+  g_mutex_unlock (&totals_mutex);
+}
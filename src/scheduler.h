@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2010 Xavier Claessens <xclaesse@gmail.com>
+ * Copyright (C) 2010 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA  02110-1301  USA
+ */
+
+#ifndef __SCHEDULER_H__
+#define __SCHEDULER_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Bytes a relay direction may move per turn */
+#define SCHEDULER_QUANTUM (64 * 1024)
+
+/* Chunks smaller than that are considered keystrokes, not bulk data */
+#define SCHEDULER_INTERACTIVE_SIZE 512
+
+typedef struct _Scheduler Scheduler;
+typedef struct _RateLimit RateLimit;
+
+/* Take a turn, moving at most @budget bytes. The entry must be scheduled
+ * again, or wait for its sockets, to get another turn. */
+typedef void (*SchedulerFunc) (gpointer user_data, gsize budget);
+
+typedef struct
+{
+  SchedulerFunc func;
+  gpointer user_data;
+  RateLimit *rate_limit;
+  /* Served before bulk entries */
+  gboolean interactive;
+
+  /* private */
+  Scheduler *scheduler;
+  GList link;
+  GSource *timer;
+} SchedulerEntry;
+
+void _scheduler_entry_init (SchedulerEntry *entry, SchedulerFunc func,
+    gpointer user_data, RateLimit *rate_limit);
+
+void _scheduler_schedule (SchedulerEntry *entry);
+
+void _scheduler_cancel (SchedulerEntry *entry);
+
+void _scheduler_get_counts (guint64 *n_wakeups, guint64 *n_turns);
+
+RateLimit *_rate_limit_new (guint64 bytes_per_second);
+
+RateLimit *_rate_limit_ref (RateLimit *rate_limit);
+
+void _rate_limit_unref (RateLimit *rate_limit);
+
+void _rate_limit_consume (RateLimit *rate_limit, gsize n);
+
+G_END_DECLS
+
+#endif /* #ifndef __SCHEDULER_H__*/
@@ -20,13 +20,103 @@
 
 #include "config.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
 
 #include <gio/gio.h>
 #include <telepathy-glib/telepathy-glib.h>
 
+#include "backend.h"
+#include "metrics.h"
+#include "mux.h"
+#include "relay.h"
+#include "scheduler.h"
+#include "session-table.h"
+#include "stats.h"
+#include "worker-pool.h"
+
+/* Default sshd to relay tubes to, and seconds to wait for it */
+#define DEFAULT_BACKEND "127.0.0.1:22"
+#define DEFAULT_CONNECT_TIMEOUT 10
+
+/* Seconds to stay registered after the last session, so the next one doesn't
+ * pay for D-Bus activation and startup again */
+#define DEFAULT_LINGER 300
+
+/* Memory all relay buffers may use together */
+#define DEFAULT_RELAY_MEMORY_CAP 67108864
+
+/* Seconds between buffer pool and session reports in the debug output */
+#define USAGE_LOG_INTERVAL 60
+
+/* Connection attempts of a session running out of file descriptors */
+#define MAX_CONNECT_ATTEMPTS 10
+
+/* Seconds between writes of --metrics-file */
+#define DEFAULT_METRICS_INTERVAL 15
+
+typedef struct
+{
+  Mux *mux;
+  guint32 id;
+  gint64 connect_time;
+} MuxStreamData;
+
 static GMainLoop *loop = NULL;
-static GList *channel_list = NULL;
+static SessionTable *sessions = NULL;
+static RelayEngine relay_engine = RELAY_ENGINE_AUTO;
+static WorkerPool *worker_pool = NULL;
+static BackendGroup *backends = NULL;
+static gchar **inetd_argv = NULL;
+static Stats *stats = NULL;
+static Metrics *metrics = NULL;
+static BufferPool *buffer_pool = NULL;
+/* Contact identifier -> owned RateLimit, shared by its sessions */
+static GHashTable *rate_limits = NULL;
+static guint linger = DEFAULT_LINGER;
+static guint linger_id = 0;
+
+static void session_accept (Session *session);
+static void session_connect_backend (Session *session);
+
+static gboolean
+linger_timeout_cb (gpointer user_data)
+{
+  linger_id = 0;
+  g_debug ("No session for %u seconds, exiting", linger);
+  g_main_loop_quit (loop);
+
+  return FALSE;
+}
+
+/* Exit once we had no session for a while */
+static void
+update_linger (void)
+{
+  if (_session_table_get_size (sessions) > 0)
+    {
+      if (linger_id != 0)
+        {
+          g_source_remove (linger_id);
+          linger_id = 0;
+        }
+      return;
+    }
+
+  if (linger_id != 0)
+    return;
+
+  if (linger == 0)
+    g_main_loop_quit (loop);
+  else
+    linger_id = g_timeout_add_seconds (linger, linger_timeout_cb, NULL);
+}
 
 static void
 channel_invalidated_cb (TpChannel *channel,
@@ -35,35 +125,206 @@ channel_invalidated_cb (TpChannel *channel,
     gchar *message,
     gpointer user_data)
 {
-  channel_list = g_list_remove (channel_list, channel);
-  g_object_unref (channel);
-
-  if (channel_list == NULL)
-    g_main_loop_quit (loop);
+  _session_table_remove (sessions, channel);
+  update_linger ();
 }
 
 static void
-session_complete (TpChannel *channel, const GError *error)
+session_complete (Session *session,
+    const GError *error)
 {
   if (error != NULL)
     {
-      g_debug ("Error for channel %p: %s", channel,
+      g_debug ("Error for channel %p: %s", session->channel,
           error ? error->message : "No error message");
     }
 
-  tp_channel_close_async (channel, NULL, NULL);
+  if (session->state == SESSION_STATE_CLOSED)
+    return;
+
+  if (error != NULL)
+    _metrics_tube_failed (metrics, error);
+
+  session->state = SESSION_STATE_CLOSED;
+  tp_channel_close_async (session->channel, NULL, NULL);
+}
+
+/* Note when the kernel ran out of file descriptors for us */
+static void
+check_fds_exhausted (const GError *error)
+{
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_TOO_MANY_OPEN_FILES))
+    _session_table_fds_exhausted (sessions);
+}
+
+static void
+session_set_running (Session *session)
+{
+  session->state = SESSION_STATE_RUNNING;
+  _stats_startup_phase (stats, STATS_STARTUP_FIRST_SESSION);
 }
 
 static void
 splice_cb (GObject *source_object,
     GAsyncResult *res,
-    gpointer channel)
+    gpointer user_data)
+{
+  Session *session = user_data;
+  GError *error = NULL;
+
+  /* Cancelled means the channel is already gone */
+  if (!_worker_pool_relay_finish (res, &error) &&
+      g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    g_clear_error (&error);
+
+  session_complete (session, error);
+  g_clear_error (&error);
+
+  _stats_remove_session (stats,
+      tp_proxy_get_object_path (session->channel));
+  _session_unref (session);
+}
+
+static gboolean
+retry_connect_cb (gpointer user_data)
+{
+  Session *session = user_data;
+
+  if (session->state != SESSION_STATE_CLOSED)
+    session_connect_backend (session);
+
+  _session_unref (session);
+
+  return FALSE;
+}
+
+static void
+backend_connected_cb (GObject *object,
+    GAsyncResult *res,
+    gpointer user_data)
+{
+  Session *session = user_data;
+  GError *error = NULL;
+
+  session->sshd_connection = _backend_group_connect_finish (backends, res,
+      &error);
+  if (session->state == SESSION_STATE_CLOSED)
+    goto OUT;
+
+  if (session->sshd_connection == NULL)
+    {
+      check_fds_exhausted (error);
+
+      /* Other sessions will close some file descriptors */
+      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_TOO_MANY_OPEN_FILES)
+          && session->connect_attempts < MAX_CONNECT_ATTEMPTS)
+        {
+          g_timeout_add (_session_table_get_backoff (sessions),
+              retry_connect_cb, _session_ref (session));
+          goto OUT;
+        }
+
+      session_complete (session, error);
+      goto OUT;
+    }
+
+  _session_table_fds_available (sessions);
+  _metrics_backend_connected (metrics,
+      g_get_monotonic_time () - session->connect_time);
+  session_set_running (session);
+
+  _stats_add_session (stats, tp_proxy_get_object_path (session->channel),
+      tp_channel_get_identifier (session->channel), session->stats);
+
+  /* Splice tube and ssh connections, on a worker thread if we have some. The
+   * channel itself stays on the main thread with the rest of D-Bus. */
+  _worker_pool_relay_async (worker_pool,
+      G_IO_STREAM (session->tube_connection),
+      G_IO_STREAM (session->sshd_connection), relay_engine, session->stats,
+      g_hash_table_lookup (rate_limits,
+          tp_channel_get_identifier (session->channel)),
+      session->cancellable, splice_cb, _session_ref (session));
+
+OUT:
+  _session_unref (session);
+  g_clear_error (&error);
+}
+
+/* Connect to the sshd without blocking other sessions */
+static void
+session_connect_backend (Session *session)
+{
+  session->state = SESSION_STATE_CONNECTING;
+  session->connect_attempts++;
+  session->connect_time = g_get_monotonic_time ();
+
+  _backend_group_connect_async (backends, backend_connected_cb,
+      _session_ref (session));
+}
+
+static void
+inetd_child_watch_cb (GPid pid,
+    gint status,
+    gpointer user_data)
 {
+  Session *session = user_data;
   GError *error = NULL;
 
-  g_io_stream_splice_finish (res, &error);
-  session_complete (channel, error);
+  if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
+    {
+      error = g_error_new (G_SPAWN_ERROR, G_SPAWN_ERROR_FAILED,
+          "%s exited abnormally (status %d)", inetd_argv[0], status);
+    }
+
+  session_complete (session, error);
+
+  g_spawn_close_pid (pid);
   g_clear_error (&error);
+  _session_unref (session);
+}
+
+/* Runs in the child, between fork and exec */
+static void
+inetd_child_setup (gpointer user_data)
+{
+  gint fd = GPOINTER_TO_INT (user_data);
+  gint flags;
+
+  /* inetd-style servers expect a blocking socket on stdin and stdout */
+  flags = fcntl (fd, F_GETFL);
+  if (flags >= 0)
+    fcntl (fd, F_SETFL, flags & ~O_NONBLOCK);
+
+  dup2 (fd, STDIN_FILENO);
+  dup2 (fd, STDOUT_FILENO);
+}
+
+/* Give the tube to an inetd-style server, like "sshd -i", we are then out of
+ * the data path and only wait for it to exit to close the channel. */
+static void
+spawn_inetd (Session *session)
+{
+  GSocket *socket;
+  GPid pid;
+  GError *error = NULL;
+
+  socket = g_socket_connection_get_socket (session->tube_connection);
+
+  if (!g_spawn_async (NULL, inetd_argv, NULL,
+      G_SPAWN_SEARCH_PATH | G_SPAWN_DO_NOT_REAP_CHILD,
+      inetd_child_setup, GINT_TO_POINTER (g_socket_get_fd (socket)),
+      &pid, &error))
+    {
+      session_complete (session, error);
+      g_clear_error (&error);
+      return;
+    }
+
+  session_set_running (session);
+  g_child_watch_add (pid, inetd_child_watch_cb, _session_ref (session));
+
+  /* The child has its own copy of the socket */
+  g_io_stream_close (G_IO_STREAM (session->tube_connection), NULL, NULL);
 }
 
 static void
@@ -71,51 +332,249 @@ accept_tube_cb (GObject *object,
     GAsyncResult *res,
     gpointer user_data)
 {
-  TpChannel *channel = TP_CHANNEL (object);
-  TpStreamTubeConnection *stc;
-  GInetAddress *inet_address = NULL;
-  GSocketAddress *socket_address = NULL;
-  GSocket *socket = NULL;
-  GSocketConnection *tube_connection = NULL;
-  GSocketConnection *sshd_connection = NULL;
+  Session *session = user_data;
   GError *error = NULL;
 
-  stc = tp_stream_tube_channel_accept_finish (TP_STREAM_TUBE_CHANNEL (channel),
-      res, &error);
-  if (stc == NULL)
+  session->stc = tp_stream_tube_channel_accept_finish (
+      TP_STREAM_TUBE_CHANNEL (object), res, &error);
+  if (session->state == SESSION_STATE_CLOSED)
     goto OUT;
 
-  tube_connection = tp_stream_tube_connection_get_socket_connection (stc);
+  if (session->stc == NULL)
+    {
+      check_fds_exhausted (error);
+      session_complete (session, error);
+      goto OUT;
+    }
 
-  /* Connect to the sshd */
-  inet_address = g_inet_address_new_loopback (G_SOCKET_FAMILY_IPV4);
-  socket_address = g_inet_socket_address_new (inet_address, 22);
-  socket = g_socket_new (G_SOCKET_FAMILY_IPV4, G_SOCKET_TYPE_STREAM,
-      G_SOCKET_PROTOCOL_DEFAULT, &error);
-  if (socket == NULL)
+  session->tube_connection = g_object_ref (
+      tp_stream_tube_connection_get_socket_connection (session->stc));
+  _metrics_tube_accepted (metrics);
+
+  if (inetd_argv != NULL)
+    {
+      spawn_inetd (session);
+      goto OUT;
+    }
+
+  /* Session duration and time to first byte include the backend connect */
+  session->stats = _relay_stats_new ();
+  session_connect_backend (session);
+
+OUT:
+  _session_unref (session);
+  g_clear_error (&error);
+}
+
+static void
+mux_backend_connected_cb (GObject *object,
+    GAsyncResult *res,
+    gpointer user_data)
+{
+  MuxStreamData *data = user_data;
+  GSocketConnection *sshd_connection;
+  GError *error = NULL;
+
+  sshd_connection = _backend_group_connect_finish (backends, res, &error);
+  if (sshd_connection == NULL)
+    {
+      g_debug ("Error for mux stream %u: %s", data->id, error->message);
+      check_fds_exhausted (error);
+      _mux_reject_stream (data->mux, data->id);
+      goto OUT;
+    }
+
+  _metrics_backend_connected (metrics,
+      g_get_monotonic_time () - data->connect_time);
+  _mux_attach_stream (data->mux, data->id, G_IO_STREAM (sshd_connection));
+  g_object_unref (sshd_connection);
+
+OUT:
+  _mux_unref (data->mux);
+  g_slice_free (MuxStreamData, data);
+  g_clear_error (&error);
+}
+
+static void
+mux_inetd_child_watch_cb (GPid pid,
+    gint status,
+    gpointer user_data)
+{
+  /* The stream ends when the child closes its end of the socketpair */
+  g_spawn_close_pid (pid);
+}
+
+/* Like spawn_inetd(), but the child gets one end of a socketpair since the
+ * tube itself is shared */
+static GIOStream *
+mux_spawn_inetd (GError **error)
+{
+  GSocket *socket;
+  GSocketConnection *connection = NULL;
+  gint fds[2];
+  GPid pid;
+
+  if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0)
+    {
+      gint errsv = errno;
+
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+          "Can't create socketpair: %s", g_strerror (errsv));
+      return NULL;
+    }
+
+  if (!g_spawn_async (NULL, inetd_argv, NULL,
+      G_SPAWN_SEARCH_PATH | G_SPAWN_DO_NOT_REAP_CHILD,
+      inetd_child_setup, GINT_TO_POINTER (fds[1]), &pid, error))
     goto OUT;
-  if (!g_socket_connect (socket, socket_address, NULL, &error))
+
+  g_child_watch_add (pid, mux_inetd_child_watch_cb, NULL);
+
+  socket = g_socket_new_from_fd (fds[0], error);
+  if (socket == NULL)
     goto OUT;
-  sshd_connection = g_socket_connection_factory_create_connection (socket);
+  fds[0] = -1;
 
-  /* Splice tube and ssh connections */
-  g_io_stream_splice_async (G_IO_STREAM (tube_connection),
-      G_IO_STREAM (sshd_connection), G_IO_STREAM_SPLICE_NONE,
-      G_PRIORITY_DEFAULT, NULL, splice_cb, channel);
+  connection = g_socket_connection_factory_create_connection (socket);
+  g_object_unref (socket);
 
 OUT:
+  if (fds[0] >= 0)
+    close (fds[0]);
+  close (fds[1]);
 
-  if (error != NULL)
-    session_complete (channel, error);
+  return (GIOStream *) connection;
+}
+
+static void
+mux_new_stream_cb (Mux *mux,
+    guint32 id,
+    gpointer user_data)
+{
+  MuxStreamData *data;
+
+  if (inetd_argv != NULL)
+    {
+      GIOStream *local;
+      GError *error = NULL;
+
+      local = mux_spawn_inetd (&error);
+      if (local == NULL)
+        {
+          g_debug ("Error for mux stream %u: %s", id, error->message);
+          _mux_reject_stream (mux, id);
+          g_clear_error (&error);
+          return;
+        }
+
+      _mux_attach_stream (mux, id, local);
+      g_object_unref (local);
+      return;
+    }
+
+  data = g_slice_new0 (MuxStreamData);
+  data->mux = _mux_ref (mux);
+  data->id = id;
+  data->connect_time = g_get_monotonic_time ();
+
+  _backend_group_connect_async (backends, mux_backend_connected_cb, data);
+}
+
+static void
+mux_closed_cb (Mux *mux,
+    const GError *error,
+    gpointer user_data)
+{
+  Session *session = user_data;
+
+  session_complete (session, error);
+
+  /* The mux keeps itself alive while it's calling us */
+  tp_clear_pointer (&session->mux, _mux_unref);
+  _session_unref (session);
+}
+
+static const MuxCallbacks mux_callbacks = {
+  mux_new_stream_cb,
+  NULL,
+  mux_closed_cb,
+};
+
+static void
+accept_mux_tube_cb (GObject *object,
+    GAsyncResult *res,
+    gpointer user_data)
+{
+  Session *session = user_data;
+  GError *error = NULL;
+
+  session->stc = tp_stream_tube_channel_accept_finish (
+      TP_STREAM_TUBE_CHANNEL (object), res, &error);
+  if (session->state == SESSION_STATE_CLOSED)
+    goto OUT;
 
-  tp_clear_object (&stc);
-  tp_clear_object (&inet_address);
-  tp_clear_object (&socket_address);
-  tp_clear_object (&socket);
-  tp_clear_object (&sshd_connection);
+  if (session->stc == NULL)
+    {
+      check_fds_exhausted (error);
+      session_complete (session, error);
+      goto OUT;
+    }
+
+  session->tube_connection = g_object_ref (
+      tp_stream_tube_connection_get_socket_connection (session->stc));
+  _metrics_tube_accepted (metrics);
+
+  /* Each stream the client opens gets its own sshd connection. Streams are
+   * relayed by the mux in the main thread, not by the relay engines. The mux
+   * holds a ref on the session until it's closed. */
+  session_set_running (session);
+  session->mux = _mux_new (G_IO_STREAM (session->tube_connection),
+      &mux_callbacks, _session_ref (session));
+
+OUT:
+  _session_unref (session);
   g_clear_error (&error);
 }
 
+static gboolean
+accept_backoff_cb (gpointer user_data)
+{
+  Session *session = user_data;
+
+  if (session->state != SESSION_STATE_CLOSED)
+    session_accept (session);
+
+  _session_unref (session);
+
+  return FALSE;
+}
+
+static void
+session_accept (Session *session)
+{
+  TpStreamTubeChannel *channel = TP_STREAM_TUBE_CHANNEL (session->channel);
+  guint backoff;
+
+  /* Accepting needs a socket, wait until other sessions closed some */
+  backoff = _session_table_get_backoff (sessions);
+  if (backoff > 0)
+    {
+      session->state = SESSION_STATE_PENDING;
+      g_timeout_add (backoff, accept_backoff_cb, _session_ref (session));
+      return;
+    }
+
+  session->state = SESSION_STATE_ACCEPTING;
+
+  if (!tp_strdiff (tp_stream_tube_channel_get_service (channel),
+      TUBE_SERVICE_MUX))
+    tp_stream_tube_channel_accept_async (channel, accept_mux_tube_cb,
+        _session_ref (session));
+  else
+    tp_stream_tube_channel_accept_async (channel, accept_tube_cb,
+        _session_ref (session));
+}
+
 static void
 got_channel_cb (TpSimpleHandler *handler,
     TpAccount *account,
@@ -132,19 +591,107 @@ got_channel_cb (TpSimpleHandler *handler,
     {
       if (TP_IS_STREAM_TUBE_CHANNEL (l->data))
         {
-          TpStreamTubeChannel *channel = l->data;
+          TpChannel *channel = l->data;
+          Session *session;
 
-          channel_list = g_list_prepend (channel_list, g_object_ref (channel));
+          _stats_startup_phase (stats, STATS_STARTUP_FIRST_CHANNEL);
+          session = _session_table_add (sessions, channel);
+          update_linger ();
           g_signal_connect (channel, "invalidated",
               G_CALLBACK (channel_invalidated_cb), NULL);
 
-          tp_stream_tube_channel_accept_async (channel, accept_tube_cb, NULL);
+          /* No need to accept the tube if we know sshd won't answer. That
+           * still counts as a failure in the metrics. */
+          if (backends != NULL && !_backend_group_is_available (backends))
+            {
+              GError *error = NULL;
+
+              g_set_error_literal (&error, G_IO_ERROR,
+                  G_IO_ERROR_HOST_UNREACHABLE, "All backends are down");
+              session_complete (session, error);
+              g_clear_error (&error);
+              continue;
+            }
+
+          session_accept (session);
         }
     }
 
   tp_handle_channels_context_accept (context);
 }
 
+static gboolean
+log_usage_cb (gpointer user_data)
+{
+  _buffer_pool_log_occupancy (buffer_pool);
+  _session_table_log (sessions);
+  if (backends != NULL)
+    _backend_group_log (backends);
+
+  return TRUE;
+}
+
+/* Each session needs a few file descriptors, allow as many as we may */
+static void
+raise_fd_limit (void)
+{
+  struct rlimit limit;
+
+  if (getrlimit (RLIMIT_NOFILE, &limit) < 0)
+    {
+      g_debug ("Can't get file descriptor limit: %s", g_strerror (errno));
+      return;
+    }
+
+  if (limit.rlim_cur == limit.rlim_max)
+    return;
+
+  limit.rlim_cur = limit.rlim_max;
+  if (setrlimit (RLIMIT_NOFILE, &limit) < 0)
+    {
+      g_debug ("Can't raise file descriptor limit: %s", g_strerror (errno));
+      return;
+    }
+
+  g_debug ("Raised file descriptor limit to %lu",
+      (gulong) limit.rlim_cur);
+}
+
+/* Parse CONTACT=BYTES_PER_SEC specs into rate_limits. Contact identifiers
+ * may contain '=', the rate is after the last one. */
+static gboolean
+parse_rate_limits (gchar **specs,
+    GError **error)
+{
+  guint i;
+
+  rate_limits = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+      (GDestroyNotify) _rate_limit_unref);
+
+  for (i = 0; specs != NULL && specs[i] != NULL; i++)
+    {
+      const gchar *sep = strrchr (specs[i], '=');
+      guint64 rate = 0;
+      gchar *end = NULL;
+
+      if (sep != NULL && sep != specs[i] && sep[1] != '\0')
+        rate = g_ascii_strtoull (sep + 1, &end, 10);
+
+      if (rate == 0 || *end != '\0')
+        {
+          g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+              "Invalid rate limit '%s', expected CONTACT=BYTES_PER_SEC",
+              specs[i]);
+          return FALSE;
+        }
+
+      g_hash_table_insert (rate_limits, g_strndup (specs[i], sep - specs[i]),
+          _rate_limit_new (rate));
+    }
+
+  return TRUE;
+}
+
 int
 main (gint argc, gchar *argv[])
 {
@@ -152,12 +699,191 @@ main (gint argc, gchar *argv[])
   TpSimpleClientFactory *factory = NULL;
   TpBaseClient *client = NULL;
   gboolean success = TRUE;
+  gchar *engine = NULL;
+  gint n_workers = 0;
+  gint buffer_min = RELAY_DEFAULT_BUFFER_MIN;
+  gint buffer_max = RELAY_DEFAULT_BUFFER_MAX;
+  gint64 memory_cap = DEFAULT_RELAY_MEMORY_CAP;
+  gchar **backend_specs = NULL;
+  gchar *balance_name = NULL;
+  BackendBalance balance = BACKEND_BALANCE_LEAST_CONNECTIONS;
+  gint connect_timeout = DEFAULT_CONNECT_TIMEOUT;
+  gint linger_time = DEFAULT_LINGER;
+  gchar *inetd_command = NULL;
+  gchar **rate_limit_specs = NULL;
+  gchar *metrics_path = NULL;
+  gint metrics_interval = DEFAULT_METRICS_INTERVAL;
   GError *error = NULL;
+  GOptionContext *optcontext;
+  GOptionEntry options[] = {
+      { "relay-engine", 0,
+        0, G_OPTION_ARG_STRING, &engine,
+        "How to relay data: auto, gio, splice or uring (default: auto)",
+        "ENGINE" },
+      { "relay-buffer-min", 0,
+        0, G_OPTION_ARG_INT, &buffer_min,
+        "Smallest relay buffer, used by idle and interactive sessions "
+        "(default: " G_STRINGIFY (RELAY_DEFAULT_BUFFER_MIN) ")",
+        "BYTES" },
+      { "relay-buffer-max", 0,
+        0, G_OPTION_ARG_INT, &buffer_max,
+        "Largest relay buffer, reached by bulk transfers "
+        "(default: " G_STRINGIFY (RELAY_DEFAULT_BUFFER_MAX) ")",
+        "BYTES" },
+      { "relay-memory-cap", 0,
+        0, G_OPTION_ARG_INT64, &memory_cap,
+        "Memory all relay buffers may use together, reads pause when it's "
+        "reached. 0 for no limit (default: "
+        G_STRINGIFY (DEFAULT_RELAY_MEMORY_CAP) ")",
+        "BYTES" },
+      { "rate-limit", 0,
+        0, G_OPTION_ARG_STRING_ARRAY, &rate_limit_specs,
+        "Limit what CONTACT's sessions may send and receive together, "
+        "can be given several times",
+        "CONTACT=BYTES_PER_SEC" },
+      { "backend", 0,
+        0, G_OPTION_ARG_STRING_ARRAY, &backend_specs,
+        "An sshd to relay to, as HOST[:PORT] or unix:PATH with an optional "
+        "weight, can be given several times (default: " DEFAULT_BACKEND ")",
+        "ADDRESS[=WEIGHT]" },
+      { "backend-balance", 0,
+        0, G_OPTION_ARG_STRING, &balance_name,
+        "How to spread tubes across backends: least-connections or "
+        "weighted (default: least-connections)",
+        "POLICY" },
+      { "connect-timeout", 0,
+        0, G_OPTION_ARG_INT, &connect_timeout,
+        "Seconds to wait for an sshd to accept a connection before trying "
+        "the next one, 0 to wait forever",
+        "SECONDS" },
+      { "inetd-command", 0,
+        0, G_OPTION_ARG_STRING, &inetd_command,
+        "Run COMMAND for each tube with the tube as stdin and stdout, "
+        "instead of relaying it to --backend. For example "
+        "\"/usr/sbin/sshd -i\"",
+        "COMMAND" },
+      { "linger", 0,
+        0, G_OPTION_ARG_INT, &linger_time,
+        "Seconds to keep running after the last session, 0 to exit right "
+        "away (default: " G_STRINGIFY (DEFAULT_LINGER) ")",
+        "SECONDS" },
+      { "workers", 0,
+        0, G_OPTION_ARG_INT, &n_workers,
+        "Number of relay threads, 0 to relay in the main thread (default: 0)",
+        "N" },
+      { "metrics-file", 0,
+        0, G_OPTION_ARG_FILENAME, &metrics_path,
+        "Write metrics to PATH in the Prometheus text format, for the node "
+        "exporter's textfile collector",
+        "PATH" },
+      { "metrics-interval", 0,
+        0, G_OPTION_ARG_INT, &metrics_interval,
+        "Seconds between writes of --metrics-file (default: "
+        G_STRINGIFY (DEFAULT_METRICS_INTERVAL) ")",
+        "SECONDS" },
+      { NULL }
+  };
 
   g_type_init ();
 
+  /* Startup times are counted from here */
+  stats = _stats_new ();
+
+  optcontext = g_option_context_new (NULL);
+  g_option_context_add_main_entries (optcontext, options, NULL);
+  if (!g_option_context_parse (optcontext, &argc, &argv, &error))
+    goto OUT;
+
+  if (engine != NULL && !_relay_engine_from_string (engine, &relay_engine))
+    {
+      error = g_error_new (G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+          "Unknown relay engine '%s'", engine);
+      goto OUT;
+    }
+
+  if (buffer_min <= 0 || buffer_max < buffer_min)
+    {
+      error = g_error_new (G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+          "Invalid relay buffer sizes: %d to %d", buffer_min, buffer_max);
+      goto OUT;
+    }
+  _relay_set_buffer_size (buffer_min, buffer_max);
+
+  /* A single session must always be able to get its two buffers */
+  if (memory_cap < 0 || (memory_cap > 0 && memory_cap < 2 * buffer_min))
+    {
+      error = g_error_new (G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+          "Invalid relay memory cap: %" G_GINT64_FORMAT ", it must be at "
+          "least twice --relay-buffer-min", memory_cap);
+      goto OUT;
+    }
+  buffer_pool = _buffer_pool_new (memory_cap);
+  _relay_set_buffer_pool (buffer_pool);
+
+  if (!parse_rate_limits (rate_limit_specs, &error))
+    goto OUT;
+
+  if (n_workers < 0)
+    {
+      error = g_error_new (G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+          "Invalid number of workers: %d", n_workers);
+      goto OUT;
+    }
+  worker_pool = _worker_pool_new (n_workers);
+
+  if (linger_time < 0)
+    {
+      error = g_error_new (G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+          "Invalid linger time: %d", linger_time);
+      goto OUT;
+    }
+  linger = linger_time;
+
+  if (metrics_interval <= 0)
+    {
+      error = g_error_new (G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+          "Invalid metrics interval: %d", metrics_interval);
+      goto OUT;
+    }
+
+  if (connect_timeout < 0)
+    {
+      error = g_error_new (G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+          "Invalid connect timeout: %d", connect_timeout);
+      goto OUT;
+    }
+
+  if (inetd_command != NULL)
+    {
+      if (!g_shell_parse_argv (inetd_command, NULL, &inetd_argv, &error))
+        goto OUT;
+    }
+  else
+    {
+      gchar *default_specs[] = { DEFAULT_BACKEND, NULL };
+
+      if (balance_name != NULL &&
+          !_backend_balance_from_string (balance_name, &balance))
+        {
+          error = g_error_new (G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+              "Unknown backend balance policy '%s'", balance_name);
+          goto OUT;
+        }
+
+      backends = _backend_group_new (backend_specs != NULL ? backend_specs :
+          default_specs, balance, connect_timeout, &error);
+      if (backends == NULL)
+        goto OUT;
+    }
+
   tp_debug_set_flags (g_getenv ("SSH_CONTACT_DEBUG"));
 
+  raise_fd_limit ();
+  sessions = _session_table_new ();
+  metrics = _metrics_new (stats, sessions, backends);
+  if (metrics_path != NULL)
+    _metrics_write_file (metrics, metrics_path, metrics_interval);
+
   dbus = tp_dbus_daemon_dup (&error);
   if (dbus == NULL)
     goto OUT;
@@ -177,10 +903,31 @@ main (gint argc, gchar *argv[])
         FALSE,
       NULL));
 
+  tp_base_client_take_handler_filter (client, tp_asv_new (
+      TP_PROP_CHANNEL_CHANNEL_TYPE, G_TYPE_STRING,
+        TP_IFACE_CHANNEL_TYPE_STREAM_TUBE,
+      TP_PROP_CHANNEL_TARGET_HANDLE_TYPE, G_TYPE_UINT,
+        TP_HANDLE_TYPE_CONTACT,
+      TP_PROP_CHANNEL_TYPE_STREAM_TUBE_SERVICE, G_TYPE_STRING,
+        TUBE_SERVICE_MUX,
+      TP_PROP_CHANNEL_REQUESTED, G_TYPE_BOOLEAN,
+        FALSE,
+      NULL));
+
   if (!tp_base_client_register (client, &error))
     goto OUT;
 
+  _stats_startup_phase (stats, STATS_STARTUP_READY);
+  _stats_export (stats);
+
+  g_timeout_add_seconds (USAGE_LOG_INTERVAL, log_usage_cb, NULL);
+
   loop = g_main_loop_new (NULL, FALSE);
+
+  /* Don't stay forever if the channel we were activated for never comes */
+  if (linger > 0)
+    update_linger ();
+
   g_main_loop_run (loop);
 
 OUT:
@@ -191,11 +938,28 @@ OUT:
       success = FALSE;
     }
 
+  if (linger_id != 0)
+    g_source_remove (linger_id);
+  tp_clear_pointer (&metrics, _metrics_free);
+  tp_clear_pointer (&sessions, _session_table_free);
+  tp_clear_pointer (&worker_pool, _worker_pool_free);
+  tp_clear_pointer (&buffer_pool, _buffer_pool_free);
+  tp_clear_pointer (&rate_limits, g_hash_table_unref);
+  tp_clear_pointer (&backends, _backend_group_free);
+  tp_clear_pointer (&stats, _stats_free);
   tp_clear_pointer (&loop, g_main_loop_unref);
+  tp_clear_pointer (&optcontext, g_option_context_free);
   tp_clear_object (&dbus);
   tp_clear_object (&factory);
   tp_clear_object (&client);
   g_clear_error (&error);
+  g_free (engine);
+  g_strfreev (backend_specs);
+  g_free (balance_name);
+  g_free (inetd_command);
+  g_strfreev (rate_limit_specs);
+  g_free (metrics_path);
+  tp_clear_pointer (&inetd_argv, g_strfreev);
 
   return success ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -0,0 +1,216 @@
+/*
+ * Copyright (C) 2010 Xavier Claessens <xclaesse@gmail.com>
+ * Copyright (C) 2010 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include "session-table.h"
+
+/* Delay before opening new sockets once we ran out of file descriptors, it
+ * doubles while that keeps happening */
+#define BACKOFF_MIN_MS 100
+#define BACKOFF_MAX_MS 5000
+
+struct _SessionTable
+{
+  /* TpChannel -> owned Session */
+  GHashTable *sessions;
+
+  guint peak;
+  guint64 total;
+
+  guint backoff;
+  gint64 backoff_until;
+};
+
+Session *
+_session_ref (Session *session)
+{
+  session->ref_count++;
+
+  return session;
+}
+
+void
+_session_unref (Session *session)
+{
+  g_assert (session->ref_count > 0);
+
+  session->ref_count--;
+  if (session->ref_count > 0)
+    return;
+
+  /* Relays and the mux hold refs, they are over by now */
+  g_assert (session->mux == NULL);
+
+  if (session->sshd_connection != NULL)
+    g_io_stream_close (G_IO_STREAM (session->sshd_connection), NULL, NULL);
+  if (session->tube_connection != NULL)
+    g_io_stream_close (G_IO_STREAM (session->tube_connection), NULL, NULL);
+
+  tp_clear_object (&session->sshd_connection);
+  tp_clear_object (&session->tube_connection);
+  tp_clear_object (&session->stc);
+  tp_clear_object (&session->cancellable);
+  tp_clear_object (&session->channel);
+  tp_clear_pointer (&session->stats, _relay_stats_free);
+
+  g_slice_free (Session, session);
+}
+
+SessionTable *
+_session_table_new (void)
+{
+  SessionTable *table;
+
+  table = g_slice_new0 (SessionTable);
+  table->sessions = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+      NULL, (GDestroyNotify) _session_unref);
+
+  return table;
+}
+
+void
+_session_table_free (SessionTable *table)
+{
+  GList *channels;
+  GList *l;
+
+  /* Removing cancels relays and closes muxes */
+  channels = g_hash_table_get_keys (table->sessions);
+  for (l = channels; l != NULL; l = l->next)
+    _session_table_remove (table, l->data);
+  g_list_free (channels);
+
+  g_hash_table_unref (table->sessions);
+  g_slice_free (SessionTable, table);
+}
+
+/* Returns the new session, owned by @table */
+Session *
+_session_table_add (SessionTable *table,
+    TpChannel *channel)
+{
+  Session *session;
+
+  g_return_val_if_fail (!g_hash_table_lookup (table->sessions, channel),
+      NULL);
+
+  session = g_slice_new0 (Session);
+  session->ref_count = 1;
+  session->channel = g_object_ref (channel);
+  session->state = SESSION_STATE_PENDING;
+  session->cancellable = g_cancellable_new ();
+  session->start_time = g_get_monotonic_time ();
+
+  g_hash_table_insert (table->sessions, channel, session);
+
+  table->total++;
+  table->peak = MAX (table->peak, g_hash_table_size (table->sessions));
+
+  return session;
+}
+
+Session *
+_session_table_lookup (SessionTable *table,
+    TpChannel *channel)
+{
+  return g_hash_table_lookup (table->sessions, channel);
+}
+
+/* Forget the session of @channel, its pending operations are cancelled and
+ * its connections closed once they returned */
+void
+_session_table_remove (SessionTable *table,
+    TpChannel *channel)
+{
+  Session *session;
+
+  session = g_hash_table_lookup (table->sessions, channel);
+  if (session == NULL)
+    return;
+
+  /* Keep the table's ref until we're done */
+  g_hash_table_steal (table->sessions, channel);
+
+  session->state = SESSION_STATE_CLOSED;
+  g_cancellable_cancel (session->cancellable);
+
+  /* The closed callback drops the mux */
+  if (session->mux != NULL)
+    _mux_close (session->mux);
+
+  _session_unref (session);
+}
+
+guint
+_session_table_get_size (SessionTable *table)
+{
+  return g_hash_table_size (table->sessions);
+}
+
+void
+_session_table_log (SessionTable *table)
+{
+  g_debug ("Sessions: %u open, peak %u, %" G_GUINT64_FORMAT " since start",
+      g_hash_table_size (table->sessions), table->peak, table->total);
+}
+
+/* Opening a socket failed with EMFILE or ENFILE, new sockets wait a bit */
+void
+_session_table_fds_exhausted (SessionTable *table)
+{
+  gint64 now = g_get_monotonic_time ();
+
+  /* Failures of the same burst don't make it longer */
+  if (now < table->backoff_until)
+    return;
+
+  table->backoff = table->backoff == 0 ? BACKOFF_MIN_MS :
+      MIN (table->backoff * 2, BACKOFF_MAX_MS);
+  table->backoff_until = now + table->backoff * 1000;
+
+  g_debug ("Out of file descriptors with %u sessions, backing off %u ms",
+      g_hash_table_size (table->sessions), table->backoff);
+}
+
+/* Opening a socket worked, stop backing off */
+void
+_session_table_fds_available (SessionTable *table)
+{
+  if (table->backoff == 0 || g_get_monotonic_time () < table->backoff_until)
+    return;
+
+  g_debug ("File descriptors available again");
+  table->backoff = 0;
+  table->backoff_until = 0;
+}
+
+/* Returns how many milliseconds to wait before opening sockets, 0 when it's
+ * fine to do it now */
+guint
+_session_table_get_backoff (SessionTable *table)
+{
+  gint64 remaining = table->backoff_until - g_get_monotonic_time ();
+
+  if (remaining <= 0)
+    return 0;
+
+  return (remaining + 999) / 1000;
+}
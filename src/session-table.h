@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2010 Xavier Claessens <xclaesse@gmail.com>
+ * Copyright (C) 2010 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA  02110-1301  USA
+ */
+
+#ifndef __SESSION_TABLE_H__
+#define __SESSION_TABLE_H__
+
+#include <gio/gio.h>
+#include <telepathy-glib/telepathy-glib.h>
+
+#include "mux.h"
+#include "relay.h"
+
+G_BEGIN_DECLS
+
+typedef struct _SessionTable SessionTable;
+
+typedef enum
+{
+  /* Waiting for file descriptors to be available before accepting */
+  SESSION_STATE_PENDING,
+  SESSION_STATE_ACCEPTING,
+  /* Connecting to the backend */
+  SESSION_STATE_CONNECTING,
+  /* Relayed, carrying mux streams, or handed to an inetd-style server */
+  SESSION_STATE_RUNNING,
+  /* Being closed, or removed from the table */
+  SESSION_STATE_CLOSED,
+} SessionState;
+
+/* Everything the service knows about one tube. Pending operations hold a ref
+ * so they can check the state once they return. */
+typedef struct
+{
+  TpChannel *channel;
+  SessionState state;
+
+  TpStreamTubeConnection *stc;
+  GSocketConnection *tube_connection;
+  GSocketConnection *sshd_connection;
+  Mux *mux;
+  /* Cancelled once the session is removed, to stop its relay */
+  GCancellable *cancellable;
+
+  RelayStats *stats;
+  gint64 start_time;
+  guint connect_attempts;
+  /* When the last backend connection attempt started */
+  gint64 connect_time;
+
+  /* private */
+  guint ref_count;
+} Session;
+
+Session *_session_ref (Session *session);
+
+void _session_unref (Session *session);
+
+SessionTable *_session_table_new (void);
+
+void _session_table_free (SessionTable *table);
+
+Session *_session_table_add (SessionTable *table, TpChannel *channel);
+
+Session *_session_table_lookup (SessionTable *table, TpChannel *channel);
+
+void _session_table_remove (SessionTable *table, TpChannel *channel);
+
+guint _session_table_get_size (SessionTable *table);
+
+void _session_table_log (SessionTable *table);
+
+void _session_table_fds_exhausted (SessionTable *table);
+
+void _session_table_fds_available (SessionTable *table);
+
+guint _session_table_get_backoff (SessionTable *table);
+
+G_END_DECLS
+
+#endif /* #ifndef __SESSION_TABLE_H__*/
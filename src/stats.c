@@ -0,0 +1,389 @@
+/*
+ * Copyright (C) 2010 Xavier Claessens <xclaesse@gmail.com>
+ * Copyright (C) 2010 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "stats.h"
+
+static const gchar introspection_xml[] =
+  "<node>"
+  "  <interface name='" STATS_INTERFACE "'>"
+  "    <method name='GetSessions'>"
+  "      <arg type='a{oa{sv}}' name='Sessions' direction='out'/>"
+  "    </method>"
+  "    <method name='GetLatencyHistogram'>"
+  "      <arg type='at' name='Buckets' direction='out'/>"
+  "    </method>"
+  "    <method name='GetStartupTimes'>"
+  "      <arg type='a{sv}' name='Times' direction='out'/>"
+  "    </method>"
+  "  </interface>"
+  "</node>";
+
+typedef struct
+{
+  gchar *contact_id;
+  /* Owned by the session, it outlives us */
+  RelayStats *relay_stats;
+} Session;
+
+static const gchar *startup_phase_names[] = {
+  "Ready",
+  "FirstChannel",
+  "FirstSession",
+};
+
+struct _Stats
+{
+  /* Session id -> Session */
+  GHashTable *sessions;
+  /* Latency and bytes of sessions that are over */
+  guint64 latency[RELAY_LATENCY_BUCKETS];
+  guint64 bytes[2];
+
+  /* When we were created, and reached each phase, 0 if not yet */
+  gint64 start_time;
+  gint64 startup[STATS_STARTUP_N_PHASES];
+
+  guint owner_id;
+  GDBusConnection *connection;
+  guint registration_id;
+};
+
+static void
+session_free (Session *session)
+{
+  g_free (session->contact_id);
+  g_slice_free (Session, session);
+}
+
+static GVariant *
+session_to_variant (Session *session)
+{
+  RelayStats snapshot;
+  GVariantBuilder builder;
+  GVariantBuilder latency;
+  gint64 end_time;
+  guint i;
+
+  _relay_stats_snapshot (session->relay_stats, &snapshot);
+
+  end_time = snapshot.end_time != 0 ? snapshot.end_time :
+      g_get_monotonic_time ();
+
+  g_variant_builder_init (&latency, G_VARIANT_TYPE ("at"));
+  for (i = 0; i < RELAY_LATENCY_BUCKETS; i++)
+    g_variant_builder_add (&latency, "t", snapshot.latency[i]);
+
+  /* Forward is tube to backend, see service.c */
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
+  g_variant_builder_add (&builder, "{sv}", "Contact",
+      g_variant_new_string (session->contact_id));
+  g_variant_builder_add (&builder, "{sv}", "Duration",
+      g_variant_new_uint64 (end_time - snapshot.start_time));
+  g_variant_builder_add (&builder, "{sv}", "TimeToFirstByte",
+      g_variant_new_int64 (snapshot.first_byte_time != 0 ?
+          snapshot.first_byte_time - snapshot.start_time : -1));
+  g_variant_builder_add (&builder, "{sv}", "BytesFromTube",
+      g_variant_new_uint64 (snapshot.bytes[RELAY_DIRECTION_FORWARD]));
+  g_variant_builder_add (&builder, "{sv}", "BytesFromBackend",
+      g_variant_new_uint64 (snapshot.bytes[RELAY_DIRECTION_BACKWARD]));
+  g_variant_builder_add (&builder, "{sv}", "TubeReads",
+      g_variant_new_uint64 (snapshot.n_reads[RELAY_DIRECTION_FORWARD]));
+  g_variant_builder_add (&builder, "{sv}", "TubeWrites",
+      g_variant_new_uint64 (snapshot.n_writes[RELAY_DIRECTION_BACKWARD]));
+  g_variant_builder_add (&builder, "{sv}", "BackendReads",
+      g_variant_new_uint64 (snapshot.n_reads[RELAY_DIRECTION_BACKWARD]));
+  g_variant_builder_add (&builder, "{sv}", "BackendWrites",
+      g_variant_new_uint64 (snapshot.n_writes[RELAY_DIRECTION_FORWARD]));
+  g_variant_builder_add (&builder, "{sv}", "Latency",
+      g_variant_builder_end (&latency));
+  g_variant_builder_add (&builder, "{sv}", "TubeMode",
+      g_variant_new_string (_relay_mode_to_string (
+          snapshot.mode[RELAY_DIRECTION_FORWARD])));
+  g_variant_builder_add (&builder, "{sv}", "BackendMode",
+      g_variant_new_string (_relay_mode_to_string (
+          snapshot.mode[RELAY_DIRECTION_BACKWARD])));
+
+  return g_variant_builder_end (&builder);
+}
+
+static GVariant *
+stats_get_sessions (Stats *stats)
+{
+  GVariantBuilder builder;
+  GHashTableIter iter;
+  gpointer key;
+  gpointer value;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{oa{sv}}"));
+  g_hash_table_iter_init (&iter, stats->sessions);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      g_variant_builder_add (&builder, "{o@a{sv}}", key,
+          session_to_variant (value));
+    }
+
+  return g_variant_new ("(@a{oa{sv}})", g_variant_builder_end (&builder));
+}
+
+/* Sessions that are over, and the ones still running */
+static GVariant *
+stats_get_latency_histogram (Stats *stats)
+{
+  GVariantBuilder builder;
+  GHashTableIter iter;
+  gpointer value;
+  guint64 latency[RELAY_LATENCY_BUCKETS];
+  guint i;
+
+  memcpy (latency, stats->latency, sizeof (latency));
+
+  g_hash_table_iter_init (&iter, stats->sessions);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      Session *session = value;
+      RelayStats snapshot;
+
+      _relay_stats_snapshot (session->relay_stats, &snapshot);
+      for (i = 0; i < RELAY_LATENCY_BUCKETS; i++)
+        latency[i] += snapshot.latency[i];
+    }
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("at"));
+  for (i = 0; i < RELAY_LATENCY_BUCKETS; i++)
+    g_variant_builder_add (&builder, "t", latency[i]);
+
+  return g_variant_new ("(@at)", g_variant_builder_end (&builder));
+}
+
+/* Microseconds from start to each phase, -1 for those not reached yet */
+static GVariant *
+stats_get_startup_times (Stats *stats)
+{
+  GVariantBuilder builder;
+  guint i;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
+  for (i = 0; i < STATS_STARTUP_N_PHASES; i++)
+    {
+      g_variant_builder_add (&builder, "{sv}", startup_phase_names[i],
+          g_variant_new_int64 (stats->startup[i] != 0 ?
+              stats->startup[i] - stats->start_time : -1));
+    }
+  g_variant_builder_add (&builder, "{sv}", "Uptime",
+      g_variant_new_uint64 (g_get_monotonic_time () - stats->start_time));
+
+  return g_variant_new ("(@a{sv})", g_variant_builder_end (&builder));
+}
+
+static void
+method_call_cb (GDBusConnection *connection,
+    const gchar *sender,
+    const gchar *object_path,
+    const gchar *interface_name,
+    const gchar *method_name,
+    GVariant *parameters,
+    GDBusMethodInvocation *invocation,
+    gpointer user_data)
+{
+  Stats *stats = user_data;
+
+  if (!g_strcmp0 (method_name, "GetSessions"))
+    {
+      g_dbus_method_invocation_return_value (invocation,
+          stats_get_sessions (stats));
+    }
+  else if (!g_strcmp0 (method_name, "GetLatencyHistogram"))
+    {
+      g_dbus_method_invocation_return_value (invocation,
+          stats_get_latency_histogram (stats));
+    }
+  else if (!g_strcmp0 (method_name, "GetStartupTimes"))
+    {
+      g_dbus_method_invocation_return_value (invocation,
+          stats_get_startup_times (stats));
+    }
+  else
+    {
+      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
+          G_DBUS_ERROR_UNKNOWN_METHOD, "Unknown method %s", method_name);
+    }
+}
+
+static const GDBusInterfaceVTable interface_vtable = {
+  method_call_cb,
+  NULL,
+  NULL,
+};
+
+static void
+bus_acquired_cb (GDBusConnection *connection,
+    const gchar *name,
+    gpointer user_data)
+{
+  Stats *stats = user_data;
+  GDBusNodeInfo *info;
+  GError *error = NULL;
+
+  info = g_dbus_node_info_new_for_xml (introspection_xml, NULL);
+  g_assert (info != NULL);
+
+  stats->registration_id = g_dbus_connection_register_object (connection,
+      STATS_OBJECT_PATH, info->interfaces[0], &interface_vtable, stats, NULL,
+      &error);
+  if (stats->registration_id == 0)
+    {
+      g_debug ("Can't export stats: %s", error->message);
+      g_clear_error (&error);
+    }
+  else
+    {
+      stats->connection = g_object_ref (connection);
+    }
+
+  g_dbus_node_info_unref (info);
+}
+
+static void
+name_lost_cb (GDBusConnection *connection,
+    const gchar *name,
+    gpointer user_data)
+{
+  g_debug ("Can't own %s, another service has it", name);
+}
+
+/* Startup times are counted from here, create it first thing */
+Stats *
+_stats_new (void)
+{
+  Stats *stats;
+
+  stats = g_slice_new0 (Stats);
+  stats->start_time = g_get_monotonic_time ();
+  stats->sessions = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+      (GDestroyNotify) session_free);
+
+  return stats;
+}
+
+void
+_stats_free (Stats *stats)
+{
+  if (stats->owner_id != 0)
+    g_bus_unown_name (stats->owner_id);
+
+  if (stats->registration_id != 0)
+    g_dbus_connection_unregister_object (stats->connection,
+        stats->registration_id);
+
+  g_clear_object (&stats->connection);
+  g_hash_table_unref (stats->sessions);
+
+  g_slice_free (Stats, stats);
+}
+
+void
+_stats_export (Stats *stats)
+{
+  g_return_if_fail (stats->owner_id == 0);
+
+  stats->owner_id = g_bus_own_name (G_BUS_TYPE_SESSION, STATS_BUS_NAME,
+      G_BUS_NAME_OWNER_FLAGS_NONE, bus_acquired_cb, NULL, name_lost_cb,
+      stats, NULL);
+}
+
+void
+_stats_add_session (Stats *stats,
+    const gchar *id,
+    const gchar *contact_id,
+    RelayStats *relay_stats)
+{
+  Session *session;
+
+  session = g_slice_new0 (Session);
+  session->contact_id = g_strdup (contact_id);
+  session->relay_stats = relay_stats;
+
+  g_hash_table_insert (stats->sessions, g_strdup (id), session);
+}
+
+void
+_stats_remove_session (Stats *stats,
+    const gchar *id)
+{
+  Session *session;
+  RelayStats snapshot;
+  guint i;
+
+  session = g_hash_table_lookup (stats->sessions, id);
+  if (session == NULL)
+    return;
+
+  _relay_stats_snapshot (session->relay_stats, &snapshot);
+  for (i = 0; i < RELAY_LATENCY_BUCKETS; i++)
+    stats->latency[i] += snapshot.latency[i];
+  for (i = 0; i < G_N_ELEMENTS (stats->bytes); i++)
+    stats->bytes[i] += snapshot.bytes[i];
+
+  g_hash_table_remove (stats->sessions, id);
+}
+
+/* Only the first time counts */
+void
+_stats_startup_phase (Stats *stats,
+    StatsStartupPhase phase)
+{
+  g_return_if_fail (phase < STATS_STARTUP_N_PHASES);
+
+  if (stats->startup[phase] != 0)
+    return;
+
+  stats->startup[phase] = g_get_monotonic_time ();
+  g_debug ("Startup: %s after %" G_GINT64_FORMAT " ms",
+      startup_phase_names[phase],
+      (stats->startup[phase] - stats->start_time) / 1000);
+}
+
+/* Bytes relayed in each RelayDirection since we started, by sessions that
+ * are over and the ones still running */
+void
+_stats_get_bytes (Stats *stats,
+    guint64 *bytes)
+{
+  GHashTableIter iter;
+  gpointer value;
+  guint i;
+
+  memcpy (bytes, stats->bytes, sizeof (stats->bytes));
+
+  g_hash_table_iter_init (&iter, stats->sessions);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      Session *session = value;
+      RelayStats snapshot;
+
+      _relay_stats_snapshot (session->relay_stats, &snapshot);
+      for (i = 0; i < G_N_ELEMENTS (stats->bytes); i++)
+        bytes[i] += snapshot.bytes[i];
+    }
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2010 Xavier Claessens <xclaesse@gmail.com>
+ * Copyright (C) 2010 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA  02110-1301  USA
+ */
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <gio/gio.h>
+
+#include "relay.h"
+
+G_BEGIN_DECLS
+
+/* Published on the session bus so operators can look at running sessions */
+#define STATS_BUS_NAME "uk.co.collabora.SSHContact"
+#define STATS_OBJECT_PATH "/uk/co/collabora/SSHContact"
+#define STATS_INTERFACE "uk.co.collabora.SSHContact.Stats"
+
+typedef struct _Stats Stats;
+
+/* Milestones after the service started, to track what a cold start costs to
+ * the first connection */
+typedef enum
+{
+  /* Registered as a Telepathy handler */
+  STATS_STARTUP_READY,
+  /* Got its first channel */
+  STATS_STARTUP_FIRST_CHANNEL,
+  /* Its first session is connected to the backend */
+  STATS_STARTUP_FIRST_SESSION,
+  STATS_STARTUP_N_PHASES,
+} StatsStartupPhase;
+
+Stats *_stats_new (void);
+
+void _stats_free (Stats *stats);
+
+void _stats_export (Stats *stats);
+
+void _stats_add_session (Stats *stats, const gchar *id,
+    const gchar *contact_id, RelayStats *relay_stats);
+
+void _stats_remove_session (Stats *stats, const gchar *id);
+
+void _stats_startup_phase (Stats *stats, StatsStartupPhase phase);
+
+void _stats_get_bytes (Stats *stats, guint64 *bytes);
+
+G_END_DECLS
+
+#endif /* #ifndef __STATS_H__*/
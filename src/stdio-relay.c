@@ -0,0 +1,346 @@
+/*
+ * Copyright (C) 2010 Xavier Claessens <xclaesse@gmail.com>
+ * Copyright (C) 2010 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <gio/gunixinputstream.h>
+#include <gio/gunixoutputstream.h>
+
+#include "stdio-relay.h"
+
+/* Relay a tube to our stdin and stdout, for ssh's ProxyCommand. ssh gives us
+ * pipes, data is then spliced between them and the tube without being copied
+ * to userspace. Anything else goes through GIO. Like the relay engines, the
+ * first EOF ends the relay. */
+
+/* Bytes moved by one splice(2), and splices in a row before yielding to the
+ * other direction */
+#define STDIO_SPLICE_SIZE (64 * 1024)
+#define STDIO_SPLICE_ROUNDS 16
+
+typedef struct _StdioRelay StdioRelay;
+
+/* One direction, between a pipe and the tube's socket */
+typedef struct
+{
+  StdioRelay *relay;
+  gint in_fd;
+  gint out_fd;
+  GSource *source;
+} SplicePump;
+
+struct _StdioRelay
+{
+  GSimpleAsyncResult *simple;
+  GSocketConnection *tube;
+  /* Cancelled once the relay is over, to stop pending GIO operations */
+  GCancellable *cancellable;
+  GSource *cancel_source;
+  SplicePump pumps[2];
+  gboolean completed;
+};
+
+static void
+clear_source (GSource **source)
+{
+  if (*source == NULL)
+    return;
+
+  g_source_destroy (*source);
+  g_source_unref (*source);
+  *source = NULL;
+}
+
+static void
+stdio_relay_free (StdioRelay *relay)
+{
+  guint i;
+
+  clear_source (&relay->cancel_source);
+  for (i = 0; i < G_N_ELEMENTS (relay->pumps); i++)
+    clear_source (&relay->pumps[i].source);
+
+  g_object_unref (relay->tube);
+  g_object_unref (relay->cancellable);
+
+  g_slice_free (StdioRelay, relay);
+}
+
+static void
+stdio_relay_complete (StdioRelay *relay,
+    const GError *error)
+{
+  GSimpleAsyncResult *simple = relay->simple;
+  guint i;
+
+  if (relay->completed)
+    return;
+
+  relay->completed = TRUE;
+  clear_source (&relay->cancel_source);
+  for (i = 0; i < G_N_ELEMENTS (relay->pumps); i++)
+    clear_source (&relay->pumps[i].source);
+  g_cancellable_cancel (relay->cancellable);
+
+  if (error != NULL)
+    g_simple_async_result_set_from_error (simple, error);
+
+  /* This drops the ref taken in _stdio_relay_async(), @relay could be
+   * freed */
+  g_simple_async_result_complete (simple);
+  g_object_unref (simple);
+}
+
+static gboolean
+stdio_relay_cancelled_cb (GCancellable *cancellable,
+    gpointer user_data)
+{
+  StdioRelay *relay = user_data;
+  GError *error = NULL;
+
+  g_cancellable_set_error_if_cancelled (cancellable, &error);
+  stdio_relay_complete (relay, error);
+  g_clear_error (&error);
+
+  return FALSE;
+}
+
+/* Pending operations hold a ref on relay->simple */
+static void
+gio_splice_cb (GObject *source_object,
+    GAsyncResult *res,
+    gpointer user_data)
+{
+  StdioRelay *relay = user_data;
+  GSimpleAsyncResult *simple = relay->simple;
+  GError *error = NULL;
+
+  g_output_stream_splice_finish (G_OUTPUT_STREAM (source_object), res,
+      &error);
+  stdio_relay_complete (relay, error);
+
+  g_clear_error (&error);
+  g_object_unref (simple);
+}
+
+static void
+gio_splice_start (StdioRelay *relay,
+    GInputStream *input,
+    GOutputStream *output)
+{
+  g_object_ref (relay->simple);
+  g_output_stream_splice_async (output, input,
+      G_OUTPUT_STREAM_SPLICE_NONE, G_PRIORITY_DEFAULT, relay->cancellable,
+      gio_splice_cb, relay);
+}
+
+#ifdef HAVE_SPLICE
+
+static void splice_pump_run (SplicePump *pump);
+
+static gboolean
+splice_pump_ready_cb (GIOChannel *channel,
+    GIOCondition condition,
+    gpointer user_data)
+{
+  SplicePump *pump = user_data;
+
+  g_source_unref (pump->source);
+  pump->source = NULL;
+
+  splice_pump_run (pump);
+
+  return FALSE;
+}
+
+static void
+splice_pump_wait (SplicePump *pump)
+{
+  struct pollfd fds[] = {
+      { pump->in_fd, POLLIN, 0 },
+      { pump->out_fd, POLLOUT, 0 },
+  };
+  GIOChannel *channel;
+  GIOCondition condition;
+
+  /* splice() doesn't tell which side would block, wait for the one that's
+   * not ready. If both are, that's only a yield. */
+  poll (fds, G_N_ELEMENTS (fds), 0);
+  if (fds[0].revents == 0 || fds[1].revents != 0)
+    {
+      channel = g_io_channel_unix_new (pump->in_fd);
+      condition = G_IO_IN;
+    }
+  else
+    {
+      channel = g_io_channel_unix_new (pump->out_fd);
+      condition = G_IO_OUT;
+    }
+
+  pump->source = g_io_create_watch (channel,
+      condition | G_IO_HUP | G_IO_ERR);
+  g_source_set_callback (pump->source, (GSourceFunc) splice_pump_ready_cb,
+      pump, NULL);
+  g_source_attach (pump->source, g_main_context_get_thread_default ());
+  g_io_channel_unref (channel);
+}
+
+static void
+splice_pump_run (SplicePump *pump)
+{
+  gssize n;
+  guint i;
+
+  for (i = 0; i < STDIO_SPLICE_ROUNDS; i++)
+    {
+      n = splice (pump->in_fd, NULL, pump->out_fd, NULL, STDIO_SPLICE_SIZE,
+          SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n == 0)
+        {
+          stdio_relay_complete (pump->relay, NULL);
+          return;
+        }
+      if (n < 0)
+        {
+          GError *error;
+          gint errsv = errno;
+
+          if (errsv == EINTR)
+            continue;
+          if (errsv == EAGAIN)
+            break;
+
+          error = g_error_new_literal (G_IO_ERROR,
+              g_io_error_from_errno (errsv), g_strerror (errsv));
+          stdio_relay_complete (pump->relay, error);
+          g_error_free (error);
+          return;
+        }
+    }
+
+  splice_pump_wait (pump);
+}
+
+#endif /* HAVE_SPLICE */
+
+/* splice(2) needs one end to be a pipe */
+static gboolean
+fd_can_splice (gint fd)
+{
+#ifdef HAVE_SPLICE
+  struct stat st;
+
+  return fstat (fd, &st) == 0 && S_ISFIFO (st.st_mode);
+#else
+  return FALSE;
+#endif
+}
+
+/* Start one direction, spliced when @stdio_fd is a pipe */
+static void
+stdio_relay_start (StdioRelay *relay,
+    SplicePump *pump,
+    gint stdio_fd,
+    gboolean from_stdio)
+{
+  GIOStream *tube = G_IO_STREAM (relay->tube);
+  GSocket *socket = g_socket_connection_get_socket (relay->tube);
+  GInputStream *input;
+  GOutputStream *output;
+
+  if (fd_can_splice (stdio_fd))
+    {
+#ifdef HAVE_SPLICE
+      pump->relay = relay;
+      pump->in_fd = from_stdio ? stdio_fd : g_socket_get_fd (socket);
+      pump->out_fd = from_stdio ? g_socket_get_fd (socket) : stdio_fd;
+
+      /* Wait instead of splicing right away, so we never complete from
+       * within _stdio_relay_async() */
+      splice_pump_wait (pump);
+      return;
+#endif
+    }
+
+  g_debug ("%s is not a pipe, relaying it with GIO",
+      from_stdio ? "stdin" : "stdout");
+
+  if (from_stdio)
+    {
+      input = g_unix_input_stream_new (stdio_fd, FALSE);
+      gio_splice_start (relay, input, g_io_stream_get_output_stream (tube));
+      g_object_unref (input);
+    }
+  else
+    {
+      output = g_unix_output_stream_new (stdio_fd, FALSE);
+      gio_splice_start (relay, g_io_stream_get_input_stream (tube), output);
+      g_object_unref (output);
+    }
+}
+
+void
+_stdio_relay_async (GSocketConnection *tube,
+    GCancellable *cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data)
+{
+  GSimpleAsyncResult *simple;
+  StdioRelay *relay;
+
+  simple = g_simple_async_result_new (NULL, callback, user_data,
+      _stdio_relay_async);
+
+  relay = g_slice_new0 (StdioRelay);
+  relay->simple = simple;
+  relay->tube = g_object_ref (tube);
+  relay->cancellable = g_cancellable_new ();
+  g_simple_async_result_set_op_res_gpointer (simple, relay,
+      (GDestroyNotify) stdio_relay_free);
+
+  if (cancellable != NULL)
+    {
+      relay->cancel_source = g_cancellable_source_new (cancellable);
+      g_source_set_callback (relay->cancel_source,
+          (GSourceFunc) stdio_relay_cancelled_cb, relay, NULL);
+      g_source_attach (relay->cancel_source,
+          g_main_context_get_thread_default ());
+    }
+
+  stdio_relay_start (relay, &relay->pumps[0], STDIN_FILENO, TRUE);
+  stdio_relay_start (relay, &relay->pumps[1], STDOUT_FILENO, FALSE);
+}
+
+gboolean
+_stdio_relay_finish (GAsyncResult *res,
+    GError **error)
+{
+  g_return_val_if_fail (g_simple_async_result_is_valid (res, NULL,
+      _stdio_relay_async), FALSE);
+
+  return !g_simple_async_result_propagate_error (G_SIMPLE_ASYNC_RESULT (res),
+      error);
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright (C) 2010 Xavier Claessens <xclaesse@gmail.com>
+ * Copyright (C) 2010 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA  02110-1301  USA
+ */
+
+#ifndef __STDIO_RELAY_H__
+#define __STDIO_RELAY_H__
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+void _stdio_relay_async (GSocketConnection *tube, GCancellable *cancellable,
+    GAsyncReadyCallback callback, gpointer user_data);
+
+gboolean _stdio_relay_finish (GAsyncResult *res, GError **error);
+
+G_END_DECLS
+
+#endif /* #ifndef __STDIO_RELAY_H__*/
@@ -0,0 +1,181 @@
+/*
+ * Copyright (C) 2010 Xavier Claessens <xclaesse@gmail.com>
+ * Copyright (C) 2010 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA  02110-1301  USA
+ */
+
+/* Opens and tears down thousands of fake sessions: the channels are plain
+ * GObjects and the tube and sshd connections are socketpairs. Checks the
+ * table size, the Session refcounts, and that no file descriptor leaks. */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <sys/socket.h>
+
+#include <gio/gio.h>
+
+#include "session-table.h"
+
+#define N_ROUNDS 50
+/* Each session holds 4 fds, stay well below the usual limit of 1024 */
+#define N_SESSIONS 100
+
+static guint
+count_fds (void)
+{
+  GDir *dir;
+  guint n = 0;
+
+  dir = g_dir_open ("/proc/self/fd", 0, NULL);
+  g_assert (dir != NULL);
+
+  while (g_dir_read_name (dir) != NULL)
+    n++;
+
+  g_dir_close (dir);
+
+  return n;
+}
+
+static GSocketConnection *
+connection_new (GSocket **peer)
+{
+  GSocket *socket;
+  GSocketConnection *connection;
+  gint fds[2];
+
+  g_assert_cmpint (socketpair (AF_UNIX, SOCK_STREAM, 0, fds), ==, 0);
+
+  socket = g_socket_new_from_fd (fds[0], NULL);
+  g_assert (socket != NULL);
+  *peer = g_socket_new_from_fd (fds[1], NULL);
+  g_assert (*peer != NULL);
+
+  connection = g_socket_connection_factory_create_connection (socket);
+  g_object_unref (socket);
+
+  return connection;
+}
+
+static void
+test_add_remove (void)
+{
+  SessionTable *table;
+  GObject *channels[N_SESSIONS];
+  Session *sessions[N_SESSIONS];
+  GSocket *peers[N_SESSIONS * 2];
+  guint fds;
+  guint round;
+  guint i;
+
+  table = _session_table_new ();
+  fds = count_fds ();
+
+  for (round = 0; round < N_ROUNDS; round++)
+    {
+      for (i = 0; i < N_SESSIONS; i++)
+        {
+          Session *session;
+
+          channels[i] = g_object_new (G_TYPE_OBJECT, NULL);
+          session = _session_table_add (table, (TpChannel *) channels[i]);
+          g_assert (session != NULL);
+          g_assert_cmpuint (session->ref_count, ==, 1);
+          g_assert (session->state == SESSION_STATE_PENDING);
+          g_assert (_session_table_lookup (table,
+              (TpChannel *) channels[i]) == session);
+          g_assert_cmpuint (_session_table_get_size (table), ==, i + 1);
+
+          session->tube_connection = connection_new (&peers[i * 2]);
+          session->sshd_connection = connection_new (&peers[i * 2 + 1]);
+          session->stats = _relay_stats_new ();
+
+          /* Like a pending operation would */
+          sessions[i] = _session_ref (session);
+          g_assert_cmpuint (session->ref_count, ==, 2);
+
+          /* The session must be what keeps the channel alive */
+          g_object_add_weak_pointer (channels[i], (gpointer *) &channels[i]);
+          g_object_unref (channels[i]);
+          g_assert (channels[i] != NULL);
+        }
+
+      for (i = 0; i < N_SESSIONS; i++)
+        {
+          Session *session = sessions[i];
+
+          _session_table_remove (table, (TpChannel *) channels[i]);
+          g_assert_cmpuint (_session_table_get_size (table), ==,
+              N_SESSIONS - i - 1);
+          g_assert (_session_table_lookup (table,
+              (TpChannel *) channels[i]) == NULL);
+
+          /* The pending operation still sees a cancelled, closed session */
+          g_assert_cmpuint (session->ref_count, ==, 1);
+          g_assert (session->state == SESSION_STATE_CLOSED);
+          g_assert (g_cancellable_is_cancelled (session->cancellable));
+          g_assert (channels[i] != NULL);
+
+          _session_unref (session);
+          g_assert (channels[i] == NULL);
+
+          g_object_unref (peers[i * 2]);
+          g_object_unref (peers[i * 2 + 1]);
+        }
+
+      g_assert_cmpuint (count_fds (), ==, fds);
+    }
+
+  /* Sessions left in the table are released with it */
+  for (i = 0; i < N_SESSIONS; i++)
+    {
+      Session *session;
+
+      channels[i] = g_object_new (G_TYPE_OBJECT, NULL);
+      session = _session_table_add (table, (TpChannel *) channels[i]);
+      session->tube_connection = connection_new (&peers[i * 2]);
+      session->sshd_connection = connection_new (&peers[i * 2 + 1]);
+
+      g_object_add_weak_pointer (channels[i], (gpointer *) &channels[i]);
+      g_object_unref (channels[i]);
+    }
+
+  g_assert_cmpuint (_session_table_get_size (table), ==, N_SESSIONS);
+  _session_table_free (table);
+
+  for (i = 0; i < N_SESSIONS; i++)
+    {
+      g_assert (channels[i] == NULL);
+      g_object_unref (peers[i * 2]);
+      g_object_unref (peers[i * 2 + 1]);
+    }
+
+  g_assert_cmpuint (count_fds (), ==, fds);
+}
+
+int
+main (int argc,
+    char **argv)
+{
+  g_type_init ();
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/session-table/add-remove", test_add_remove);
+
+  return g_test_run ();
+}
@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2010 Xavier Claessens <xclaesse@gmail.com>
+ * Copyright (C) 2010 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include <unistd.h>
+
+#include "trace.h"
+
+/* Setup phases are written in Chrome's trace event format, load the file in
+ * chrome://tracing or https://ui.perfetto.dev. Phases overlap (accounts are
+ * prepared concurrently) so they are async events, each on its own row.
+ * Timestamps are g_get_monotonic_time() values. */
+
+static gchar *trace_path = NULL;
+static GString *trace_events = NULL;
+static guint trace_next_id = 1;
+
+void
+_trace_open (const gchar *path)
+{
+  g_return_if_fail (trace_path == NULL);
+
+  trace_path = g_strdup (path);
+  trace_events = g_string_new (NULL);
+}
+
+gboolean
+_trace_enabled (void)
+{
+  return trace_events != NULL;
+}
+
+/* JSON string escaping, UTF-8 is kept as is */
+static void
+trace_append_string (const gchar *str)
+{
+  const gchar *p;
+
+  g_string_append_c (trace_events, '"');
+  for (p = str; *p != '\0'; p++)
+    {
+      if (*p == '"' || *p == '\\')
+        g_string_append_printf (trace_events, "\\%c", *p);
+      else if ((guchar) *p < 0x20)
+        g_string_append_printf (trace_events, "\\u%04x", (guchar) *p);
+      else
+        g_string_append_c (trace_events, *p);
+    }
+  g_string_append_c (trace_events, '"');
+}
+
+static void
+trace_append_event (const gchar *name,
+    const gchar *detail,
+    const gchar *phase,
+    guint id,
+    gint64 timestamp)
+{
+  if (trace_events->len > 0)
+    g_string_append (trace_events, ",\n");
+
+  g_string_append (trace_events, "{\"name\":");
+  trace_append_string (name);
+  g_string_append_printf (trace_events,
+      ",\"cat\":\"setup\",\"ph\":\"%s\",\"id\":%u,"
+      "\"ts\":%" G_GINT64_FORMAT ",\"pid\":%d,\"tid\":%d",
+      phase, id, timestamp, getpid (), getpid ());
+
+  if (detail != NULL)
+    {
+      g_string_append (trace_events, ",\"args\":{\"detail\":");
+      trace_append_string (detail);
+      g_string_append_c (trace_events, '}');
+    }
+
+  g_string_append_c (trace_events, '}');
+}
+
+/* Record that @name took from @start to @end */
+void
+_trace_phase (const gchar *name,
+    const gchar *detail,
+    gint64 start,
+    gint64 end)
+{
+  guint id;
+
+  if (trace_events == NULL)
+    return;
+
+  id = trace_next_id++;
+  trace_append_event (name, detail, "b", id, start);
+  trace_append_event (name, NULL, "e", id, end);
+}
+
+void
+_trace_instant (const gchar *name,
+    const gchar *detail)
+{
+  if (trace_events == NULL)
+    return;
+
+  trace_append_event (name, detail, "n", trace_next_id++,
+      g_get_monotonic_time ());
+}
+
+gboolean
+_trace_close (GError **error)
+{
+  gchar *contents;
+  gboolean success;
+
+  if (trace_events == NULL)
+    return TRUE;
+
+  contents = g_strdup_printf ("{\"traceEvents\":[\n%s\n],"
+      "\"displayTimeUnit\":\"ms\"}\n", trace_events->str);
+  success = g_file_set_contents (trace_path, contents, -1, error);
+  g_free (contents);
+
+  g_string_free (trace_events, TRUE);
+  trace_events = NULL;
+  g_free (trace_path);
+  trace_path = NULL;
+
+  return success;
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2010 Xavier Claessens <xclaesse@gmail.com>
+ * Copyright (C) 2010 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA  02110-1301  USA
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+void _trace_open (const gchar *path);
+
+gboolean _trace_close (GError **error);
+
+gboolean _trace_enabled (void);
+
+void _trace_phase (const gchar *name, const gchar *detail, gint64 start,
+    gint64 end);
+
+void _trace_instant (const gchar *name, const gchar *detail);
+
+G_END_DECLS
+
+#endif /* #ifndef __TRACE_H__*/
@@ -0,0 +1,430 @@
+/*
+ * Copyright (C) 2010 Xavier Claessens <xclaesse@gmail.com>
+ * Copyright (C) 2010 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <sys/uio.h>
+
+#include <liburing.h>
+
+#include "uring.h"
+
+/* Each thread running relays has an io_uring. Operations queued while
+ * dispatching its main loop are submitted together with a single syscall,
+ * right before the loop polls again, and their completions are all reaped
+ * when the ring's fd becomes readable. One thread drives many relays for a
+ * few syscalls per loop iteration instead of a few per read or write. */
+
+/* Operations queued in one iteration above that are submitted in several
+ * batches */
+#define URING_ENTRIES 256
+
+/* Registered buffers of each ring. The kernel doesn't have to map them for
+ * each read and write, pumps that don't get one use regular buffers. */
+#define URING_N_BUFFERS 64
+
+struct _UringRing
+{
+  GSource source;
+  GPollFD pollfd;
+  struct io_uring ring;
+  gboolean initialized;
+
+  /* URING_N_BUFFERS buffers, NULL if they couldn't be registered */
+  guint8 *buffers;
+  /* Stack of the free ones' indexes */
+  gint *free_buffers;
+  guint n_free;
+};
+
+/* Set once we know the kernel can't do it, for all threads */
+static volatile gint unsupported = FALSE;
+
+static void
+uring_ring_submit (UringRing *self)
+{
+  gint ret;
+
+  if (io_uring_sq_ready (&self->ring) == 0)
+    return;
+
+  do
+    ret = io_uring_submit (&self->ring);
+  while (ret == -EINTR);
+
+  /* What wasn't submitted stays queued for the next iteration */
+  if (ret < 0)
+    g_debug ("Can't submit io_uring operations: %s", g_strerror (-ret));
+}
+
+static gboolean
+uring_source_prepare (GSource *source,
+    gint *timeout)
+{
+  UringRing *self = (UringRing *) source;
+
+  *timeout = -1;
+  uring_ring_submit (self);
+
+  return io_uring_cq_ready (&self->ring) > 0;
+}
+
+static gboolean
+uring_source_check (GSource *source)
+{
+  UringRing *self = (UringRing *) source;
+
+  return io_uring_cq_ready (&self->ring) > 0;
+}
+
+static gboolean
+uring_source_dispatch (GSource *source,
+    GSourceFunc callback,
+    gpointer user_data)
+{
+  UringRing *self = (UringRing *) source;
+  struct io_uring_cqe *cqe;
+
+  while (io_uring_peek_cqe (&self->ring, &cqe) == 0)
+    {
+      UringOp *op = io_uring_cqe_get_data (cqe);
+      gint res = cqe->res;
+
+      io_uring_cqe_seen (&self->ring, cqe);
+
+      /* Cancellation requests have no op */
+      if (op == NULL)
+        continue;
+
+      /* @op can be queued again, or freed, from there */
+      op->pending = FALSE;
+      op->func (res, op->user_data);
+    }
+
+  return TRUE;
+}
+
+static void
+uring_source_finalize (GSource *source)
+{
+  UringRing *self = (UringRing *) source;
+
+  /* That unregisters the buffers too */
+  if (self->initialized)
+    io_uring_queue_exit (&self->ring);
+
+  g_free (self->buffers);
+  g_free (self->free_buffers);
+}
+
+static GSourceFuncs uring_source_funcs = {
+  uring_source_prepare,
+  uring_source_check,
+  uring_source_dispatch,
+  uring_source_finalize,
+};
+
+static void
+uring_ring_free (UringRing *self)
+{
+  g_source_destroy ((GSource *) self);
+  g_source_unref ((GSource *) self);
+}
+
+static GPrivate ring_key = G_PRIVATE_INIT ((GDestroyNotify) uring_ring_free);
+
+/* Opcodes appeared in different kernel versions, the ring can exist without
+ * those we need */
+static gboolean
+uring_ring_probe (UringRing *self)
+{
+  struct io_uring_probe *probe;
+  gboolean supported;
+
+  /* Probing itself came with IORING_OP_READ, in Linux 5.6 */
+  probe = io_uring_get_probe_ring (&self->ring);
+  if (probe == NULL)
+    return FALSE;
+
+  supported = io_uring_opcode_supported (probe, IORING_OP_POLL_ADD) &&
+      io_uring_opcode_supported (probe, IORING_OP_ASYNC_CANCEL) &&
+      io_uring_opcode_supported (probe, IORING_OP_READ) &&
+      io_uring_opcode_supported (probe, IORING_OP_WRITE) &&
+      io_uring_opcode_supported (probe, IORING_OP_READ_FIXED) &&
+      io_uring_opcode_supported (probe, IORING_OP_WRITE_FIXED);
+  io_uring_free_probe (probe);
+
+  return supported;
+}
+
+static void
+uring_ring_register_buffers (UringRing *self)
+{
+  struct iovec iovecs[URING_N_BUFFERS];
+  gint ret;
+  guint i;
+
+  self->buffers = g_malloc (URING_N_BUFFERS * URING_BUFFER_SIZE);
+  for (i = 0; i < URING_N_BUFFERS; i++)
+    {
+      iovecs[i].iov_base = self->buffers + i * URING_BUFFER_SIZE;
+      iovecs[i].iov_len = URING_BUFFER_SIZE;
+    }
+
+  ret = io_uring_register_buffers (&self->ring, iovecs, URING_N_BUFFERS);
+  if (ret < 0)
+    {
+      /* They are pinned, that counts against RLIMIT_MEMLOCK */
+      g_debug ("Can't register io_uring buffers, relaying without: %s",
+          g_strerror (-ret));
+      g_free (self->buffers);
+      self->buffers = NULL;
+      return;
+    }
+
+  self->free_buffers = g_new (gint, URING_N_BUFFERS);
+  for (i = 0; i < URING_N_BUFFERS; i++)
+    self->free_buffers[i] = URING_N_BUFFERS - 1 - i;
+  self->n_free = URING_N_BUFFERS;
+}
+
+static UringRing *
+uring_ring_new (void)
+{
+  GSource *source;
+  UringRing *self;
+  gint ret;
+
+  source = g_source_new (&uring_source_funcs, sizeof (UringRing));
+  self = (UringRing *) source;
+
+  ret = io_uring_queue_init (URING_ENTRIES, &self->ring, 0);
+  if (ret < 0)
+    {
+      /* ENOSYS before Linux 5.1, EPERM when disabled by sysctl or a
+       * seccomp filter */
+      g_debug ("io_uring not available: %s", g_strerror (-ret));
+      goto ERROR;
+    }
+  self->initialized = TRUE;
+
+  if (!uring_ring_probe (self))
+    {
+      g_debug ("io_uring lacks operations needed by the relay");
+      goto ERROR;
+    }
+
+  uring_ring_register_buffers (self);
+
+  /* The ring's fd is readable when it has completions */
+  self->pollfd.fd = self->ring.ring_fd;
+  self->pollfd.events = G_IO_IN;
+  g_source_add_poll (source, &self->pollfd);
+  g_source_attach (source, g_main_context_get_thread_default ());
+
+  return self;
+
+ERROR:
+  g_source_unref (source);
+  return NULL;
+}
+
+/* Returns the calling thread's ring, created on first use, or NULL if the
+ * kernel doesn't support io_uring. The caller must then use another way. */
+UringRing *
+_uring_ring_get (void)
+{
+  UringRing *self;
+
+  if (g_atomic_int_get (&unsupported))
+    return NULL;
+
+  self = g_private_get (&ring_key);
+  if (self != NULL)
+    return self;
+
+  self = uring_ring_new ();
+  if (self == NULL)
+    {
+      g_atomic_int_set (&unsupported, TRUE);
+      return NULL;
+    }
+
+  g_private_set (&ring_key, self);
+
+  return self;
+}
+
+void
+_uring_op_init (UringOp *op,
+    UringFunc func,
+    gpointer user_data)
+{
+  op->func = func;
+  op->user_data = user_data;
+  op->pending = FALSE;
+}
+
+/* Returns a registered buffer of URING_BUFFER_SIZE bytes, or NULL and -1 as
+ * @index when they are all in use */
+guint8 *
+_uring_ring_alloc_buffer (UringRing *self,
+    gint *index)
+{
+  if (self->n_free == 0)
+    {
+      *index = -1;
+      return NULL;
+    }
+
+  *index = self->free_buffers[--self->n_free];
+
+  return self->buffers + (gsize) *index * URING_BUFFER_SIZE;
+}
+
+void
+_uring_ring_release_buffer (UringRing *self,
+    gint index)
+{
+  g_return_if_fail (index >= 0 && index < URING_N_BUFFERS);
+
+  self->free_buffers[self->n_free++] = index;
+}
+
+/* Returns NULL if the queue is still full after submitting it */
+static struct io_uring_sqe *
+uring_ring_queue (UringRing *self,
+    UringOp *op)
+{
+  struct io_uring_sqe *sqe;
+
+  g_return_val_if_fail (!op->pending, NULL);
+
+  sqe = io_uring_get_sqe (&self->ring);
+  if (sqe == NULL)
+    {
+      uring_ring_submit (self);
+      sqe = io_uring_get_sqe (&self->ring);
+    }
+
+  if (sqe == NULL)
+    return NULL;
+
+  io_uring_sqe_set_data (sqe, op);
+  op->pending = TRUE;
+
+  return sqe;
+}
+
+/* Wait for @fd to get @condition. Operations are submitted once the
+ * thread's main loop is done dispatching, returns FALSE if @op can't be
+ * queued. */
+gboolean
+_uring_ring_poll (UringRing *self,
+    UringOp *op,
+    gint fd,
+    GIOCondition condition)
+{
+  struct io_uring_sqe *sqe;
+
+  sqe = uring_ring_queue (self, op);
+  if (sqe == NULL)
+    return FALSE;
+
+  /* GIOCondition values are the poll() ones */
+  io_uring_prep_poll_add (sqe, fd, condition);
+
+  return TRUE;
+}
+
+/* Read at most @len bytes to @buffer, registered buffer @index or -1 */
+gboolean
+_uring_ring_read (UringRing *self,
+    UringOp *op,
+    gint fd,
+    guint8 *buffer,
+    gsize len,
+    gint index)
+{
+  struct io_uring_sqe *sqe;
+
+  sqe = uring_ring_queue (self, op);
+  if (sqe == NULL)
+    return FALSE;
+
+  if (index >= 0)
+    io_uring_prep_read_fixed (sqe, fd, buffer, len, 0, index);
+  else
+    io_uring_prep_read (sqe, fd, buffer, len, 0);
+
+  return TRUE;
+}
+
+gboolean
+_uring_ring_write (UringRing *self,
+    UringOp *op,
+    gint fd,
+    const guint8 *buffer,
+    gsize len,
+    gint index)
+{
+  struct io_uring_sqe *sqe;
+
+  sqe = uring_ring_queue (self, op);
+  if (sqe == NULL)
+    return FALSE;
+
+  if (index >= 0)
+    io_uring_prep_write_fixed (sqe, fd, buffer, len, 0, index);
+  else
+    io_uring_prep_write (sqe, fd, buffer, len, 0);
+
+  return TRUE;
+}
+
+/* @op's function still gets called, with -ECANCELED unless it completed
+ * in the meantime */
+void
+_uring_ring_cancel (UringRing *self,
+    UringOp *op)
+{
+  struct io_uring_sqe *sqe;
+
+  if (!op->pending)
+    return;
+
+  sqe = io_uring_get_sqe (&self->ring);
+  if (sqe == NULL)
+    {
+      uring_ring_submit (self);
+      sqe = io_uring_get_sqe (&self->ring);
+    }
+
+  if (sqe == NULL)
+    {
+      /* Reads and writes complete anyway, only a poll could wait forever */
+      g_debug ("Can't cancel io_uring operation, queue is full");
+      return;
+    }
+
+  io_uring_prep_cancel (sqe, op, 0);
+  io_uring_sqe_set_data (sqe, NULL);
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2010 Xavier Claessens <xclaesse@gmail.com>
+ * Copyright (C) 2010 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA  02110-1301  USA
+ */
+
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <glib.h>
+
+#include "scheduler.h"
+
+G_BEGIN_DECLS
+
+/* Size of registered buffers, a turn never moves more than that */
+#define URING_BUFFER_SIZE SCHEDULER_QUANTUM
+
+typedef struct _UringRing UringRing;
+
+/* Called from the ring's thread with the operation's result, a negative
+ * errno on error */
+typedef void (*UringFunc) (gint res, gpointer user_data);
+
+/* An operation in flight, it must stay alive until its function is called,
+ * even when cancelled */
+typedef struct
+{
+  UringFunc func;
+  gpointer user_data;
+
+  /* private */
+  gboolean pending;
+} UringOp;
+
+UringRing *_uring_ring_get (void);
+
+void _uring_op_init (UringOp *op, UringFunc func, gpointer user_data);
+
+guint8 *_uring_ring_alloc_buffer (UringRing *ring, gint *index);
+
+void _uring_ring_release_buffer (UringRing *ring, gint index);
+
+gboolean _uring_ring_poll (UringRing *ring, UringOp *op, gint fd,
+    GIOCondition condition);
+
+gboolean _uring_ring_read (UringRing *ring, UringOp *op, gint fd,
+    guint8 *buffer, gsize len, gint index);
+
+gboolean _uring_ring_write (UringRing *ring, UringOp *op, gint fd,
+    const guint8 *buffer, gsize len, gint index);
+
+void _uring_ring_cancel (UringRing *ring, UringOp *op);
+
+G_END_DECLS
+
+#endif /* #ifndef __URING_H__*/
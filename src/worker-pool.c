@@ -0,0 +1,253 @@
+/*
+ * Copyright (C) 2010 Xavier Claessens <xclaesse@gmail.com>
+ * Copyright (C) 2010 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include "worker-pool.h"
+
+typedef struct
+{
+  guint id;
+  GThread *thread;
+  GMainContext *context;
+  GMainLoop *loop;
+  /* Number of relays running in this worker, atomic */
+  volatile gint n_sessions;
+} Worker;
+
+struct _WorkerPool
+{
+  Worker *workers;
+  guint n_workers;
+};
+
+typedef struct
+{
+  Worker *worker;
+  GIOStream *stream1;
+  GIOStream *stream2;
+  RelayEngine engine;
+  RelayStats *stats;
+  RateLimit *rate_limit;
+  GCancellable *cancellable;
+} RelayJob;
+
+static void
+relay_job_free (RelayJob *job)
+{
+  g_object_unref (job->stream1);
+  g_object_unref (job->stream2);
+  if (job->rate_limit != NULL)
+    _rate_limit_unref (job->rate_limit);
+  g_clear_object (&job->cancellable);
+
+  g_slice_free (RelayJob, job);
+}
+
+static gpointer
+worker_thread (gpointer user_data)
+{
+  Worker *worker = user_data;
+
+  /* Relay sources get attached to the thread-default context */
+  g_main_context_push_thread_default (worker->context);
+  g_main_loop_run (worker->loop);
+  g_main_context_pop_thread_default (worker->context);
+
+  return NULL;
+}
+
+static gboolean
+worker_quit_cb (gpointer user_data)
+{
+  Worker *worker = user_data;
+
+  g_main_loop_quit (worker->loop);
+
+  return FALSE;
+}
+
+WorkerPool *
+_worker_pool_new (guint n_workers)
+{
+  WorkerPool *pool;
+  guint i;
+
+  if (n_workers == 0)
+    return NULL;
+
+  pool = g_slice_new0 (WorkerPool);
+  pool->n_workers = n_workers;
+  pool->workers = g_new0 (Worker, n_workers);
+
+  for (i = 0; i < n_workers; i++)
+    {
+      Worker *worker = &pool->workers[i];
+      gchar *name;
+
+      worker->id = i;
+      worker->context = g_main_context_new ();
+      worker->loop = g_main_loop_new (worker->context, FALSE);
+
+      name = g_strdup_printf ("relay-%u", i);
+      worker->thread = g_thread_new (name, worker_thread, worker);
+      g_free (name);
+    }
+
+  return pool;
+}
+
+void
+_worker_pool_free (WorkerPool *pool)
+{
+  guint i;
+
+  if (pool == NULL)
+    return;
+
+  for (i = 0; i < pool->n_workers; i++)
+    {
+      Worker *worker = &pool->workers[i];
+
+      g_main_context_invoke (worker->context, worker_quit_cb, worker);
+      g_thread_join (worker->thread);
+
+      g_main_loop_unref (worker->loop);
+      g_main_context_unref (worker->context);
+    }
+
+  g_free (pool->workers);
+  g_slice_free (WorkerPool, pool);
+}
+
+static Worker *
+worker_pool_pick (WorkerPool *pool)
+{
+  Worker *best = NULL;
+  gint best_load = G_MAXINT;
+  guint i;
+
+  for (i = 0; i < pool->n_workers; i++)
+    {
+      gint load = g_atomic_int_get (&pool->workers[i].n_sessions);
+
+      if (load < best_load)
+        {
+          best = &pool->workers[i];
+          best_load = load;
+        }
+    }
+
+  return best;
+}
+
+/* Called in the worker thread when the relay is over */
+static void
+worker_relay_cb (GObject *source_object,
+    GAsyncResult *res,
+    gpointer user_data)
+{
+  GSimpleAsyncResult *simple = user_data;
+  RelayJob *job;
+  GError *error = NULL;
+
+  job = g_simple_async_result_get_op_res_gpointer (simple);
+
+  if (!_relay_splice_finish (res, &error))
+    g_simple_async_result_take_error (simple, error);
+
+  if (job->worker != NULL)
+    g_atomic_int_add (&job->worker->n_sessions, -1);
+
+  /* Calls back in the thread where _worker_pool_relay_async() was called */
+  g_simple_async_result_complete_in_idle (simple);
+  g_object_unref (simple);
+}
+
+static gboolean
+worker_start_relay_cb (gpointer user_data)
+{
+  GSimpleAsyncResult *simple = user_data;
+  RelayJob *job;
+
+  job = g_simple_async_result_get_op_res_gpointer (simple);
+
+  _relay_splice_async (job->stream1, job->stream2, job->engine, job->stats,
+      job->rate_limit, job->cancellable, worker_relay_cb, simple);
+
+  return FALSE;
+}
+
+void
+_worker_pool_relay_async (WorkerPool *pool,
+    GIOStream *stream1,
+    GIOStream *stream2,
+    RelayEngine engine,
+    RelayStats *stats,
+    RateLimit *rate_limit,
+    GCancellable *cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data)
+{
+  GSimpleAsyncResult *simple;
+  RelayJob *job;
+
+  simple = g_simple_async_result_new (NULL, callback, user_data,
+      _worker_pool_relay_async);
+
+  job = g_slice_new0 (RelayJob);
+  job->stream1 = g_object_ref (stream1);
+  job->stream2 = g_object_ref (stream2);
+  job->engine = engine;
+  job->stats = stats;
+  if (rate_limit != NULL)
+    job->rate_limit = _rate_limit_ref (rate_limit);
+  if (cancellable != NULL)
+    job->cancellable = g_object_ref (cancellable);
+  g_simple_async_result_set_op_res_gpointer (simple, job,
+      (GDestroyNotify) relay_job_free);
+
+  /* Without workers, relay in the calling thread */
+  if (pool == NULL)
+    {
+      worker_start_relay_cb (simple);
+      return;
+    }
+
+  job->worker = worker_pool_pick (pool);
+  g_atomic_int_inc (&job->worker->n_sessions);
+
+  g_debug ("Relaying on worker %u (%d sessions)", job->worker->id,
+      g_atomic_int_get (&job->worker->n_sessions));
+
+  g_main_context_invoke (job->worker->context, worker_start_relay_cb,
+      simple);
+}
+
+gboolean
+_worker_pool_relay_finish (GAsyncResult *res,
+    GError **error)
+{
+  g_return_val_if_fail (g_simple_async_result_is_valid (res, NULL,
+      _worker_pool_relay_async), FALSE);
+
+  return !g_simple_async_result_propagate_error (G_SIMPLE_ASYNC_RESULT (res),
+      error);
+}